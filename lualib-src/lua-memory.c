@@ -3,6 +3,7 @@
 #include <lauxlib.h>
 
 #include "malloc_hook.h"
+#include "skynet_payload.h"
 
 static int
 ltotal(lua_State *L) {
@@ -34,6 +35,95 @@ ldump(lua_State *L) {
 	return 0;
 }
 
+// memory.limit(handle, soft, hard) : limits in bytes, 0 means no limit
+static int
+llimit(lua_State *L) {
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 1);
+	size_t soft = (size_t)luaL_optinteger(L, 2, 0);
+	size_t hard = (size_t)luaL_optinteger(L, 3, 0);
+	if (malloc_limit(handle, soft, hard)) {
+		return luaL_error(L, "Can't set the memory limit of :%08x", handle);
+	}
+	return 0;
+}
+
+// memory.service(handle) : current, peak, soft limit, hard limit
+static int
+lservice(lua_State *L) {
+	uint32_t handle = (uint32_t)luaL_checkinteger(L, 1);
+	struct malloc_handle_stat stat;
+	if (malloc_handle_memory(handle, &stat)) {
+		return 0;
+	}
+	lua_pushinteger(L, stat.allocated);
+	lua_pushinteger(L, stat.peak);
+	lua_pushinteger(L, stat.soft);
+	lua_pushinteger(L, stat.hard);
+	return 4;
+}
+
+// memory.services() : { [handle] = { current, peak } }
+static int
+lservices(lua_State *L) {
+	uint32_t tmp[1024];
+	uint32_t *handles = tmp;
+	int sz = sizeof(tmp)/sizeof(tmp[0]);
+	int n = malloc_handle_list(handles, sz);
+	while (n > sz) {
+		// more services than the buffer, size it from the count (with room for the new ones) and retry.
+		// The userdata stays on the stack below the result, so the gc keeps it.
+		// 服务比缓冲区多，按数量重新分配(留出新服务的空间)再取一次，userdata留在栈上不会被回收
+		if (handles != tmp) {
+			lua_pop(L, 1);
+		}
+		sz = n + n / 4;
+		handles = lua_newuserdata(L, sz * sizeof(uint32_t));
+		n = malloc_handle_list(handles, sz);
+	}
+	int i;
+	lua_createtable(L, 0, n);
+	for (i=0;i<n;i++) {
+		struct malloc_handle_stat stat;
+		if (malloc_handle_memory(handles[i], &stat))
+			continue;
+		lua_createtable(L, 2, 0);
+		lua_pushinteger(L, stat.allocated);
+		lua_rawseti(L, -2, 1);
+		lua_pushinteger(L, stat.peak);
+		lua_rawseti(L, -2, 2);
+		lua_rawseti(L, -2, handles[i]);
+	}
+	return 1;
+}
+
+// statistics of the message payload allocator, hit is the share of allocations served by the caches
+static int
+lpayload(lua_State *L) {
+	struct skynet_payload_stat s;
+	skynet_payload_stat(&s);
+	lua_createtable(L, 0, 8);
+#define FIELD(f) lua_pushnumber(L, (lua_Number)s.f); lua_setfield(L, -2, #f);
+	FIELD(alloc_hit)
+	FIELD(alloc_depot)
+	FIELD(alloc_miss)
+	FIELD(alloc_large)
+	FIELD(free_cache)
+	FIELD(free_depot)
+	FIELD(free_release)
+#undef FIELD
+	uint64_t alloc = s.alloc_hit + s.alloc_depot + s.alloc_miss + s.alloc_large;
+	lua_pushnumber(L, alloc ? (lua_Number)(s.alloc_hit + s.alloc_depot) / alloc : 0);
+	lua_setfield(L, -2, "hit");
+	return 1;
+}
+
+// turn the payload caches on or off (payload_cache in config), returns the old state
+static int
+lpayload_cache(lua_State *L) {
+	lua_pushboolean(L, skynet_payload_enable(lua_toboolean(L, 1)));
+	return 1;
+}
+
 int
 luaopen_memory(lua_State *L) {
 	luaL_checkversion(L);
@@ -43,6 +133,11 @@ luaopen_memory(lua_State *L) {
 		{ "block", lblock },
 		{ "dumpinfo", ldumpinfo },
 		{ "dump", ldump },
+		{ "payload", lpayload },
+		{ "payload_cache", lpayload_cache },
+		{ "limit", llimit },
+		{ "service", lservice },
+		{ "services", lservices },
 		{ NULL, NULL },
 	};
 
@@ -5,6 +5,7 @@
  */
 
 #include "skynet_malloc.h"
+#include "skynet_payload.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -470,7 +471,7 @@ unpack_one(lua_State *L, struct read_block *rb) {
 
 static void
 seri(lua_State *L, struct block *b, int len) {
-	uint8_t * buffer = skynet_malloc(len);
+	uint8_t * buffer = skynet_payload_alloc(len);	// it becomes a message payload
 	uint8_t * ptr = buffer;
 	int sz = len;
 	while(len>0) {
@@ -1,6 +1,7 @@
 //核心库， 封装 skynet 给 lua 使用
 #include "skynet.h"
 #include "lua-seri.h"//序列化库
+#include "skynet_payload.h"
 
 #define KNRM  "\x1B[0m"
 #define KRED  "\x1B[31m"
@@ -99,6 +100,7 @@ _callback(lua_State *L) {
 		skynet_callback(context, gL, forward_cb);
 	} else {
 		skynet_callback(context, gL, _cb);//重新设置上下文的回调函数
+		skynet_callback_shared(context, 1);//_cb返回后消息就被释放了，不会保留消息，可以直接收到批量发送的共享数据
 	}
 
 	return 0;
@@ -207,6 +209,55 @@ _send(lua_State *L) {
 	return 1;
 }
 
+/*
+	参数：
+		1. table destinations，数字地址的数组
+		2. integer type，消息类型id
+		3. string message或者lightuserdata message_ptr
+		4. integer len
+	返回成功投递的目的地数
+ */
+static int
+_send_batch(lua_State *L) {
+	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int n = lua_rawlen(L, 1);
+	uint32_t * dest = lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(uint32_t));//由gc回收
+	int i;
+	for (i=0;i<n;i++) {
+		lua_rawgeti(L, 1, i+1);
+		dest[i] = lua_tounsigned(L, -1);
+		if (dest[i] == 0) {
+			return luaL_error(L, "skynet.send_batch invalid address at %d", i+1);
+		}
+		lua_pop(L, 1);
+	}
+	int type = luaL_checkinteger(L, 2);
+	int count;
+	int mtype = lua_type(L,3);
+	switch (mtype) {
+	case LUA_TSTRING: {
+		size_t len = 0;
+		void * msg = (void *)lua_tolstring(L,3,&len);
+		if (len == 0) {
+			msg = NULL;
+		}
+		count = skynet_send_batch(context, 0, dest, n, type, msg, len);
+		break;
+	}
+	case LUA_TLIGHTUSERDATA: {
+		void * msg = lua_touserdata(L,3);
+		int size = luaL_checkinteger(L,4);
+		count = skynet_send_batch(context, 0, dest, n, type | PTYPE_TAG_DONTCOPY, msg, size);
+		break;
+	}
+	default:
+		return luaL_error(L, "skynet.send_batch invalid param %s", lua_typename(L,mtype));
+	}
+	lua_pushinteger(L, count);
+	return 1;
+}
+
 static int
 _redirect(lua_State *L) {
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
@@ -286,7 +337,7 @@ lpackstring(lua_State *L) {//pack字符串
 	char * str = (char *)lua_touserdata(L, -2);
 	int sz = lua_tointeger(L, -1);
 	lua_pushlstring(L, str, sz);
-	skynet_free(str);
+	skynet_payload_free(str);
 	return 1;
 }
 
@@ -300,7 +351,7 @@ ltrash(lua_State *L) {
 	case LUA_TLIGHTUSERDATA: {//如果是轻量级用户数据
 		void * msg = lua_touserdata(L,1);//取得指针
 		luaL_checkinteger(L,2);//取得内存块大小
-		skynet_free(msg);//释放内存
+		skynet_payload_free(msg);//释放内存
 		break;
 	}
 	default:
@@ -318,6 +369,7 @@ luaopen_skynet_core(lua_State *L) {
 		{ "send" , _send }, //发送消息函数
 		{ "genid", _genid },//生成一个唯一 session 号
 		{ "redirect", _redirect },
+		{ "send_batch", _send_batch },//同一条消息发送给多个目的地
 		{ "command" , _command },//执行命令
 		{ "error", _error },//报错
 		{ "tostring", _tostring },
@@ -15,6 +15,7 @@
 #include <arpa/inet.h>
 
 #include "skynet_socket.h"
+#include "socket_server.h"
 
 #define BACKLOG 32
 // 2 ** 12 == 4096
@@ -626,6 +627,45 @@ ludp_address(lua_State *L) {
 	return 2;
 }
 
+// writev is the number of writev calls flushing the write lists, writev_buffer the buffers given to them
+// stat() sums all the socket threads, stat(n) is the load of the nth socket thread
+static int
+lstat(lua_State *L) {
+	struct socket_server_stat stat;
+	int shard = skynet_socket_shard();
+	if (lua_isnoneornil(L, 1)) {
+		skynet_socket_stat(&stat);
+	} else {
+		int n = luaL_checkinteger(L, 1);
+		luaL_argcheck(L, n >= 1 && n <= shard, 1, "invalid socket thread");
+		skynet_socket_shard_stat(n-1, &stat);
+	}
+	lua_createtable(L, 0, 11);
+	lua_pushnumber(L, (lua_Number)stat.writev);
+	lua_setfield(L, -2, "writev");
+	lua_pushnumber(L, (lua_Number)stat.writev_buffer);
+	lua_setfield(L, -2, "writev_buffer");
+	lua_pushnumber(L, stat.writev ? (lua_Number)stat.writev_buffer / stat.writev : 0);
+	lua_setfield(L, -2, "buffers_per_writev");
+	lua_pushnumber(L, (lua_Number)stat.recvmmsg);
+	lua_setfield(L, -2, "recvmmsg");
+	lua_pushnumber(L, (lua_Number)stat.recvmmsg_packet);
+	lua_setfield(L, -2, "recvmmsg_packet");
+	lua_pushnumber(L, (lua_Number)stat.sendmmsg);
+	lua_setfield(L, -2, "sendmmsg");
+	lua_pushnumber(L, (lua_Number)stat.sendmmsg_packet);
+	lua_setfield(L, -2, "sendmmsg_packet");
+	lua_pushnumber(L, (lua_Number)stat.event);
+	lua_setfield(L, -2, "event");
+	lua_pushnumber(L, (lua_Number)stat.command);
+	lua_setfield(L, -2, "command");
+	lua_pushinteger(L, stat.socket);
+	lua_setfield(L, -2, "socket");
+	lua_pushinteger(L, shard);
+	lua_setfield(L, -2, "thread");
+	return 1;
+}
+
 int
 luaopen_socketdriver(lua_State *L) {
 	luaL_checkversion(L);
@@ -641,6 +681,7 @@ luaopen_socketdriver(lua_State *L) {
 		{ "header", lheader },
 
 		{ "unpack", lunpack },
+		{ "stat", lstat },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L,l);//创建一张表，将列表 l 的函数注册进去
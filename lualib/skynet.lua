@@ -30,6 +30,7 @@ local skynet = {
 	PTYPE_DEBUG = 9,
 	PTYPE_LUA = 10,
 	PTYPE_SNAX = 11,
+	PTYPE_MEMORY = 12,
 }
 
 -- code cache
@@ -281,13 +282,22 @@ function suspend(co, result, command, param, size) --当协程执行完当前请
 	dispatch_error_queue() --调度错误队列
 end
 
-function skynet.timeout(ti, func)--注册定时器 非阻塞API
+function skynet.timeout(ti, func)--注册定时器 非阻塞API，返回的会话可用于skynet.cancel_timeout
 	local session = c.command("TIMEOUT",tostring(ti)) --调用C库的执行命令函数(命令为注册定时器)
 	assert(session)
 	session = tonumber(session) --将会话串转为数字
-	local co = co_create(func) --创建一个协程,此时创建的协程并没有运行
 	assert(session_id_coroutine[session] == nil) --当前会话上没有对应的协程
-	session_id_coroutine[session] = co --保存协程
+	session_id_coroutine[session] = func --保存函数，到期时才创建协程，取消的定时器不占用协程
+	return session
+end
+
+-- cancel a timer of skynet.timeout, returns false if it has already expired (func will run)
+function skynet.cancel_timeout(session)
+	if session_id_coroutine[session] and c.command("CANCEL", tostring(session)) then
+		session_id_coroutine[session] = nil
+		return true
+	end
+	return false
 end
 
 function skynet.sleep(ti) --休眠ti个单位时间
@@ -302,6 +312,15 @@ function skynet.sleep(ti) --休眠ti个单位时间
 	end
 end
 
+-- same as skynet.timeout / skynet.sleep, but ti is in milliseconds (rounded up to the timer_resolution of the config)
+function skynet.timeout_ms(ms, func)
+	return skynet.timeout(string.format("%dms", ms), func)
+end
+
+function skynet.sleep_ms(ms)
+	return skynet.sleep(string.format("%dms", ms))
+end
+
 function skynet.yield()
 	return skynet.sleep("0")
 end
@@ -427,6 +446,13 @@ function skynet.send(addr, typename, ...) --非阻塞发送消息
 	return c.send(addr, p.id, 0 , p.pack(...)) --先用p.pack打包数据，然后调用c库发送消息
 end
 
+-- send the same message to an array of addresses, the payload is packed once and shared by local receivers
+-- returns the number of messages delivered
+function skynet.send_batch(addrs, typename, ...)
+	local p = proto[typename]
+	return c.send_batch(addrs, p.id, p.pack(...))
+end
+
 skynet.genid = assert(c.genid)
 
 skynet.redirect = function(dest,source,typename,...)
@@ -511,6 +537,17 @@ function skynet.dispatch_unknown_response(unknown)
 	return prev
 end
 
+-- the service crossed its soft memory limit (memory.limit or memory_soft_limit in config)
+local function memory_warning(used)
+	skynet.error(string.format("Memory warning %.2f M", used / 1048576))
+end
+
+function skynet.memory_warning(warning)
+	local prev = memory_warning
+	memory_warning = warning
+	return prev
+end
+
 local fork_queue = {} --创建的协程队列
 
 local tunpack = table.unpack
@@ -533,6 +570,9 @@ local function raw_dispatch_message(prototype, msg, sz, session, source, ...)
 			unknown_response(session, source, msg, sz) -- 未知的响应消息
 		else
 			session_id_coroutine[session] = nil --置空
+			if type(co) == "function" then --skynet.timeout的函数
+				co = co_create(co)
+			end
 			suspend(co, coroutine.resume(co, true, msg, sz)) --恢复正在等待响应的协程
 		end
 	else --其他服务发送来的请求
@@ -640,6 +680,13 @@ do
 		unpack = function(...) return ... end,
 		dispatch = _error_dispatch,
 	}
+
+	REG {
+		name = "memory", --服务的内存越过了软限制，消息是当前用量
+		id = skynet.PTYPE_MEMORY,
+		unpack = function(msg, sz) return tonumber(c.tostring(msg, sz)) end,
+		dispatch = function(_, _, used) memory_warning(used) end,
+	}
 end
 
 local init_func = {} --初始化函数表
@@ -739,11 +786,79 @@ function skynet.mqlen()
 	return tonumber(c.command "MQLEN")
 end
 
+function skynet.stat(what) --派发统计 mqlen/batch/cost/message
+	return tonumber(c.command("STAT", what))
+end
+
+-- priority class "high"/"normal"/"low" of current service, or of address if it's given
+-- without class, returns the priority class of current service
+function skynet.priority(class, address)
+	if class == nil then
+		return c.command "PRIORITY"
+	end
+	if address then
+		c.command("PRIORITY", skynet.address(address) .. " " .. class)
+	else
+		c.command("PRIORITY", class)
+	end
+end
+
+-- mailbox of the service (current one, or address) : cap (0 for unbounded) and the policy when it's full
+-- policy : "drop_newest", "drop_oldest", "error" (send fails, callers get an error) or "slowdown" (senders get backpressure)
+-- responses, errors and socket messages are always queued
+function skynet.mailbox(cap, policy, address)
+	if address then
+		c.command("MAILBOX", string.format("%s %d %s", skynet.address(address), cap, policy))
+	else
+		c.command("MAILBOX", string.format("%d %s", cap, policy))
+	end
+end
+
+-- how many times each mailbox policy of current service took effect
+function skynet.mailbox_stat()
+	local drop_newest, drop_oldest, err, slowdown = c.command("MAILBOX", "stat"):match "(%d+) (%d+) (%d+) (%d+)"
+	return {
+		drop_newest = tonumber(drop_newest),
+		drop_oldest = tonumber(drop_oldest),
+		error = tonumber(err),
+		slowdown = tonumber(slowdown),
+	}
+end
+
+-- the number of slowdown signals from full mailboxes since last call, a sender should slow down if it's not 0
+function skynet.backpressure()
+	return tonumber(c.command("MAILBOX", "backpressure"))
+end
+
+-- run the service (current one, or address) on a dedicated thread, its queue never enters the run queues
+function skynet.dedicated(address)
+	if address then
+		c.command("DEDICATED", skynet.address(address))
+	else
+		c.command "DEDICATED"
+	end
+end
+
+-- queueing delay of a priority class (from runnable to dispatch) : count, total ns, max ns
+-- it's measured only after skynet.priority_stat(true) or with priority_stat = true in config
+function skynet.priority_stat(class)
+	if type(class) == "boolean" then
+		c.command("PRIORITY", class and "stat on" or "stat off")
+		return
+	end
+	local count, delay, max = c.command("PRIORITY", "stat " .. class):match "(%d+) (%d+) (%d+)"
+	return tonumber(count), tonumber(delay), tonumber(max)
+end
+
 function skynet.task(ret)
 	local t = 0
 	for session,co in pairs(session_id_coroutine) do
 		if ret then
-			ret[session] = debug.traceback(co)
+			if type(co) == "function" then
+				ret[session] = "timeout " .. tostring(co)
+			else
+				ret[session] = debug.traceback(co)
+			end
 		end
 		t = t + 1
 	end
@@ -29,6 +29,10 @@ function dbgcmd.STAT()
 	local stat = {}
 	stat.mqlen = skynet.mqlen()
 	stat.task = skynet.task()
+	stat.batch = skynet.stat "batch"
+	stat.cost = skynet.stat "cost"
+	stat.message = skynet.stat "message"
+	stat.priority = skynet.priority()
 	skynet.ret(skynet.pack(stat))
 end
 
@@ -407,5 +407,6 @@ end
 
 socket.sendto = assert(driver.udp_send)
 socket.udp_address = assert(driver.udp_address)
+socket.stat = assert(driver.stat)
 
 return socket
@@ -1,5 +1,7 @@
 //加载 lua 编写的服务
 #include "skynet.h"
+#include "skynet_env.h"
+#include "skynet_arena.h"
 
 #include <lua.h>
 #include <lualib.h>
@@ -14,6 +16,7 @@
 struct snlua {
 	lua_State * L;//一个lua虚拟机
 	struct skynet_context * ctx;//skynet上下文
+	struct skynet_arena * arena;//虚拟机的内存池，配置lua_arena = true时使用
 };
 
 // LUA_CACHELIB may defined in patched lua for shared proto
@@ -165,14 +168,24 @@ _launch(struct skynet_context * context, void *ud, int type, int session, uint32
 
 int
 snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
-	int sz = strlen(args);//参数长度
-	char * tmp = skynet_malloc(sz);//分配内存存储参数
-	memcpy(tmp, args, sz);//拷贝参数数据 不包含"\0"
-	skynet_callback(ctx, l , _launch);//设置上下文回调函数
 	const char * self = skynet_command(ctx, "REG", NULL);//self为服务句柄号十六进制表示
 
 	//str to unsigned long  将字符串转换成无符号长整型数
 	uint32_t handle_id = strtoul(self+1, NULL, 16);//计算出该snlua服务的句柄号
+
+	// the lua state is created here, when the handle owning its memory is known
+	// 在这里创建虚拟机，这时已经知道它的内存计入哪个服务
+	const char * arena = skynet_getenv("lua_arena");
+	if (arena && strcmp(arena, "true") == 0) {
+		l->arena = skynet_arena_new(handle_id);
+		l->L = lua_newstate(skynet_arena_lalloc, l->arena);//创建一个使用内存池的虚拟机
+	} else {
+		l->L = lua_newstate(skynet_lalloc, (void *)(uintptr_t)handle_id);//创建一个虚拟机
+	}
+	int sz = strlen(args);//参数长度
+	char * tmp = skynet_malloc(sz);//分配内存存储参数
+	memcpy(tmp, args, sz);//拷贝参数数据 不包含"\0"
+	skynet_callback(ctx, l , _launch);//设置上下文回调函数
 	// it must be first message
 	// 发送第一个消息 其实第一个消息就是"bootstrap"
 	skynet_send(ctx, 0, handle_id, PTYPE_TAG_DONTCOPY,0, tmp, sz);//源地址为0，目的地址是自己，自己给自己发送一个消息
@@ -182,13 +195,17 @@ snlua_init(struct snlua *l, struct skynet_context *ctx, const char * args) {
 struct snlua *
 snlua_create(void) {
 	struct snlua * l = skynet_malloc(sizeof(*l));//先为snlua数据结构分配内存
-	memset(l,0,sizeof(*l));//清空内存
-	l->L = lua_newstate(skynet_lalloc, NULL);//创建一个虚拟机
+	memset(l,0,sizeof(*l));//清空内存，虚拟机在snlua_init中创建
 	return l;//返回snlua引用
 }
 
 void
 snlua_release(struct snlua *l) {
-	lua_close(l->L);//关闭虚拟机
+	if (l->L) {
+		lua_close(l->L);//关闭虚拟机
+	}
+	if (l->arena) {
+		skynet_arena_delete(l->arena);//一次释放内存池的所有内存
+	}
 	skynet_free(l);//释放snlua内存
 }
@@ -6,26 +6,30 @@
 
 #include "malloc_hook.h"
 #include "skynet.h"
+#include "skynet_server.h"
+#include "skynet_mq.h"
+#include "skynet_harbor.h"
 
 static size_t _used_memory = 0;
 static size_t _memory_block = 0;
 typedef struct _mem_data {
 	uint32_t handle;
 	ssize_t allocated;
+	ssize_t peak;		//分配的峰值
+	size_t soft;		//软限制，lua的分配越过它时通知服务，0表示没有限制
+	size_t hard;		//硬限制，lua的分配不能越过它，0表示没有限制
+	int warned;			//已经越过软限制并通知过服务了
 } mem_data;
 
 #define SLOT_SIZE 0x10000
 #define PREFIX_SIZE sizeof(uint32_t)
 
 static mem_data mem_stats[SLOT_SIZE];
+static size_t _default_soft = 0;
+static size_t _default_hard = 0;
 
-
-#ifndef NOUSE_JEMALLOC
-
-#include "jemalloc.h"
-
-static ssize_t*
-get_allocated_field(uint32_t handle) {
+static mem_data *
+get_mem_data(uint32_t handle) {
 	int h = (int)(handle & (SLOT_SIZE - 1));
 	mem_data *data = &mem_stats[h];
 	uint32_t old_handle = data->handle;
@@ -38,20 +42,38 @@ get_allocated_field(uint32_t handle) {
 		if (old_alloc < 0) {
 			__sync_bool_compare_and_swap(&data->allocated, old_alloc, 0);
 		}
+		if (old_handle != handle) {//新的服务接管这个槽，使用默认的限制
+			data->peak = 0;
+			data->soft = _default_soft;
+			data->hard = _default_hard;
+			data->warned = 0;
+		}
 	}
 	if(data->handle != handle) {
 		return 0;
 	}
-	return &data->allocated;
+	return data;
+}
+
+inline static void
+update_allocated(mem_data *data, ssize_t n) {
+	ssize_t allocated = __sync_add_and_fetch(&data->allocated, n);
+	if (allocated > data->peak) {
+		data->peak = allocated;
+	}
 }
 
+#ifndef NOUSE_JEMALLOC
+
+#include "jemalloc.h"
+
 inline static void 
 update_xmalloc_stat_alloc(uint32_t handle, size_t __n) {
 	__sync_add_and_fetch(&_used_memory, __n);
 	__sync_add_and_fetch(&_memory_block, 1); 
-	ssize_t* allocated = get_allocated_field(handle);
-	if(allocated) {
-		__sync_add_and_fetch(allocated, __n);
+	mem_data* data = get_mem_data(handle);
+	if(data) {
+		update_allocated(data, __n);
 	}
 }
 
@@ -59,9 +81,9 @@ inline static void
 update_xmalloc_stat_free(uint32_t handle, size_t __n) {
 	__sync_sub_and_fetch(&_used_memory, __n);
 	__sync_sub_and_fetch(&_memory_block, 1);
-	ssize_t* allocated = get_allocated_field(handle);
-	if(allocated) {
-		__sync_sub_and_fetch(allocated, __n);
+	mem_data* data = get_mem_data(handle);
+	if(data) {
+		__sync_sub_and_fetch(&data->allocated, __n);
 	}
 }
 
@@ -86,6 +108,25 @@ clean_prefix(char* ptr) {
 	return ptr;
 }
 
+void
+skynet_malloc_owner(void *ptr, uint32_t handle) {
+	size_t size = je_malloc_usable_size(ptr);
+	uint32_t *p = (uint32_t *)((char *)ptr + size - sizeof(uint32_t));
+	uint32_t old;
+	memcpy(&old, p, sizeof(old));
+	if (old == handle)
+		return;
+	mem_data *data = get_mem_data(old);
+	if (data) {
+		__sync_sub_and_fetch(&data->allocated, size);
+	}
+	data = get_mem_data(handle);
+	if (data) {
+		update_allocated(data, size);
+	}
+	memcpy(p, &handle, sizeof(handle));
+}
+
 static void malloc_oom(size_t size) {
 	fprintf(stderr, "xmalloc: Out of memory trying to allocate %zu bytes\n",
 		size);
@@ -181,6 +222,11 @@ mallctl_opt(const char* name, int* newval) {
 	return 0;
 }
 
+void
+skynet_malloc_owner(void *ptr, uint32_t handle) {
+	// the blocks are not counted per service without jemalloc
+}
+
 #endif
 
 size_t
@@ -202,12 +248,58 @@ dump_c_mem() {
 		mem_data* data = &mem_stats[i];
 		if(data->handle != 0 && data->allocated != 0) {
 			total += data->allocated;
-			skynet_error(NULL, "0x%x -> %zdkb", data->handle, data->allocated >> 10);
+			skynet_error(NULL, "0x%x -> %zdkb (peak %zdkb)", data->handle, data->allocated >> 10, data->peak >> 10);
 		}
 	}
 	skynet_error(NULL, "+total: %zdkb",total >> 10);
 }
 
+void
+malloc_limit_default(size_t soft, size_t hard) {
+	_default_soft = soft;
+	_default_hard = hard;
+}
+
+int
+malloc_limit(uint32_t handle, size_t soft, size_t hard) {
+	mem_data *data = get_mem_data(handle);
+	if (data == NULL)
+		return 1;
+	data->soft = soft;
+	data->hard = hard;
+	data->warned = 0;
+	return 0;
+}
+
+int
+malloc_handle_memory(uint32_t handle, struct malloc_handle_stat *stat) {
+	int h = (int)(handle & (SLOT_SIZE - 1));
+	mem_data *data = &mem_stats[h];
+	if (data->handle != handle)
+		return 1;
+	stat->allocated = data->allocated;
+	stat->peak = data->peak;
+	stat->soft = data->soft;
+	stat->hard = data->hard;
+	return 0;
+}
+
+int
+malloc_handle_list(uint32_t *handles, int n) {
+	int i;
+	int count = 0;
+	for(i=0; i<SLOT_SIZE; i++) {
+		mem_data* data = &mem_stats[i];
+		if(data->handle != 0 && data->allocated > 0) {
+			if (count < n) {
+				handles[count] = data->handle;
+			}
+			++count;
+		}
+	}
+	return count;
+}
+
 char *
 skynet_strdup(const char *str) {//将串拷贝到新建的位置处
 	size_t sz = strlen(str);//字符串大小
@@ -216,12 +308,87 @@ skynet_strdup(const char *str) {//将串拷贝到新建的位置处
 	return ret;//返回新串的地址
 }
 
+//通知服务它的内存越过了软限制，消息内容是当前的用量(字节数)
+static void
+memory_warning(uint32_t handle, ssize_t used) {
+	char tmp[32];
+	int sz = sprintf(tmp, "%zd", used);
+	struct skynet_message msg;
+	msg.source = 0;
+	msg.session = 0;
+	msg.data = skynet_strdup(tmp);
+	msg.sz = (size_t)sz | ((size_t)PTYPE_MEMORY << HANDLE_REMOTE_SHIFT);
+	msg.shared = 0;
+	if (skynet_context_push(handle, &msg)) {
+		skynet_free(msg.data);
+	}
+}
+
+// Check a lua allocation which grows the service by n bytes against its limits.
+// 检查一次让服务增长n字节的lua分配，越过硬限制返回0
+static int
+quota_check(mem_data *data, uint32_t handle, size_t n) {
+	size_t soft = data->soft;
+	size_t hard = data->hard;
+	if (soft == 0 && hard == 0)
+		return 1;
+	ssize_t used = data->allocated + (ssize_t)n;
+	if (hard && used > (ssize_t)hard)
+		return 0;
+	if (soft) {
+		if (used > (ssize_t)soft) {
+			if (!data->warned) {
+				data->warned = 1;
+				memory_warning(handle, used);
+			}
+		} else if (data->warned) {//回到软限制以下，下次越过时再通知
+			data->warned = 0;
+		}
+	}
+	return 1;
+}
+
+// Lua allocations belong to the service owning the lua state, which may not be the one dispatched on this thread
+// (e.g. lua_close when the service is released), 0 means the current service. Growing past its hard limit fails,
+// which raises a memory error in that lua state only. Without jemalloc, the hook doesn't count anything,
+// so the lua allocations are counted here.
+// lua的分配属于拥有这个虚拟机的服务，它不一定是本线程正在派发的服务(比如服务释放时的lua_close)，0表示当前服务。
+// 越过硬限制时分配失败，只在这个lua虚拟机里引发内存错误。没有jemalloc时钩子不做统计，所以在这里统计lua的分配
+int
+malloc_lua_account(uint32_t handle, ssize_t n, int check) {
+	if (handle == 0) {
+		handle = skynet_current_handle();
+	}
+	mem_data *data = get_mem_data(handle);
+	if (data == NULL)
+		return 1;
+	if (n > 0 && check && !quota_check(data, data->handle, n)) {
+		return 0;
+	}
+#ifdef NOUSE_JEMALLOC
+	if (n > 0) {
+		update_allocated(data, n);
+	} else {
+		__sync_add_and_fetch(&data->allocated, n);
+	}
+#endif
+	return 1;
+}
+
+// ud is the handle of the service owning the lua state, NULL for the current service
 void * 
 skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	uint32_t handle = (uint32_t)(uintptr_t)ud;
+	if (ptr == NULL) {
+		osize = 0;	// osize is the type of the new object
+	}
 	if (nsize == 0) {
 		skynet_free(ptr);
+		malloc_lua_account(handle, -(ssize_t)osize, 0);
+		return NULL;
+	}
+	if (!malloc_lua_account(handle, (ssize_t)nsize - (ssize_t)osize, 1)) {
 		return NULL;
-	} else {
-		return skynet_realloc(ptr, nsize);
 	}
+	return skynet_realloc(ptr, nsize);
 }
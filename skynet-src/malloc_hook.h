@@ -3,6 +3,15 @@
 #define __MALLOC_HOOK_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct malloc_handle_stat {
+	ssize_t allocated;	//当前用量
+	ssize_t peak;		//峰值
+	size_t soft;		//软限制，0表示没有
+	size_t hard;		//硬限制，0表示没有
+};
 
 extern size_t malloc_used_memory(void);
 extern size_t malloc_memory_block(void);
@@ -11,4 +20,16 @@ extern size_t mallctl_int64(const char* name, size_t* newval);
 extern int    mallctl_opt(const char* name, int* newval);
 extern void   dump_c_mem(void);
 
+// per service memory limits, 0 means no limit. Only lua allocations (skynet_lalloc) are refused past the hard limit.
+extern void   malloc_limit_default(size_t soft, size_t hard);
+extern int    malloc_limit(uint32_t handle, size_t soft, size_t hard);
+extern int    malloc_handle_memory(uint32_t handle, struct malloc_handle_stat *stat);
+// fills at most n handles, returns the number of all services using memory (may be more than n)
+extern int    malloc_handle_list(uint32_t *handles, int n);
+// a lua allocator grows (n > 0) or shrinks (n < 0) the service handle (0 for the current one),
+// returns 0 if the growth is refused
+extern int    malloc_lua_account(uint32_t handle, ssize_t n, int check);
+// move the charge of a skynet_malloc block to another service, 0 means no service
+extern void   skynet_malloc_owner(void *ptr, uint32_t handle);
+
 #endif /* __MALLOC_HOOK_H */
\ No newline at end of file
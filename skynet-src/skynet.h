@@ -24,6 +24,8 @@
 #define PTYPE_RESERVED_DEBUG 9
 #define PTYPE_RESERVED_LUA 10
 #define PTYPE_RESERVED_SNAX 11
+// a service crossed its soft memory limit, read skynet-src/malloc_hook.c
+#define PTYPE_MEMORY 12
 
 #define PTYPE_TAG_DONTCOPY 0x10000	//不要拷贝
 #define PTYPE_TAG_ALLOCSESSION 0x20000	//分配会话
@@ -40,6 +42,11 @@ int skynet_isremote(struct skynet_context *, uint32_t handle, int * harbor);
 
 typedef int (*skynet_cb)(struct skynet_context * context, void *ud, int type, int session, uint32_t source , const void * msg, size_t sz);
 void skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb);
+// the callback never keeps the message (always returns 0), so it can receive the shared payload of skynet_send_batch without a copy
+void skynet_callback_shared(struct skynet_context * context, int shared);
+
+// send the same message to n destinations (session 0), returns the number of messages delivered
+int skynet_send_batch(struct skynet_context * context, uint32_t source, const uint32_t * destination, int n, int type, void * msg, size_t sz);
 
 uint32_t skynet_current_handle(void);
 
@@ -0,0 +1,118 @@
+//线程的CPU亲和性和NUMA节点
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		//pthread_setaffinity_np
+#endif
+
+#include "skynet_affinity.h"
+#include "skynet_mq.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+//解析 "0-3,8,10-11" 格式的cpu列表，存入cpu中，返回cpu数量，格式错误返回-1
+int
+skynet_cpulist_parse(const char *str, int *cpu, int max) {
+	int n = 0;
+	const char *p = str;
+	while (*p) {
+		char *end;
+		if (!isdigit((unsigned char)*p))
+			return -1;
+		long from = strtol(p, &end, 10);
+		long to = from;
+		p = end;
+		if (*p == '-') {
+			++p;
+			if (!isdigit((unsigned char)*p))
+				return -1;
+			to = strtol(p, &end, 10);
+			p = end;
+		}
+		if (to < from)
+			return -1;
+		long i;
+		for (i=from;i<=to;i++) {
+			if (n >= max)
+				return -1;
+			cpu[n++] = (int)i;
+		}
+		if (*p == ',') {
+			++p;
+		} else if (*p == '\n' || *p == '\0') {
+			break;
+		} else {
+			return -1;
+		}
+	}
+	return n;
+}
+
+#if defined(__linux__)
+
+//读取 /sys/devices/system/node/node%d/cpulist
+int
+skynet_numa_cpulist(int node, int *cpu, int max) {
+	char path[64];
+	char buf[1024];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	if (fgets(buf, sizeof(buf), f) == NULL) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	int n = skynet_cpulist_parse(buf, cpu, max);
+	return n < 0 ? 0 : n;
+}
+
+//节点编号是连续的，没有cpu的节点(只有内存)不计入
+int
+skynet_numa_node_count(void) {
+	int cpu[MAX_AFFINITY_CPU];
+	int i;
+	for (i=0;i<MAX_NUMA_NODE;i++) {
+		if (skynet_numa_cpulist(i, cpu, MAX_AFFINITY_CPU) == 0)
+			break;
+	}
+	return i == 0 ? 1 : i;
+}
+
+int
+skynet_affinity_bind(pthread_t pid, const int *cpu, int n) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	int i;
+	for (i=0;i<n;i++) {
+		if (cpu[i] < 0 || cpu[i] >= CPU_SETSIZE)
+			return -1;
+		CPU_SET(cpu[i], &set);
+	}
+	return pthread_setaffinity_np(pid, sizeof(set), &set);
+}
+
+#else
+
+// Thread affinity and NUMA discovery are linux only, other platforms run as one node without pinning.
+// 其他平台不支持，作为一个节点运行，不绑定cpu
+
+int
+skynet_numa_cpulist(int node, int *cpu, int max) {
+	return 0;
+}
+
+int
+skynet_numa_node_count(void) {
+	return 1;
+}
+
+int
+skynet_affinity_bind(pthread_t pid, const int *cpu, int n) {
+	return -1;
+}
+
+#endif
@@ -0,0 +1,18 @@
+//线程的CPU亲和性和NUMA节点
+#ifndef skynet_affinity_h
+#define skynet_affinity_h
+
+#include <pthread.h>
+
+#define MAX_AFFINITY_CPU 1024	//cpu列表的最大长度
+
+// parse a cpu list like "0-3,8,10-11", returns the number of cpus or -1 for syntax error
+int skynet_cpulist_parse(const char *str, int *cpu, int max);
+// number of NUMA nodes which have cpus, 1 if unknown
+int skynet_numa_node_count(void);
+// cpu list of a NUMA node, returns the number of cpus
+int skynet_numa_cpulist(int node, int *cpu, int max);
+// bind a thread to a set of cpus, returns 0 on success
+int skynet_affinity_bind(pthread_t pid, const int *cpu, int n);
+
+#endif
@@ -0,0 +1,285 @@
+//lua虚拟机的内存池
+#include "skynet.h"
+#include "skynet_arena.h"
+#include "malloc_hook.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Small blocks (up to ARENA_SMALL bytes) are carved from chunks owned by the arena and recycled by free lists
+// of size classes. Lua always gives the old size, so the class of a block is known without a header.
+// Larger blocks go to skynet_malloc. When the free lists hold ARENA_TRIM bytes more than after the last trim,
+// the chunks whose blocks are all free are released (see arena_trim).
+// 小块(不超过ARENA_SMALL字节)从内存池的大块内存中切出，按大小类别用空闲链表回收。
+// lua总会给出旧的大小，所以不需要块头就能知道块的类别。更大的块使用skynet_malloc。
+// 空闲链表比上次整理后多出ARENA_TRIM字节时，释放所有块都空闲的大块内存
+#define ARENA_STEP 16
+#define ARENA_CLASS 32				// 16 ... 512
+#define ARENA_SMALL (ARENA_STEP * ARENA_CLASS)
+#define ARENA_CHUNK_MIN 0x1000		// the chunk size doubles up to ARENA_CHUNK_MAX
+#define ARENA_CHUNK_MAX 0x10000
+#define ARENA_TRIM 0x40000
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t free;					//整理时统计的空闲字节数
+};
+
+// the blocks of a chunk start after its header, keep them aligned
+#define ARENA_HEADER ((sizeof(struct arena_chunk) + ARENA_STEP - 1) / ARENA_STEP * ARENA_STEP)
+
+struct free_node {
+	struct free_node *next;
+};
+
+struct skynet_arena {
+	uint32_t owner;					//拥有虚拟机的服务，内存计入它
+	struct free_node *list[ARENA_CLASS];
+	char *ptr;						//最新的大块内存中未使用的部分
+	char *end;
+	struct arena_chunk *chunk;
+	int chunk_n;
+	size_t chunk_size;				//下一个大块内存的大小
+	size_t chunk_total;
+	size_t large;					//大块的字节数
+	size_t free;					//空闲链表中的字节数
+	size_t trim;					//空闲链表超过这个字节数时整理
+};
+
+struct skynet_arena *
+skynet_arena_new(uint32_t owner) {
+	struct skynet_arena *a = skynet_malloc(sizeof(*a));
+	memset(a, 0, sizeof(*a));
+	a->owner = owner;
+	a->chunk_size = ARENA_CHUNK_MIN;
+	a->trim = ARENA_TRIM;
+	return a;
+}
+
+void
+skynet_arena_delete(struct skynet_arena *a) {
+	struct arena_chunk *c = a->chunk;
+	while (c) {
+		struct arena_chunk *next = c->next;
+		skynet_free(c);
+		c = next;
+	}
+	malloc_lua_account(a->owner, -(ssize_t)a->chunk_total, 0);
+	skynet_free(a);
+}
+
+size_t
+skynet_arena_size(struct skynet_arena *a) {
+	return a->chunk_total + a->large;
+}
+
+static inline int
+size_class(size_t sz) {
+	return (int)((sz - 1) / ARENA_STEP);
+}
+
+static inline void
+small_free(struct skynet_arena *a, void *ptr, int c) {
+	struct free_node *n = (struct free_node *)ptr;
+	n->next = a->list[c];
+	a->list[c] = n;
+	a->free += (c + 1) * ARENA_STEP;
+}
+
+static int
+chunk_compar(const void *a, const void *b) {
+	const char *x = *(const char **)a;
+	const char *y = *(const char **)b;
+	return x < y ? -1 : x > y;
+}
+
+//二分查找块所在的大块内存，v按地址排序
+static struct arena_chunk *
+find_chunk(struct arena_chunk **v, int n, void *ptr) {
+	int begin = 0, end = n;
+	while (begin < end) {
+		int mid = (begin + end) / 2;
+		char *c = (char *)v[mid];
+		if ((char *)ptr < c) {
+			end = mid;
+		} else if ((char *)ptr >= c + v[mid]->size) {
+			begin = mid + 1;
+		} else {
+			return v[mid];
+		}
+	}
+	return NULL;
+}
+
+// Release the chunks whose blocks are all free : count the free bytes of each chunk by walking the free lists,
+// then drop the free blocks of the released chunks from the lists.
+// 释放所有块都空闲的大块内存：遍历空闲链表统计每个大块内存的空闲字节数，然后从链表中去掉被释放的大块内存中的块
+static void
+arena_trim(struct skynet_arena *a) {
+	int n = a->chunk_n;
+	struct arena_chunk **v = skynet_malloc(n * sizeof(*v));
+	struct arena_chunk *c;
+	int i = 0;
+	for (c = a->chunk; c; c = c->next) {
+		c->free = 0;
+		v[i++] = c;
+	}
+	if (a->chunk && a->ptr) {
+		a->chunk->free = a->end - a->ptr;	// the unused part of the newest chunk
+	}
+	qsort(v, n, sizeof(*v), chunk_compar);
+	for (i=0;i<ARENA_CLASS;i++) {
+		struct free_node *node;
+		for (node = a->list[i]; node; node = node->next) {
+			find_chunk(v, n, node)->free += (i + 1) * ARENA_STEP;
+		}
+	}
+	size_t release = 0;
+	for (i=0;i<n;i++) {
+		if (v[i]->free == v[i]->size - ARENA_HEADER) {
+			release += v[i]->size;
+		}
+	}
+	if (release > 0) {
+		for (i=0;i<ARENA_CLASS;i++) {
+			struct free_node **pn = &a->list[i];
+			while (*pn) {
+				c = find_chunk(v, n, *pn);
+				if (c->free == c->size - ARENA_HEADER) {
+					*pn = (*pn)->next;
+					a->free -= (i + 1) * ARENA_STEP;
+				} else {
+					pn = &(*pn)->next;
+				}
+			}
+		}
+		if (a->chunk && a->chunk->free == a->chunk->size - ARENA_HEADER) {
+			a->ptr = a->end = NULL;
+		}
+		struct arena_chunk **pc = &a->chunk;
+		while (*pc) {
+			c = *pc;
+			if (c->free == c->size - ARENA_HEADER) {
+				*pc = c->next;
+				--a->chunk_n;
+				a->chunk_total -= c->size;
+				skynet_free(c);
+			} else {
+				pc = &c->next;
+			}
+		}
+		malloc_lua_account(a->owner, -(ssize_t)release, 0);
+	}
+	skynet_free(v);
+	a->trim = a->free + ARENA_TRIM;
+}
+
+//新的大块内存，旧的剩余部分按能放下的最大类别放入空闲链表
+static int
+new_chunk(struct skynet_arena *a, int check) {
+	size_t sz = a->chunk_size;
+	if (!malloc_lua_account(a->owner, (ssize_t)sz, check)) {
+		return 0;
+	}
+	while (a->end - a->ptr >= ARENA_STEP) {
+		size_t left = a->end - a->ptr;
+		int c = left >= ARENA_SMALL ? ARENA_CLASS - 1 : size_class(left + 1) - 1;
+		small_free(a, a->ptr, c);
+		a->ptr += (c + 1) * ARENA_STEP;
+	}
+	struct arena_chunk *chunk = skynet_malloc(sz);
+	chunk->next = a->chunk;
+	chunk->size = sz;
+	a->chunk = chunk;
+	++a->chunk_n;
+	a->chunk_total += sz;
+	a->ptr = (char *)chunk + ARENA_HEADER;
+	a->end = (char *)chunk + sz;
+	if (a->chunk_size < ARENA_CHUNK_MAX) {
+		a->chunk_size *= 2;
+	}
+	return 1;
+}
+
+// check is 0 when a block shrinks, lua doesn't allow it to fail
+static void *
+small_alloc(struct skynet_arena *a, int c, int check) {
+	struct free_node *n = a->list[c];
+	if (n) {
+		a->list[c] = n->next;
+		a->free -= (c + 1) * ARENA_STEP;
+		return n;
+	}
+	size_t sz = (c + 1) * ARENA_STEP;
+	if ((size_t)(a->end - a->ptr) < sz && !new_chunk(a, check)) {
+		return NULL;
+	}
+	void *ret = a->ptr;
+	a->ptr += sz;
+	return ret;
+}
+
+static void
+large_free(struct skynet_arena *a, void *ptr, size_t sz) {
+	skynet_free(ptr);
+	a->large -= sz;
+	malloc_lua_account(a->owner, -(ssize_t)sz, 0);
+}
+
+void *
+skynet_arena_lalloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct skynet_arena *a = ud;
+	if (ptr == NULL) {
+		osize = 0;	// osize is the type of the new object
+	}
+	if (nsize == 0) {
+		if (ptr) {
+			if (osize <= ARENA_SMALL) {
+				small_free(a, ptr, size_class(osize));
+				if (a->free > a->trim) {
+					arena_trim(a);
+				}
+			} else {
+				large_free(a, ptr, osize);
+			}
+		}
+		return NULL;
+	}
+	if (nsize <= ARENA_SMALL) {
+		int c = size_class(nsize);
+		if (ptr && osize <= ARENA_SMALL && size_class(osize) == c) {
+			return ptr;
+		}
+		void *ret = small_alloc(a, c, nsize > osize);
+		if (ret == NULL) {
+			return NULL;
+		}
+		if (ptr) {
+			memcpy(ret, ptr, osize < nsize ? osize : nsize);
+			if (osize <= ARENA_SMALL) {
+				small_free(a, ptr, size_class(osize));
+			} else {
+				large_free(a, ptr, osize);
+			}
+		}
+		return ret;
+	}
+	size_t old = osize > ARENA_SMALL ? osize : 0;	// a small block is counted in its chunk
+	if (!malloc_lua_account(a->owner, (ssize_t)nsize - (ssize_t)old, nsize > old)) {
+		return NULL;
+	}
+	void *ret;
+	if (old) {
+		ret = skynet_realloc(ptr, nsize);
+		a->large -= osize;
+	} else {
+		ret = skynet_malloc(nsize);
+		if (ptr) {
+			memcpy(ret, ptr, osize);
+			small_free(a, ptr, size_class(osize));
+		}
+	}
+	a->large += nsize;
+	return ret;
+}
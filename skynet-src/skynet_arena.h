@@ -0,0 +1,19 @@
+//lua虚拟机的内存池
+#ifndef skynet_arena_h
+#define skynet_arena_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct skynet_arena;
+
+// the memory is charged to the service owner (see malloc_lua_account)
+struct skynet_arena * skynet_arena_new(uint32_t owner);
+// call it after lua_close, the chunks are released at once
+void skynet_arena_delete(struct skynet_arena *a);
+// lua_Alloc, ud is the arena. A lua state is used by one thread at a time, so there is no lock.
+void * skynet_arena_lalloc(void *ud, void *ptr, size_t osize, size_t nsize);
+// bytes of the chunks and of the large blocks
+size_t skynet_arena_size(struct skynet_arena *a);
+
+#endif
@@ -68,6 +68,7 @@ skynet_error(struct skynet_context * context, const char *msg, ...) {
 	smsg.session = 0;//会话为0
 	smsg.data = data;//数据为上面的data
 	smsg.sz = len | (PTYPE_TEXT << HANDLE_REMOTE_SHIFT);//高8位为消息编码的协议类型
+	smsg.shared = 0;
 	skynet_context_push(logger, &smsg);//将消息push到上下文内的消息队列
 }
 
@@ -10,31 +10,102 @@
 #include <string.h>
 
 #define DEFAULT_SLOT_SIZE 4
+#define MIGRATE_STEP 16	// old slots moved to the new table by each register
 #define MAX_SLOT_SIZE 0x40000000
 
 //每个模块（模块被称为服务）都有一个永不重复（即使模块退出）的数字 id，这个概念叫做handle,类似windows内的句柄概念
 
 //句柄名字数据结构定义
+// A name node is never freed : when the named service is retired, its handle becomes 0 and the node
+// is reused if the same name is registered again. So a reader (or a name cache) holding a node can
+// always read it, and the memory is bounded by the number of distinct names.
+// 名字节点永不释放：服务回收时句柄置0，同一个名字再次注册时复用该节点
+// 所以持有节点的读者(或名字缓存)总是可以读它，内存上限为出现过的不同名字的数目
 struct handle_name {
 	char * name;		//名字
-	uint32_t handle;	//句柄
+	uint32_t hash;		//名字的哈希值
+	volatile uint32_t handle;	//句柄，0表示已回收
 };
+
+// Open addressing index of names, read without lock and grown like handle_table.
+// 名字的开放寻址索引，读取不加锁，扩容方式和handle_table相同
+struct name_table {
+	int size;						//槽数，2的幂
+	struct name_table *prev;		//更小的旧表
+	struct handle_name * volatile slot[];	//槽
+};
+
+// The slot table is read without lock : skynet_handle_grab loads the current table, reads the slot, then
+// skynet_context_trygrab takes a reference only if the context is alive and still owns the handle.
+// Writers (register, retire, name) still hold the write lock. When the table grows, the new table is
+// published and the old one is kept (never freed), because a reader may still be reading it ;
+// their total size is less than the current table.
+// The new table is published empty, and each register moves MIGRATE_STEP slots of prev into it, so the
+// growth never rehashes the whole table at once. A slot is copied to the new table before it is cleared
+// in prev, so a reader looks in prev first while the migration is in progress. A reader may still hold
+// a table that has been replaced while it reads, so when it misses it reloads the current table and
+// looks again if the table changed.
+// 槽表的读取不加锁：skynet_handle_grab取得当前的表并读取槽，再由skynet_context_trygrab在上下文仍然存活
+// 并且仍然拥有该句柄时才增加引用。写操作(注册、回收、命名)仍然持有写锁
+// 表扩容时发布新表，旧表保留不释放，因为可能还有读者在读，所有旧表的总大小小于当前的表
+// 新表发布时是空的，每次注册从旧表迁移MIGRATE_STEP个槽，所以扩容不会一次重新散列整个表
+// 槽先复制到新表再从旧表清除，所以迁移期间读者先读旧表
+// 读者持有的表可能在读的过程中被替换，所以没找到时重新读取当前的表，表变了就再找一次
+struct handle_table {
+	int size;						//槽数，2的幂
+	struct handle_table *prev;		//更小的旧表
+	volatile int migrate;			//旧表中已迁移的槽数，等于prev->size时迁移完成
+	struct skynet_context * volatile slot[];	//槽
+};
+
 //句柄存储数据结构定义
 struct handle_storage {
-	struct rwlock lock;	//读写锁
+	struct rwlock lock;	//读写锁，只有写操作加锁
 
 	uint32_t harbor;	//节点号
 	uint32_t handle_index;//句柄索引
-	int slot_size;//槽大小
-	struct skynet_context ** slot;//槽
+	struct handle_table * volatile table;//当前的槽表
 	
-	int name_cap;//名字容量
-	int name_count;//名字计数
-	struct handle_name *name;//句柄名字
+	int name_count;//名字节点计数
+	struct name_table * volatile name;//名字索引
 };
 
 static struct handle_storage *H = NULL;
 
+static struct handle_table *
+table_new(int size) {
+	struct handle_table * t = skynet_malloc(sizeof(*t) + size * sizeof(struct skynet_context *));
+	t->size = size;
+	t->prev = NULL;
+	t->migrate = 0;
+	memset((void *)t->slot, 0, size * sizeof(struct skynet_context *));
+	return t;
+}
+
+static inline bool
+migrating(struct handle_table *t) {
+	return t->prev && t->migrate < t->prev->size;
+}
+
+//从旧表迁移最多n个槽到新表，需要持有写锁
+static void
+migrate(struct handle_table *t, int n) {
+	struct handle_table *old = t->prev;
+	while (n-- > 0 && t->migrate < old->size) {
+		int i = t->migrate;
+		struct skynet_context * ctx = old->slot[i];
+		if (ctx) {
+			int hash = skynet_context_handle(ctx) & (t->size - 1);
+			assert(t->slot[hash] == NULL);
+			t->slot[hash] = ctx;
+			__sync_synchronize();//先出现在新表，再从旧表清除
+			old->slot[i] = NULL;
+		}
+		__sync_synchronize();
+		t->migrate = i + 1;
+	}
+}
+
 //注册句柄(取得一个句柄)
 uint32_t
 skynet_handle_register(struct skynet_context *ctx) {
@@ -43,12 +114,23 @@ skynet_handle_register(struct skynet_context *ctx) {
 	rwlock_wlock(&s->lock);//写加锁
 	
 	for (;;) {//死循环
+		struct handle_table *t = s->table;
+		struct handle_table *old = NULL;
+		if (migrating(t)) {
+			migrate(t, MIGRATE_STEP);
+			if (migrating(t))
+				old = t->prev;
+		}
 		int i;
-		for (i=0;i<s->slot_size;i++) {//遍历槽
+		for (i=0;i<t->size;i++) {//遍历槽
 			uint32_t handle = (i+s->handle_index) & HANDLE_MASK;//获取句柄值
-			int hash = handle & (s->slot_size-1);//获取hash值，作为槽的索引
-			if (s->slot[hash] == NULL) {//槽内没有存储skynet上下文
-				s->slot[hash] = ctx;//将skynet上下文存储到槽内
+			int hash = handle & (t->size-1);//获取hash值，作为槽的索引
+			if (old && old->slot[handle & (old->size-1)]) {
+				continue;//旧表中对应的槽还没有迁移，它可能会迁移到这个槽
+			}
+			if (t->slot[hash] == NULL) {//槽内没有存储skynet上下文
+				__sync_synchronize();//上下文的初始化先于发布
+				t->slot[hash] = ctx;//将skynet上下文存储到槽内
 				s->handle_index = handle + 1;//句柄索引+1
 
 				rwlock_wunlock(&s->lock);//写解锁
@@ -57,18 +139,16 @@ skynet_handle_register(struct skynet_context *ctx) {
 				return handle;//返回句柄
 			}
 		}
-		//槽不够用了，重新分配
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
-		for (i=0;i<s->slot_size;i++) {
-			int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = s->slot[i];
+		if (old) {//迁移完成前不再扩容
+			migrate(t, old->size);
+			continue;
 		}
-		skynet_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		//槽不够用了，发布空的新表，旧表保留给还在读它的读者，之后逐步迁移
+		assert((t->size*2 - 1) <= HANDLE_MASK);
+		struct handle_table *nt = table_new(t->size * 2);
+		nt->prev = t;
+		__sync_synchronize();
+		s->table = nt;
 	}
 }
 
@@ -80,25 +160,27 @@ skynet_handle_retire(uint32_t handle) {
 
 	rwlock_wlock(&s->lock);
 
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_table *t = s->table;
+	uint32_t hash = handle & (t->size-1);
+	struct skynet_context * ctx = t->slot[hash];
+	if ((ctx == NULL || skynet_context_handle(ctx) != handle) && migrating(t)) {//还在旧表中
+		t = t->prev;
+		hash = handle & (t->size-1);
+		ctx = t->slot[hash];
+	}
 
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
+		t->slot[hash] = NULL;
 		skynet_context_release(ctx);
-		s->slot[hash] = NULL;
 		ret = 1;
+		struct name_table *nt = s->name;
 		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {
-				skynet_free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				s->name[j] = s->name[i];
+		for (i=0; i<nt->size; ++i) {
+			struct handle_name *n = nt->slot[i];
+			if (n && n->handle == handle) {
+				n->handle = 0;//名字节点保留，缓存了它的读者会发现句柄为0
 			}
-			++j;
 		}
-		s->name_count = j;
 	}
 
 	rwlock_wunlock(&s->lock);
@@ -113,13 +195,18 @@ skynet_handle_retireall() {
 	for (;;) {
 		int n=0;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
-			rwlock_rlock(&s->lock);
-			struct skynet_context * ctx = s->slot[i];
+		rwlock_wlock(&s->lock);
+		struct handle_table *t = s->table;
+		if (migrating(t))
+			migrate(t, t->prev->size);
+		rwlock_wunlock(&s->lock);
+		for (i=0;i<t->size;i++) {
+			struct skynet_context * ctx = t->slot[i];
 			uint32_t handle = 0;
-			if (ctx)
+			if (ctx && skynet_context_trygrab(ctx, skynet_context_handle(ctx))) {
 				handle = skynet_context_handle(ctx);
-			rwlock_runlock(&s->lock);
+				skynet_context_release(ctx);
+			}
 			if (handle != 0) {
 				if (skynet_handle_retire(handle)) {
 					++n;
@@ -131,107 +218,151 @@ skynet_handle_retireall() {
 	}
 }
 
-//使用句柄获取上下文引用
+//使用句柄获取上下文引用，不加锁
 struct skynet_context * 
 skynet_handle_grab(uint32_t handle) {
-	struct handle_storage *s = H;//句柄存储引用
-	struct skynet_context * result = NULL;//返回结果指针，指向上下文
-
-	rwlock_rlock(&s->lock);//读加锁
-
-	uint32_t hash = handle & (s->slot_size-1);//获取哈希值
-	struct skynet_context * ctx = s->slot[hash];//从槽内获取上下文引用
-	if (ctx && skynet_context_handle(ctx) == handle) {//获取到了上下文，并且该上下文的句柄就是传入的句柄
-		result = ctx;//设置返回结果指针指向该上下文引用
-		skynet_context_grab(result);//增加上下文的引用计数
+	if (handle == 0)//0保留给系统，注册中的上下文句柄也是0
+		return NULL;
+	struct handle_table *t = H->table;//当前的槽表
+	for (;;) {
+		struct skynet_context * ctx;
+		if (migrating(t)) {//迁移中先读旧表，槽从旧表清除之前已经出现在新表中
+			struct handle_table *old = t->prev;
+			ctx = old->slot[handle & (old->size-1)];
+			if (ctx && skynet_context_trygrab(ctx, handle)) {
+				return ctx;
+			}
+		}
+		ctx = t->slot[handle & (t->size-1)];//从槽内获取上下文引用
+		if (ctx && skynet_context_trygrab(ctx, handle)) {//上下文仍然存活，并且该上下文的句柄就是传入的句柄
+			return ctx;
+		}
+		// t may have been replaced and its slot migrated to the new table after it was loaded
+		// 读取t之后它可能已经被新表替换，槽已经迁移到新表中
+		__sync_synchronize();
+		struct handle_table *nt = H->table;
+		if (nt == t)
+			return NULL;
+		t = nt;
 	}
+}
 
-	rwlock_runlock(&s->lock);//读解锁
+//获取多个上下文，用于批量发送
+void
+skynet_handle_grabs(const uint32_t * handle, int n, struct skynet_context ** ctx) {
+	int i;
+	for (i=0;i<n;i++) {
+		ctx[i] = skynet_handle_grab(handle[i]);
+	}
+}
 
-	return result;
+static uint32_t
+name_hash(const char * name) {
+	uint32_t h = 2166136261u;	// FNV-1a
+	for (; *name; name++) {
+		h = (h ^ (uint8_t)*name) * 16777619u;
+	}
+	return h;
 }
-//根据名字查找句柄
-uint32_t 
-skynet_handle_findname(const char * name) {
-	struct handle_storage *s = H;//获取句柄存储引用
 
-	rwlock_rlock(&s->lock);//读加锁
+static struct name_table *
+name_table_new(int size) {
+	struct name_table * t = skynet_malloc(sizeof(*t) + size * sizeof(struct handle_name *));
+	t->size = size;
+	t->prev = NULL;
+	memset((void *)t->slot, 0, size * sizeof(struct handle_name *));
+	return t;
+}
 
-	uint32_t handle = 0;//句柄
+//查找名字节点，不加锁
+static struct handle_name *
+find_name(const char * name, uint32_t hash) {
+	struct name_table *t = H->name;
+	int i;
+	for (i=0;i<t->size;i++) {
+		struct handle_name *n = t->slot[(hash + i) & (t->size-1)];
+		if (n == NULL)
+			return NULL;
+		if (n->hash == hash && strcmp(n->name, name) == 0)
+			return n;
+	}
+	return NULL;
+}
 
-	//二分法遍历
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			handle = n->handle;
-			break;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
+static void
+name_table_insert(struct name_table *t, struct handle_name *n) {
+	int i;
+	for (i=0;;i++) {
+		struct handle_name * volatile *slot = &t->slot[(n->hash + i) & (t->size-1)];
+		if (*slot == NULL) {
+			__sync_synchronize();//节点的初始化先于发布
+			*slot = n;
+			return;
 		}
 	}
+}
 
-	rwlock_runlock(&s->lock);//读解锁
-
-	return handle;//返回句柄
+//根据名字查找句柄，不加锁
+uint32_t 
+skynet_handle_findname(const char * name) {
+	struct handle_name *n = find_name(name, name_hash(name));
+	return n ? n->handle : 0;
 }
 
-static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	if (s->name_count >= s->name_cap) {//扩充容量
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
-		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
-		}
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		int i;
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];//将所有元素后移一格
-		}
+// The cache is indexed by the address of the name string : senders usually pass the same (interned) string.
+// A hit is checked with strcmp and a live handle, so a reused address or a retired name falls back to the index.
+// 缓存以名字字符串的地址为索引，发送者通常传入同一个(内化的)字符串
+// 命中后还要比较名字并且句柄不为0，所以地址被复用或者名字已回收时会回到索引中查找
+uint32_t
+skynet_handle_findname_cache(const char * name, struct name_cache *cache) {
+	int index = ((uintptr_t)name >> 3) & (NAME_CACHE_SIZE-1);
+	struct handle_name *n = cache->node[index];
+	if (n && cache->key[index] == name && strcmp(n->name, name) == 0) {
+		uint32_t handle = n->handle;
+		if (handle)
+			return handle;
 	}
-	//用空出的新格子存储名字和句柄
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;//计数加1
+	n = find_name(name, name_hash(name));
+	if (n == NULL)
+		return 0;
+	cache->key[index] = name;
+	cache->node[index] = n;
+	return n->handle;
 }
 
 //插入名字
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
-	int begin = 0;//起始位置
-	int end = s->name_count - 1;//结束位置
-	while (begin<=end) {//遍历 二分法
-		int mid = (begin+end)/2;//中间位置
-		struct handle_name *n = &s->name[mid];//取句柄名字指针
-		int c = strcmp(n->name, name);//比较名字是否匹配
-		if (c==0) {//名字匹配
-			return NULL;//返回空
+	uint32_t hash = name_hash(name);
+	struct handle_name *n = find_name(name, hash);
+	if (n) {
+		if (n->handle != 0) {//名字已被占用
+			return NULL;
 		}
-		if (c<0) {//待插入的名字大于当前位置的名字
-			begin = mid + 1;//移动begin到（当前位置+1）处
-		} else {//待插入的名字小于当前位置的名字
-			end = mid - 1;//移动end到（当前位置-1）处
+		n->handle = handle;//复用已回收的名字节点
+		return n->name;
+	}
+	struct name_table *t = s->name;
+	if ((s->name_count + 1) * 2 > t->size) {//装载因子不超过1/2，扩容
+		assert(t->size * 2 <= MAX_SLOT_SIZE);
+		struct name_table *nt = name_table_new(t->size * 2);
+		int i;
+		for (i=0;i<t->size;i++) {
+			if (t->slot[i])
+				name_table_insert(nt, t->slot[i]);
 		}
+		nt->prev = t;
+		__sync_synchronize();
+		s->name = nt;
+		t = nt;
 	}
-	char * result = skynet_strdup(name);//复制名字
-
-	_insert_name_before(s, result, handle, begin);
-
-	return result;
+	n = skynet_malloc(sizeof(*n));
+	n->name = skynet_strdup(name);//复制名字
+	n->hash = hash;
+	n->handle = handle;
+	name_table_insert(t, n);
+	s->name_count ++;
+	return n->name;
 }
 
 //命名句柄
@@ -247,12 +378,14 @@ skynet_handle_namehandle(uint32_t handle, const char *name) {
 }
 
 void 
-skynet_handle_init(int harbor) {
+skynet_handle_init(int harbor, int slots) {
 	assert(H==NULL);
 	struct handle_storage * s = skynet_malloc(sizeof(*H));//分配内存
-	s->slot_size = DEFAULT_SLOT_SIZE;//设置槽大小
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *));//为槽分配内存 其实是s->slot_size个指针
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));//清空内存
+	int size = DEFAULT_SLOT_SIZE;
+	while (size < slots && size <= HANDLE_MASK / 2) {//预分配的大小取2的幂
+		size *= 2;
+	}
+	s->table = table_new(size);//为槽分配内存
 
 	rwlock_init(&s->lock);//读写锁初始化
 	// reserve 0 for system
@@ -260,9 +393,8 @@ skynet_handle_init(int harbor) {
 	//初始化handle存储相关数据
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 	s->handle_index = 1;
-	s->name_cap = 2;
 	s->name_count = 0;
-	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+	s->name = name_table_new(DEFAULT_SLOT_SIZE);
 
 	H = s;
 
@@ -11,11 +11,25 @@ struct skynet_context;
 uint32_t skynet_handle_register(struct skynet_context *);
 int skynet_handle_retire(uint32_t handle);
 struct skynet_context * skynet_handle_grab(uint32_t handle);
+// grab n contexts, ctx[i] is NULL if handle[i] is invalid
+void skynet_handle_grabs(const uint32_t * handle, int n, struct skynet_context ** ctx);
 void skynet_handle_retireall();
 
+#define NAME_CACHE_SIZE 8
+
+struct handle_name;
+
+// resolved names of one context, see skynet_handle_findname_cache
+struct name_cache {
+	const char * key[NAME_CACHE_SIZE];
+	struct handle_name * node[NAME_CACHE_SIZE];
+};
+
 uint32_t skynet_handle_findname(const char * name);
+uint32_t skynet_handle_findname_cache(const char * name, struct name_cache *cache);
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
 
-void skynet_handle_init(int harbor);
+// slots : initial size of the handle table, rounded up to a power of 2 (0 for default)
+void skynet_handle_init(int harbor, int slots);
 
 #endif
@@ -10,6 +10,19 @@ struct skynet_config {
 	const char * module_path;	//模块目录配置
 	const char * bootstrap;		//引导配置
 	const char * logger;		//日志配置
+	int adaptive_dispatch;		//是否使用自适应派发(否则使用按线程的静态权重)
+	int priority_stat;			//是否统计各优先级的排队延迟
+	int numa;					//是否按NUMA节点分组工作线程和全局队列
+	const char * worker_cpu;	//工作线程绑定的cpu列表，如 "0-3,8"
+	int socket_thread;			//socket线程数，socket按id分配到各个线程
+	const char * socket_cpu;	//socket线程绑定的cpu列表
+	const char * timer_cpu;		//时钟线程绑定的cpu列表
+	int logger_thread;			//日志服务是否使用专属线程
+	int handle_slots;			//句柄槽表的初始大小，预计的服务数
+	int timer_resolution;		//时间轮每格的毫秒数
+	int payload_cache;			//消息数据是否使用按线程缓存的分配器
+	int memory_soft_limit;		//每个服务内存的软限制(MB)，0表示没有限制
+	int memory_hard_limit;		//每个服务内存的硬限制(MB)，0表示没有限制
 };
 
 #define THREAD_WORKER 0		//工作线程
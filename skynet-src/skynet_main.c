@@ -27,7 +27,6 @@ optint(const char *key, int opt) {
 	return strtol(str, NULL, 10);//将字符串转换成长整数
 }
 
-/*
 static int
 optboolean(const char *key, int opt) {
 	const char * str = skynet_getenv(key);
@@ -37,7 +36,6 @@ optboolean(const char *key, int opt) {
 	}
 	return strcmp(str,"true")==0;
 }
-*/
 
 static const char *
 optstring(const char *key,const char * opt) {//作用同optint,区别是这里取字符串
@@ -152,6 +150,19 @@ main(int argc, char *argv[]) {
 	config.bootstrap = optstring("bootstrap","snlua bootstrap");// skynet 启动的第一个lua服务以及其启动参数
 	config.daemon = optstring("daemon", NULL);//配置是否以守护进程启动
 	config.logger = optstring("logger", NULL);//配置 skynet_error 输出到什么地方
+	config.adaptive_dispatch = optboolean("adaptive_dispatch", 0);//自适应派发，默认关闭，使用静态的weight表
+	config.priority_stat = optboolean("priority_stat", 0);//统计各优先级的排队延迟，每次push和pop都要读取时钟
+	config.numa = optboolean("numa", 0);//按NUMA节点分组工作线程，服务留在创建它的节点上
+	config.worker_cpu = optstring("worker_cpu", NULL);//工作线程的cpu亲和性，如 "0-7"
+	config.socket_thread = optint("socket_thread", 1);//socket线程数，连接很多时每个线程只轮询一部分socket
+	config.socket_cpu = optstring("socket_cpu", NULL);//socket线程的cpu亲和性
+	config.timer_cpu = optstring("timer_cpu", NULL);//时钟线程的cpu亲和性
+	config.logger_thread = optboolean("logger_thread", 0);//日志服务在专属线程上运行，慢的日志输出不占用工作线程
+	config.handle_slots = optint("handle_slots", 0);//句柄槽表预分配的大小，大量启动服务时避免扩容
+	config.timer_resolution = optint("timer_resolution", 10);//时间轮精度(毫秒)，可以是1 2 5 10
+	config.payload_cache = optboolean("payload_cache", 0);//消息数据使用按线程缓存的分配器，默认关闭，直接用skynet_malloc
+	config.memory_soft_limit = optint("memory_soft_limit", 0);//服务内存超过它(MB)时通知服务
+	config.memory_hard_limit = optint("memory_hard_limit", 0);//服务的lua内存不能超过它(MB)
 
 	lua_close(L);//关闭虚拟机
 
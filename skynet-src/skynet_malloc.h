@@ -14,6 +14,6 @@ void * skynet_calloc(size_t nmemb,size_t size);
 void * skynet_realloc(void *ptr, size_t size);
 void skynet_free(void *ptr);
 char * skynet_strdup(const char *str);
-void * skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize);	// use for lua
+void * skynet_lalloc(void *ud, void *ptr, size_t osize, size_t nsize);	// use for lua, ud is the owner handle or NULL
 
 #endif
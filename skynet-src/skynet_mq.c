@@ -3,12 +3,20 @@
 #include "skynet.h"
 #include "skynet_mq.h"
 #include "skynet_handle.h"
+#include "skynet_timer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #define DEFAULT_QUEUE_SIZE 64	//默认队列的大小为64
 #define MAX_GLOBAL_MQ 0x10000	//64K,单机服务上限是64K，因而global mq数量最大值也是64k
@@ -19,39 +27,228 @@
 #define MQ_IN_GLOBAL 1 		
 #define MQ_OVERLOAD 1024	//超载阀值
 
+// A message queue is a multi-producer single-consumer queue : any thread can push, but only
+// the worker dispatching the service pops. Messages are stored in a linked list of blocks ;
+// a producer reserves a slot by CAS on tail_index, so no lock is held and the queue grows by
+// linking a new block, never by copying the messages already queued.
+// 消息队列是多生产者单消费者队列，任何线程都可以push，但只有正在派发该服务的工作线程会pop
+// 消息存放在由块(block)组成的链表中，生产者通过对tail_index做CAS来占用槽位，不需要加锁
+// 队列增长时只需链接一个新块，不再拷贝已有的消息
+
+#define BLOCK_LAP DEFAULT_QUEUE_SIZE	//每个块占用的索引数
+#define BLOCK_CAP (BLOCK_LAP-1)			//每个块的槽位数，偏移为BLOCK_CAP的索引表示下一个块正在安装
+
+struct mq_slot {
+	struct skynet_message message;	//消息
+	volatile int ready;				//消息是否已经写入
+};
+
+struct mq_block {
+	struct mq_block * volatile next;	//下一个块
+	struct mq_slot slot[BLOCK_CAP];		//槽位
+};
+
 //消息队列数据结构定义 
 struct message_queue {
 	uint32_t handle;//句柄号
-	int cap;		//容量
-	int head;		//队头索引
-	int tail;		//队尾索引
-	int lock;		//用于实现自旋锁 加锁将这个值设置为1 释放锁将这个值设置为0
-	int release;	//消息队列释放标记，当要释放一个服务的时候 清理标记
-	int in_global;	//是否在全局队列中
+	int node;		//所属的NUMA节点，可运行时放入该节点的全局队列
+	int priority;	//优先级，可运行时放入对应优先级的运行队列
+	struct dedicated * volatile dedicated;	//不为空时由专属线程派发，不进入运行队列
+	uint64_t runnable_time;	//放入运行队列的时间，用于统计排队延迟
+	volatile int release;	//消息队列释放标记，当要释放一个服务的时候 清理标记
+	volatile int in_global;	//是否在全局队列中
 	int overload;	//超载值（超载队列的长度）
 	int overload_threshold;			//超载阀值
-	struct skynet_message *queue;	//具体的消息队列(存放具体的skynet消息) 类似于数组，按需扩展
-	struct message_queue *next;		//下一个消息队列
+	struct message_queue *next;		//下一个消息队列(全局队列的溢出链表使用)
+	struct mq_block * volatile spare;	//缓存一个用完的块，避免频繁分配
+	// consumer side, only touched by the dispatching worker
+	uint32_t head_index;			//队头索引
+	struct mq_block *head_block;	//队头所在的块
+	char pad[64];					//避免生产者和消费者在同一缓存行
+	// producer side
+	volatile uint32_t tail_index;	//队尾索引
+	struct mq_block * volatile tail_block;	//队尾所在的块
+};
+
+#define LOCK(q) while (__sync_lock_test_and_set(&(q)->lock,1)) {}	//自旋锁 加锁
+#define UNLOCK(q) __sync_lock_release(&(q)->lock);					//解锁
+
+#ifndef NOUSE_LOCKFREE_GLOBALMQ
+
+// The global queue is a bounded MPMC ring (Dmitry Vyukov's algorithm) of MAX_GLOBAL_MQ slots.
+// Each slot carries a sequence number, so push and pop only CAS on tail/head and never block.
+// A message_queue is in the global queue at most once, so the ring overflows only when
+// there are more than MAX_GLOBAL_MQ runnable services; the rest goes to a spinlocked list.
+// 全局队列是一个大小为MAX_GLOBAL_MQ的有界多生产者多消费者无锁环形队列
+// 每个槽位带有序号，push和pop只需要对tail/head做CAS，不会阻塞其他工作线程
+// 由于一个消息队列最多只会在全局队列中出现一次，只有当可运行的服务数超过MAX_GLOBAL_MQ时环才会满，满了就放入一个自旋锁保护的溢出链表
+
+#define GP(p) ((p) & (MAX_GLOBAL_MQ-1))	//环形队列的下标
+
+struct global_slot {
+	volatile uint32_t seq;			//槽位序号 等于pos表示可写，等于pos+1表示可读
+	struct message_queue * queue;	//存放的消息队列
 };
 
+//全局队列数据结构定义
+struct global_queue {
+	volatile uint32_t head;		//下一个要pop的位置
+	char pad1[60];				//避免head和tail在同一缓存行
+	volatile uint32_t tail;		//下一个要push的位置
+	char pad2[60];
+	struct global_slot *slot;	//环形队列槽位
+	struct message_queue *list;	//环满时的溢出链表头
+	struct message_queue *list_tail;	//溢出链表尾
+	int lock;					//溢出链表的锁
+};
+
+//尝试push到环形队列中，环满了返回false
+static bool
+ring_push(struct global_queue *q, struct message_queue *queue) {
+	uint32_t pos = q->tail;
+	struct global_slot *s;
+	for (;;) {
+		s = &q->slot[GP(pos)];
+		uint32_t seq = s->seq;
+		int32_t diff = (int32_t)(seq - pos);
+		if (diff == 0) {//槽位可写，尝试占用
+			if (__sync_bool_compare_and_swap(&q->tail, pos, pos+1))
+				break;
+			pos = q->tail;
+		} else if (diff < 0) {//槽位还没被消费，环满了
+			return false;
+		} else {//其他线程抢先push了，重新读取tail
+			pos = q->tail;
+		}
+	}
+	s->queue = queue;
+	__sync_synchronize();
+	s->seq = pos + 1;//发布槽位，此时可以被pop
+	return true;
+}
+
+//尝试从环形队列中pop，环空时返回NULL
+static struct message_queue *
+ring_pop(struct global_queue *q) {
+	uint32_t pos = q->head;
+	struct global_slot *s;
+	for (;;) {
+		s = &q->slot[GP(pos)];
+		uint32_t seq = s->seq;
+		int32_t diff = (int32_t)(seq - (pos + 1));
+		if (diff == 0) {//槽位可读，尝试占用
+			if (__sync_bool_compare_and_swap(&q->head, pos, pos+1))
+				break;
+			pos = q->head;
+		} else if (diff < 0) {//环空了(或push还没完成)
+			return NULL;
+		} else {//其他线程抢先pop了，重新读取head
+			pos = q->head;
+		}
+	}
+	struct message_queue * mq = s->queue;
+	s->queue = NULL;
+	__sync_synchronize();
+	s->seq = pos + MAX_GLOBAL_MQ;//槽位留给下一圈的push
+	return mq;
+}
+
+static void
+list_push(struct global_queue *q, struct message_queue *queue) {
+	LOCK(q)
+	if(q->list_tail) {
+		q->list_tail->next = queue;
+		q->list_tail = queue;
+	} else {
+		q->list = q->list_tail = queue;
+	}
+	UNLOCK(q)
+}
+
+static struct message_queue *
+list_pop(struct global_queue *q) {
+	if (q->list == NULL)//不加锁先检查一次，溢出链表几乎总是空的
+		return NULL;
+	LOCK(q)
+	struct message_queue *mq = q->list;
+	if(mq) {
+		q->list = mq->next;
+		if(q->list == NULL) {
+			assert(mq == q->list_tail);
+			q->list_tail = NULL;
+		}
+		mq->next = NULL;
+	}
+	UNLOCK(q)
+	return mq;
+}
+
+//向全局队列push新的消息队列
+static void 
+globalmq_push(struct global_queue *q, struct message_queue * queue) {
+	assert(queue->next == NULL);//新push进全局队列的消息队列的next指针必为空
+	if (!ring_push(q, queue)) {
+		// The ring is full seldom, save queue in list
+		list_push(q, queue);
+	}
+}
+
+//从全局队列pop出消息队列
+static struct message_queue * 
+globalmq_pop(struct global_queue *q) {
+	struct message_queue *mq = ring_pop(q);
+	if (mq == NULL) {
+		return list_pop(q);
+	}
+	if (q->list) {
+		// A slot is just freed, move one queue from overflow list back to the ring,
+		// so the queues in list will not starve.
+		// 刚空出了一个槽位，把溢出链表中的一个队列搬回环中，避免链表中的队列饿死
+		struct message_queue *lq = list_pop(q);
+		if (lq && !ring_push(q, lq)) {
+			list_push(q, lq);
+		}
+	}
+	return mq;
+}
+
+//全局队列中等待的消息队列数(近似值)
+static int
+globalmq_length(struct global_queue *q) {
+	int len = (int)(q->tail - q->head);
+	if (len <= 0) {
+		return q->list ? 1 : 0;
+	}
+	return len;
+}
+
+static struct global_queue *
+globalmq_create() {
+	struct global_queue *q = skynet_malloc(sizeof(*q));//为全局队列分配内存
+	memset(q,0,sizeof(*q));//清空内存
+	q->slot = skynet_malloc(MAX_GLOBAL_MQ * sizeof(struct global_slot));
+	uint32_t i;
+	for (i=0;i<MAX_GLOBAL_MQ;i++) {
+		q->slot[i].seq = i;//第i个槽位在第一圈的pos为i时可写
+		q->slot[i].queue = NULL;
+	}
+	return q;
+}
+
+#else
+
 //全局队列数据结构定义
 struct global_queue {
 	struct message_queue *head;	//消息队列头指针
 	struct message_queue *tail;	//消息队列尾指针
+	int length;					//队列中的消息队列数
 	int lock;					//锁
 };
 
-static struct global_queue *Q = NULL;	//全局队列引用
-
-#define LOCK(q) while (__sync_lock_test_and_set(&(q)->lock,1)) {}	//自旋锁 加锁
-#define UNLOCK(q) __sync_lock_release(&(q)->lock);					//解锁
-
 //向全局队列push新的消息队列
 //在队尾push
-void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;//获得全局队列引用
-
+static void 
+globalmq_push(struct global_queue *q, struct message_queue * queue) {
 	LOCK(q)//加锁
 	assert(queue->next == NULL);//新push进全局队列的消息队列的next指针必为空
 	if(q->tail) {//如果全局队列的队尾指针不为空(此时队列不为空)
@@ -60,15 +257,14 @@ skynet_globalmq_push(struct message_queue * queue) {
 	} else {
 		q->head = q->tail = queue;//第一个元素(此时队列为空)，队头队尾都指向这个队列
 	}
+	++q->length;
 	UNLOCK(q)//解锁
 }
 
 //从全局队列pop出消息队列
 //在队头pop
-struct message_queue * 
-skynet_globalmq_pop() {
-	struct global_queue *q = Q;//获得全局队列引用
-
+static struct message_queue * 
+globalmq_pop(struct global_queue *q) {
 	LOCK(q)//加锁
 	struct message_queue *mq = q->head;//先将要返回的指针指向队头
 	if(mq) {//如果队头不为空
@@ -78,20 +274,543 @@ skynet_globalmq_pop() {
 			q->tail = NULL;//如果只有一个元素pop出去了，那么队尾指针指向也应该置为空，因为没元素了啊
 		}
 		mq->next = NULL;//将要返回的消息队列的next置为空
+		--q->length;
 	}
 	UNLOCK(q)//解锁
 
 	return mq;//返回消息队列
 }
 
+static int
+globalmq_length(struct global_queue *q) {
+	return q->length;
+}
+
+static struct global_queue *
+globalmq_create() {
+	struct global_queue *q = skynet_malloc(sizeof(*q));//为全局队列分配内存
+	memset(q,0,sizeof(*q));//清空内存
+	return q;
+}
+
+#endif
+
+// Each worker thread owns a small local run queue. A message queue made runnable by a worker
+// goes to that worker's local queue first, so a request/response pair tends to stay on one core.
+// Idle workers steal from the local queues of other workers.
+// 每个工作线程有一个自己的本地运行队列，工作线程上的服务使某个消息队列变为可运行时，优先放入本线程的本地队列
+// 这样请求和回应尽量在同一个核上处理，空闲的工作线程会从其他线程的本地队列中窃取
+
+// In NUMA mode, every node has its own global queue and worker group. A service belongs to
+// the node it's launched on, workers prefer their own node and only help other nodes when idle.
+// Without NUMA mode there is only one node.
+// NUMA模式下每个节点有自己的全局队列和工作线程组，服务属于创建它的节点，
+// 工作线程优先处理本节点的队列，空闲时才帮助其他节点，非NUMA模式只有一个节点
+
+// queueing delay of each priority class : from pushed into run queue to popped by a worker.
+// Every worker keeps its own counters, they are summed when read.
+// 每个优先级的排队延迟统计：从放入运行队列到被工作线程取出。每个工作线程各自计数，读取时求和
+struct priority_stat {
+	uint64_t count;		//出队次数
+	uint64_t delay;		//总延迟(纳秒)
+	uint64_t max;		//最大延迟(纳秒)
+};
+
+#define LOCAL_MQ_SIZE 256		//本地队列的容量，满了就放入全局队列
+#define LOCAL_MQ_FAIRNESS 61	//每pop这么多次先检查一次全局队列，避免全局队列中的队列饿死
+
+struct local_queue {
+	int lock;		//自旋锁，只在窃取时才会有竞争
+	int node;		//所属的节点
+	uint32_t head;	//队头
+	uint32_t tail;	//队尾
+	uint32_t tick;	//pop计数
+	struct message_queue * queue[LOCAL_MQ_SIZE];
+	struct priority_stat stat[MQ_PRIORITY_COUNT];	//本线程取出的各优先级消息队列的排队延迟，只由本线程写
+};
+
+// Every node has a global queue for each priority class. High priority queues are strictly served first,
+// low priority queues get a share of 1/LOW_PRIORITY_SHARE pops when normal ones are waiting.
+// Only normal queues go through the local run queues, so high priority queues never wait behind them.
+// 每个节点每个优先级一个全局队列，高优先级严格优先，低优先级在有普通队列等待时也能得到1/LOW_PRIORITY_SHARE的机会
+// 只有普通优先级的消息队列使用本地运行队列，所以高优先级的队列不会排在它们后面
+
+#define LOW_PRIORITY_SHARE 8	//每pop这么多次先检查一次低优先级队列
+
+static struct global_queue *Q[MAX_NUMA_NODE][MQ_PRIORITY_COUNT];	//每个节点每个优先级的全局队列
+
+static volatile int STAT_enable = 0;	//是否统计排队延迟，关闭时push不读取时钟
+static int NODE_count = 1;				//节点数
+static int NODE_next = 0;				//非工作线程创建的服务轮流放到各个节点
+
+static struct local_queue *LQ = NULL;	//所有工作线程的本地队列
+static int LQ_count = 0;				//本地队列的数量(等于工作线程数)
+static pthread_key_t LQ_key;			//线程私有数据，保存本线程绑定的本地队列
+
+// Idle workers park here. Pushing a runnable queue wakes one parked worker directly,
+// so nobody needs to poll for wakeups. On linux it's a futex, otherwise a condition variable.
+// 空闲的工作线程在这里休眠，push可运行的消息队列时直接唤醒一个休眠的工作线程，不再需要定时轮询唤醒
+// linux下使用futex，其他平台使用条件变量
+struct park {
+	volatile uint32_t seq;	//唤醒序号，每次唤醒加一
+	volatile int sleep;		//休眠的工作线程数
+	volatile int spin;		//没有休眠、正在自旋寻找消息队列的工作线程数
+	volatile int quit;		//退出标记
+#if !defined(__linux__)
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+	char pad[64];			//每个节点的休眠结构不在同一缓存行
+};
+
+static struct park P[MAX_NUMA_NODE];	//每个节点一个
+
+//当前线程所在的节点
+static int
+current_node() {
+	struct local_queue *lq = pthread_getspecific(LQ_key);
+	if (lq) {
+		return lq->node;
+	}
+	if (NODE_count == 1) {
+		return 0;
+	}
+	return (unsigned)__sync_fetch_and_add(&NODE_next, 1) % NODE_count;
+}
+
+//是否有可运行的消息队列
+static bool
+runnable(int node) {
+	int i,j;
+	for (i=0;i<NODE_count;i++) {
+		for (j=0;j<MQ_PRIORITY_COUNT;j++) {
+			if (globalmq_length(Q[i][j]) > 0)
+				return true;
+		}
+	}
+	for (i=0;i<LQ_count;i++) {
+		if (LQ[i].node == node && LQ[i].head != LQ[i].tail)
+			return true;
+	}
+	return false;
+}
+
+static void
+park_wait(struct park *p, uint32_t seq) {
+#if defined(__linux__)
+	syscall(SYS_futex, &p->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&p->mutex);
+	while (p->seq == seq) {
+		pthread_cond_wait(&p->cond, &p->mutex);
+	}
+	pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
+static void
+park_wake(struct park *p, int n) {
+#if defined(__linux__)
+	__sync_fetch_and_add(&p->seq, 1);
+	syscall(SYS_futex, &p->seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&p->mutex);
+	++p->seq;
+	if (n == 1) {
+		pthread_cond_signal(&p->cond);
+	} else {
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
+// Park current worker until a queue becomes runnable, or skynet_mq_wakeup_all is called.
+// "spurious wakeup" is harmless, the worker will try to dispatch again.
+//休眠当前工作线程，直到有可运行的消息队列，虚假唤醒是无害的
+void
+skynet_mq_park() {
+	struct local_queue *lq = pthread_getspecific(LQ_key);
+	assert(lq);
+	struct park *p = &P[lq->node];
+	uint32_t seq = p->seq;
+	__sync_fetch_and_add(&p->sleep, 1);
+	// The pusher publishes the queue before reading sleep, we count sleep before checking the queues.
+	// push者先发布队列再读取sleep，这里先增加sleep再检查队列，所以不会丢失唤醒
+	if (!p->quit && !runnable(lq->node)) {
+		park_wait(p, seq);
+	}
+	__sync_fetch_and_sub(&p->sleep, 1);
+}
+
+// A worker spinning before it parks will find a queue pushed meanwhile : it's counted in spin
+// until it finds work, and it checks the queues after it counts itself in sleep.
+// 自旋的工作线程在找到消息队列之前计入spin，休眠前计入sleep之后还会再检查一次队列，所以自旋期间push的队列不会被错过
+void
+skynet_mq_spin(int spin) {
+	struct local_queue *lq = pthread_getspecific(LQ_key);
+	assert(lq);
+	if (spin) {
+		__sync_fetch_and_add(&P[lq->node].spin, 1);
+	} else {
+		__sync_fetch_and_sub(&P[lq->node].spin, 1);
+	}
+}
+
+//唤醒一个休眠的工作线程(如果有的话)，优先唤醒node节点的
+static inline void
+wakeup_one(int node) {
+	__sync_synchronize();
+	if (P[node].sleep > 0) {
+		park_wake(&P[node], 1);
+		return;
+	}
+	int i;
+	for (i=1;i<NODE_count;i++) {
+		struct park *p = &P[(node + i) % NODE_count];
+		if (p->sleep > 0) {
+			park_wake(p, 1);
+			return;
+		}
+	}
+}
+
+// A dedicated queue never enters the run queues : it's dispatched by its own thread,
+// which parks on the dedicated structure until the queue becomes runnable.
+// 专属线程的消息队列不进入运行队列，由它自己的线程派发，线程在专属结构上休眠直到队列变为可运行
+struct dedicated {
+	struct park p;
+	volatile int runnable;		//消息队列可运行
+	struct dedicated *next;		//所有的专属结构链成链表，退出时逐个唤醒
+};
+
+static struct {
+	int lock;
+	struct dedicated *list;
+} D;
+
+static void
+dedicated_wake(struct dedicated *d) {
+	d->runnable = 1;
+	__sync_synchronize();
+	if (d->p.sleep) {
+		park_wake(&d->p, 1);
+	}
+}
+
+//把消息队列交给专属线程派发
+void
+skynet_mq_dedicate(struct message_queue *q) {
+	struct dedicated *d = skynet_malloc(sizeof(*d));
+	memset(d, 0, sizeof(*d));
+#if !defined(__linux__)
+	if (pthread_mutex_init(&d->p.mutex, NULL) || pthread_cond_init(&d->p.cond, NULL)) {
+		fprintf(stderr, "Init park mutex error");
+		exit(1);
+	}
+#endif
+	LOCK(&D)
+	d->p.quit = P[0].quit;
+	d->next = D.list;
+	D.list = d;
+	UNLOCK(&D)
+	__sync_synchronize();
+	q->dedicated = d;
+}
+
+int
+skynet_mq_dedicated(struct message_queue *q) {
+	return q->dedicated != NULL;
+}
+
+//专属线程等待消息队列可运行，返回1表示应当退出(仍需把队列派发完)
+int
+skynet_mq_dedicated_wait(struct message_queue *q) {
+	struct dedicated *d = q->dedicated;
+	struct park *p = &d->p;
+	while (!d->runnable && !p->quit) {
+		uint32_t seq = p->seq;
+		p->sleep = 1;
+		__sync_synchronize();
+		if (!d->runnable && !p->quit) {
+			park_wait(p, seq);
+		}
+		p->sleep = 0;
+	}
+	d->runnable = 0;
+	return p->quit;
+}
+
+static void
+dedicated_release(struct dedicated *d) {
+	LOCK(&D)
+	struct dedicated **pd = &D.list;
+	while (*pd != d) {
+		pd = &(*pd)->next;
+	}
+	*pd = d->next;
+	UNLOCK(&D)
+#if !defined(__linux__)
+	pthread_mutex_destroy(&d->p.mutex);
+	pthread_cond_destroy(&d->p.cond);
+#endif
+	skynet_free(d);
+}
+
+//唤醒所有的工作线程并不再休眠，退出时调用
+void
+skynet_mq_wakeup_all() {
+	int i;
+	for (i=0;i<NODE_count;i++) {
+		struct park *p = &P[i];
+		p->quit = 1;
+		__sync_synchronize();
+		park_wake(p, p->sleep + 1);
+	}
+	LOCK(&D)
+	struct dedicated *d;
+	for (d=D.list;d;d=d->next) {
+		d->p.quit = 1;
+		__sync_synchronize();
+		park_wake(&d->p, 1);
+	}
+	UNLOCK(&D)
+}
+
+static bool
+localmq_push(struct local_queue *lq, struct message_queue *queue) {
+	bool ret = false;
+	LOCK(lq)
+	if (lq->tail - lq->head < LOCAL_MQ_SIZE) {
+		lq->queue[lq->tail++ % LOCAL_MQ_SIZE] = queue;
+		ret = true;
+	}
+	UNLOCK(lq)
+	return ret;
+}
+
+static struct message_queue *
+localmq_pop(struct local_queue *lq) {
+	if (lq->head == lq->tail)//不加锁先检查一次
+		return NULL;
+	struct message_queue *mq = NULL;
+	LOCK(lq)
+	if (lq->head != lq->tail) {
+		mq = lq->queue[lq->head++ % LOCAL_MQ_SIZE];
+	}
+	UNLOCK(lq)
+	return mq;
+}
+
+//从同一节点的其他工作线程的本地队列窃取一个消息队列
+static struct message_queue *
+localmq_steal(struct local_queue *lq) {
+	int id = lq - LQ;
+	int i;
+	for (i=1;i<LQ_count;i++) {
+		struct local_queue *victim = &LQ[(id + i) % LQ_count];
+		if (victim->node != lq->node)
+			continue;
+		struct message_queue *mq = localmq_pop(victim);
+		if (mq)
+			return mq;
+	}
+	return NULL;
+}
+
+//从其他节点的全局队列取一个消息队列，本节点空闲时帮助其他节点
+static struct message_queue *
+othernode_pop(int node) {
+	int i,j;
+	for (j=0;j<MQ_PRIORITY_COUNT;j++) {
+		for (i=1;i<NODE_count;i++) {
+			struct message_queue *mq = globalmq_pop(Q[(node + i) % NODE_count][j]);
+			if (mq)
+				return mq;
+		}
+	}
+	return NULL;
+}
+
+//记录排队延迟，只记在本线程的计数中，push时没有记录时间(统计关闭时)的不计
+static struct message_queue *
+queue_delay(struct message_queue *mq) {
+	if (mq && mq->runnable_time) {
+		struct local_queue *lq = pthread_getspecific(LQ_key);
+		if (lq) {
+			uint64_t d = skynet_monotonic_time() - mq->runnable_time;
+			struct priority_stat *s = &lq->stat[mq->priority];
+			++s->count;
+			s->delay += d;
+			if (d > s->max)
+				s->max = d;
+		}
+		mq->runnable_time = 0;
+	}
+	return mq;
+}
+
+//从运行队列取出一个消息队列
+//高优先级 -> (低优先级的份额) -> 本地队列 -> 本节点普通全局队列 -> 窃取本节点其他工作线程的本地队列 -> 本节点低优先级 -> 其他节点
+static struct message_queue *
+runq_pop() {
+	struct local_queue *lq = pthread_getspecific(LQ_key);
+	struct message_queue *mq;
+	int i;
+	if (lq == NULL) {
+		for (i=0;i<MQ_PRIORITY_COUNT;i++) {
+			mq = globalmq_pop(Q[0][i]);
+			if (mq)
+				return mq;
+		}
+		return othernode_pop(0);
+	}
+	struct global_queue **q = Q[lq->node];
+	mq = globalmq_pop(q[MQ_PRIORITY_HIGH]);
+	if (mq)
+		return mq;
+	++lq->tick;
+	if (lq->tick % LOW_PRIORITY_SHARE == 0) {
+		mq = globalmq_pop(q[MQ_PRIORITY_LOW]);
+		if (mq)
+			return mq;
+	}
+	if (lq->tick % LOCAL_MQ_FAIRNESS == 0) {
+		mq = globalmq_pop(q[MQ_PRIORITY_NORMAL]);
+		if (mq)
+			return mq;
+	}
+	mq = localmq_pop(lq);
+	if (mq)
+		return mq;
+	mq = globalmq_pop(q[MQ_PRIORITY_NORMAL]);
+	if (mq)
+		return mq;
+	mq = localmq_steal(lq);
+	if (mq)
+		return mq;
+	mq = globalmq_pop(q[MQ_PRIORITY_LOW]);
+	if (mq)
+		return mq;
+	return othernode_pop(lq->node);
+}
+
+//绑定当前线程到第id个本地队列，只在工作线程中调用
+void
+skynet_localmq_bind(int id, int node) {
+	assert(id >= 0 && id < LQ_count);
+	assert(node >= 0 && node < NODE_count);
+	LQ[id].node = node;
+	pthread_setspecific(LQ_key, &LQ[id]);
+}
+
+//将可运行的消息队列放入运行队列
+//普通优先级的在同一节点的工作线程中优先放入本线程的本地队列，其他情况放入消息队列所属节点对应优先级的全局队列
+void
+skynet_globalmq_push(struct message_queue * queue) {
+	struct dedicated *d = queue->dedicated;
+	if (d) {
+		dedicated_wake(d);//由专属线程派发
+		return;
+	}
+	if (STAT_enable) {
+		queue->runnable_time = skynet_monotonic_time();
+	}
+	struct local_queue *lq = pthread_getspecific(LQ_key);
+	if (queue->priority == MQ_PRIORITY_NORMAL && lq && lq->node == queue->node && localmq_push(lq, queue)) {
+		// The current worker will take the first one itself, but it may be in a long callback.
+		// Skip the wakeup only when there is one queue and an idle worker of the node is spinning, it steals it soon.
+		// 本线程自己会处理第一个，但它可能正在执行很长的回调。只有一个队列并且本节点有空闲的工作线程在自旋时才不唤醒，它很快会来窃取
+		__sync_synchronize();
+		if (lq->tail - lq->head > 1 || P[lq->node].spin == 0) {
+			wakeup_one(lq->node);
+		}
+		return;
+	}
+	globalmq_push(Q[queue->node][queue->priority], queue);
+	wakeup_one(queue->node);
+}
+
+struct message_queue *
+skynet_globalmq_pop() {
+	return queue_delay(runq_pop());
+}
+
+static struct mq_block *
+block_new(struct message_queue *q) {
+	struct mq_block *b = __sync_lock_test_and_set(&q->spare, NULL);//优先使用缓存的块
+	if (b == NULL) {
+		b = skynet_malloc(sizeof(*b));
+	}
+	memset(b, 0, sizeof(*b));
+	return b;
+}
+
+static void
+block_delete(struct message_queue *q, struct mq_block *b) {
+	if (!__sync_bool_compare_and_swap(&q->spare, NULL, b)) {
+		skynet_free(b);
+	}
+}
+
+// The number of message queues waiting to be dispatched, seen by current thread :
+// global queue of its node plus its own local queue. It's an approximate value used by dispatch policy.
+// 当前线程看到的等待派发的消息队列数：本节点的全局队列加上本线程的本地队列，是近似值，供派发策略使用
+int
+skynet_globalmq_length() {
+	struct local_queue *lq = pthread_getspecific(LQ_key);
+	int node = lq ? lq->node : 0;
+	int len = 0;
+	int i;
+	for (i=0;i<MQ_PRIORITY_COUNT;i++) {
+		len += globalmq_length(Q[node][i]);
+	}
+	if (lq) {
+		len += (int)(lq->tail - lq->head);
+	}
+	return len;
+}
+
+void
+skynet_mq_setpriority(struct message_queue *q, int priority) {
+	assert(priority >= 0 && priority < MQ_PRIORITY_COUNT);
+	q->priority = priority;//已经在运行队列中的不移动，下次放入运行队列时生效
+}
+
+int
+skynet_mq_priority(struct message_queue *q) {
+	return q->priority;
+}
+
+void
+skynet_mq_priority_stat_enable(int enable) {
+	STAT_enable = enable;
+}
+
+//各个工作线程的计数求和，读取不加锁
+void
+skynet_mq_priority_stat(int priority, uint64_t *count, uint64_t *delay, uint64_t *max) {
+	assert(priority >= 0 && priority < MQ_PRIORITY_COUNT);
+	int i;
+	*count = 0;
+	*delay = 0;
+	*max = 0;
+	for (i=0;i<LQ_count;i++) {
+		struct priority_stat *s = &LQ[i].stat[priority];
+		*count += s->count;
+		*delay += s->delay;
+		if (s->max > *max)
+			*max = s->max;
+	}
+}
+
 struct message_queue * 
 skynet_mq_create(uint32_t handle) {
 	struct message_queue *q = skynet_malloc(sizeof(*q));//为消息队列分配内存
+	memset(q, 0, sizeof(*q));
 	q->handle = handle;//将句柄号存入消息队列的handle字段中
-	q->cap = DEFAULT_QUEUE_SIZE;//设置队列容量
-	q->head = 0;//队头
-	q->tail = 0;//队尾
-	q->lock = 0;//自旋锁
+	q->node = current_node();//服务放在创建它的节点上
+	q->priority = MQ_PRIORITY_NORMAL;//默认为普通优先级
 	// When the queue is create (always between service create and service init) ,
 	// set in_global flag to avoid push it to global queue .
 	// If the service init success, skynet_context_new will call skynet_mq_force_push to push it to global queue.
@@ -102,7 +821,7 @@ skynet_mq_create(uint32_t handle) {
 	q->release = 0;//释放标记
 	q->overload = 0;//超载标记
 	q->overload_threshold = MQ_OVERLOAD;//超载阀值
-	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);//为具体的消息队列分配内存
+	q->head_block = q->tail_block = block_new(q);//第一个块
 	q->next = NULL;//下一个消息队列指针
 
 	return q;
@@ -112,7 +831,13 @@ skynet_mq_create(uint32_t handle) {
 static void 
 _release(struct message_queue *q) {
 	assert(q->next == NULL);//断言传入的队列的next指针必为空
-	skynet_free(q->queue);//释放具体的消息队列
+	struct mq_block *b = q->head_block;
+	while (b) {//释放所有的块
+		struct mq_block *next = b->next;
+		skynet_free(b);
+		b = next;
+	}
+	skynet_free(q->spare);
 	skynet_free(q);//释放消息队列
 }
 
@@ -122,21 +847,15 @@ skynet_mq_handle(struct message_queue *q) {
 	return q->handle;//直接返回字段即可
 }
 
-//计算消息队列的长度
+//计算消息队列的长度(包括正在写入的消息)
 int
 skynet_mq_length(struct message_queue *q) {
-	int head, tail,cap;
-
-	LOCK(q)//锁住该队列
-	head = q->head;//得到头
-	tail = q->tail;//得到尾
-	cap = q->cap;//得到容量
-	UNLOCK(q)//解锁该队列
-	
-	if (head <= tail) {//如果头小于等于尾 没有回绕
-		return tail - head;//直接返回二者差值即为当前消息队列的长度
-	}
-	return tail + cap - head;//发生回绕了
+	uint32_t head = q->head_index;
+	uint32_t tail = q->tail_index;
+	uint32_t lap = head - head % BLOCK_LAP;
+	// every lap has BLOCK_LAP indexes but only BLOCK_CAP slots
+	// 每个块占用BLOCK_LAP个索引，但只有BLOCK_CAP个槽位
+	return (int)((tail - head) - (tail - lap) / BLOCK_LAP);
 }
 
 //获取消息队列的超载值，如果超载了，返回后，将重置超载值
@@ -151,112 +870,157 @@ skynet_mq_overload(struct message_queue *q) {
 	return 0;//返回0代表消息队列未超载
 }
 
+//队头的消息是否已经写入
+static inline bool
+message_ready(struct message_queue *q) {
+	return q->head_block->slot[q->head_index % BLOCK_LAP].ready;
+}
+
+//从队头取出一条已经写入的消息，没有则返回false
+static bool
+take_message(struct message_queue *q, struct skynet_message *message) {
+	uint32_t head = q->head_index;
+	struct mq_block *b = q->head_block;
+	uint32_t offset = head % BLOCK_LAP;
+	struct mq_slot *slot = &b->slot[offset];
+	if (!slot->ready) {//队列空了或者生产者还没写完
+		return false;
+	}
+	__sync_synchronize();
+	*message = slot->message;
+	if (offset + 1 == BLOCK_CAP) {
+		// The producer fill the last slot installs the next block before writing the slot.
+		// 写最后一个槽位的生产者在写入之前已经安装好了下一个块
+		struct mq_block *next = b->next;
+		assert(next);
+		q->head_block = next;
+		q->head_index = head + 2;//跳过表示安装中的索引
+		block_delete(q, b);
+	} else {
+		q->head_index = head + 1;
+	}
+	return true;
+}
+
 //从消息队列POP出消息
-//队头POP
+//队头POP 只有派发该服务的工作线程会调用
 int
 skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
-	int ret = 1;//默认返回值为1
-	LOCK(q)//加锁队列n
-
-	if (q->head != q->tail) {//如果队列头不等于队列尾 代表队列中有消息
-		*message = q->queue[q->head++];//根据当前的队头索引取出队列中的消息，并自增队头索引
-		ret = 0;//将返回值设为0
-		int head = q->head;//取得队头
-		int tail = q->tail;//取得队尾
-		int cap = q->cap;//取出容量
-
-		if (head >= cap) {//如果队头索引超出了容量
-			q->head = head = 0;//重置队头索引
-		}
-		int length = tail - head;//计算当前队列长度
-		if (length < 0) {//如果长度小于0,则发生回绕了
-			length += cap;//需要加上容量获取长度，即length=tail + cap - head
-		}
+	if (take_message(q, message)) {
+		int length = skynet_mq_length(q);//计算当前队列长度
 		while (length > q->overload_threshold) {//当队列长度大于超载阀值时
 			q->overload = length;//设置超载值为当前队列的长度
 			q->overload_threshold *= 2;//增加队列的超载阀值为原有的2倍
 			//如果当前队列的长度依然大于增加后的队列超载阀值，则继续这个过程
 		}
-	} else {//此时队列已经空了，为什么呢？因为如果head==tail，则有两种情况，一种是队列空，一种是队列满，
-			//假设是队列满,那一定是经历过push消息的操作，但是在skynet_mq_push中，在push消息后，有判断是否队列满的情况，
-			//而且如果满了，会进行队列的扩充操作，那么这个地方是不可能队列满的
-
-		// reset overload_threshold when queue is empty
-		// 当队列为空时，重置超载阀值
-		q->overload_threshold = MQ_OVERLOAD;
-	}
-
-	if (ret) {//没有获取到消息
-		q->in_global = 0;//设置是否在全局队列中为false
+		return 0;
 	}
-	
-	UNLOCK(q)//解锁队列
+	// reset overload_threshold when queue is empty
+	// 当队列为空时，重置超载阀值
+	q->overload_threshold = MQ_OVERLOAD;
 
-	return ret;//返回0或1	0代表获取到消息了，1代表没有获取到消息
-}
-
-//扩充消息队列
-static void
-expand_queue(struct message_queue *q) {
-	struct skynet_message *new_queue = skynet_malloc(sizeof(struct skynet_message) * q->cap * 2);//重新分配2倍于原有队列容量的内存
-	int i;
-	for (i=0;i<q->cap;i++) {//遍历队列，因为此时队列已满
-		new_queue[i] = q->queue[(q->head + i) % q->cap];//按照消息在原有队列的顺序拷贝到新的消息队列中，即使发生回绕了，但顺序不变
+	// Clear in_global first, then check again. A producer finishing its slot at the same time
+	// either sees in_global == 0 and pushes q into global queue, or we see its message here.
+	// 先清除in_global再检查一次，同时写完消息的生产者要么看到in_global为0并将q放入全局队列，要么它的消息在这里被看到
+	q->in_global = 0;
+	__sync_synchronize();
+	if (message_ready(q) && __sync_bool_compare_and_swap(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		// If the CAS failed, a producer has pushed q into global queue, don't touch q any more.
+		// CAS失败说明生产者已经把q放入全局队列了，不能再从q中取消息
+		take_message(q, message);
+		return 0;
 	}
-	q->head = 0;//设置头为0
-	q->tail = q->cap;//设置尾为原有队列的容量
-	q->cap *= 2;//设置新的容量为原有容量的两倍
-	
-	skynet_free(q->queue);//释放原有的消息队列
-	q->queue = new_queue;//使用新分配的消息队列
+	return 1;//返回1代表没有获取到消息
 }
 
 //向消息队列PUSH消息
-//队尾PUSH
+//队尾PUSH 任何线程都可以调用，不加锁
 void 
 skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	assert(message);//向一个队列PUSH消息，传入的消息当然不能为空，先断言判断下
-	LOCK(q)//加锁队列
-
-	q->queue[q->tail] = *message;//将消息存储到当前队尾索引所在位置
-	if (++ q->tail >= q->cap) {//先自增队尾索引，如果队尾索引超出了当前队列的容量
-		q->tail = 0;//设置队尾索引到0  回绕了
+	struct mq_block *next = NULL;
+	struct mq_block *b;
+	uint32_t offset;
+	for (;;) {
+		uint32_t tail = q->tail_index;
+		__sync_synchronize();
+		b = q->tail_block;
+		offset = tail % BLOCK_LAP;
+		if (offset == BLOCK_CAP) {
+			// another producer is installing the next block
+			// 其他生产者正在安装下一个块
+			continue;
+		}
+		if (offset + 1 == BLOCK_CAP && next == NULL) {
+			next = block_new(q);//占用最后一个槽位的生产者负责安装下一个块，先分配好
+		}
+		if (__sync_bool_compare_and_swap(&q->tail_index, tail, tail + 1)) {
+			if (offset + 1 == BLOCK_CAP) {
+				b->next = next;
+				q->tail_block = next;
+				__sync_synchronize();
+				q->tail_index = tail + 2;//进入下一个块
+				next = NULL;
+			}
+			break;
+		}
 	}
-
-	if (q->head == q->tail) {//如果队列头索引等于队列尾了，则代表没有位置存储元素了,消息队列已经满了
-		//队列头等于队列尾肯定不是初始状态：即head和tail都等于0，因为上面几句代码已经导致队尾指针增加了
-		//那么此时肯定是发生回绕了
-		//一种情况是一直push消息，直到发生回绕，此时head和tail都等于0
-		//另一种情况是队列有push消息，也有pop消息，但push更快，则tail追上了head，此时head和tail的值为多少不确定
-
-		expand_queue(q);//需要扩充队列了
+	if (next) {
+		block_delete(q, next);//预先分配的块没有用上
 	}
+	struct mq_slot *slot = &b->slot[offset];
+	slot->message = *message;//将消息存储到占用的槽位
+	__sync_synchronize();
+	slot->ready = 1;
 
-	if (q->in_global == 0) {//如果消息队列不在全局队列中
-		q->in_global = MQ_IN_GLOBAL;//设置标记
+	// see skynet_mq_pop
+	__sync_synchronize();
+	if (q->in_global == 0 && __sync_bool_compare_and_swap(&q->in_global, 0, MQ_IN_GLOBAL)) {//如果消息队列不在全局队列中
 		skynet_globalmq_push(q);//将消息队列push到全局队列中
 	}
-	
-	UNLOCK(q)//解锁队列
 }
 
 void 
-skynet_mq_init() {
-	struct global_queue *q = skynet_malloc(sizeof(*q));//为全局队列分配内存
-	memset(q,0,sizeof(*q));//清空内存
-	Q=q;//保存分配的指针
+skynet_mq_init(int worker, int node) {
+	assert(node >= 1 && node <= MAX_NUMA_NODE);
+	NODE_count = node;
+	memset(P, 0, sizeof(P));
+	int i;
+	for (i=0;i<node;i++) {
+		int j;
+		for (j=0;j<MQ_PRIORITY_COUNT;j++) {
+			Q[i][j]=globalmq_create();//每个节点每个优先级一个全局队列
+		}
+#if !defined(__linux__)
+		if (pthread_mutex_init(&P[i].mutex, NULL) || pthread_cond_init(&P[i].cond, NULL)) {
+			fprintf(stderr, "Init park mutex error");
+			exit(1);
+		}
+#endif
+	}
+
+	LQ = skynet_malloc(worker * sizeof(struct local_queue));//为每个工作线程分配本地队列
+	memset(LQ, 0, worker * sizeof(struct local_queue));
+	LQ_count = worker;
+	if (pthread_key_create(&LQ_key, NULL)) {
+		fprintf(stderr, "pthread_key_create failed");
+		exit(1);
+	}
 }
 
 //标记消息队列释放标记
 void 
 skynet_mq_mark_release(struct message_queue *q) {
-	LOCK(q)//加锁队列
 	assert(q->release == 0);//断言当前的释放标记为false
 	q->release = 1;//设置释放标记为true
-	if (q->in_global != MQ_IN_GLOBAL) {//如果当前消息队列不在全局队列中
+	__sync_synchronize();
+	if (q->dedicated) {
+		dedicated_wake(q->dedicated);//专属线程可能已经在等待释放标记，它看到标记后释放队列
+		return;
+	}
+	if (__sync_bool_compare_and_swap(&q->in_global, 0, MQ_IN_GLOBAL)) {//如果当前消息队列不在全局队列中
 		skynet_globalmq_push(q);//将它push到全局队列中
 	}
-	UNLOCK(q)//解锁队列
 }
 
 //丢弃队列
@@ -266,19 +1030,23 @@ _drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
 	while(!skynet_mq_pop(q, &msg)) {//不断从队列中pop出消息直到没有消息
 		drop_func(&msg, ud);//将消息传入给丢弃函数
 	}
+	if (q->dedicated) {
+		dedicated_release(q->dedicated);
+	}
 	_release(q);//最终释放队列
 }
 
+int
+skynet_mq_released(struct message_queue *q) {
+	return q->release;
+}
+
 //释放消息队列
 void 
 skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
-	LOCK(q)//先加锁队列
-	
 	if (q->release) {//如果释放标记为true，才会释放队列
-		UNLOCK(q)//解锁队列
 		_drop_queue(q, drop_func, ud);//丢弃队列
 	} else {//如果释放标记为false
 		skynet_globalmq_push(q);//将消息队列push到全局队列中
-		UNLOCK(q)//解锁队列
 	}
 }
@@ -11,15 +11,19 @@ struct skynet_message {
 	int session;	//消息标识
 	void * data;	//数据
 	size_t sz;		//大小
+	int shared;		//数据是skynet_send_batch共享的，由核心释放，不能被接收者保留
 };
 
 struct message_queue;
 
 void skynet_globalmq_push(struct message_queue * queue);
 struct message_queue * skynet_globalmq_pop(void);
+// approximate number of runnable queues waiting, for dispatch policy
+int skynet_globalmq_length(void);
 
 struct message_queue * skynet_mq_create(uint32_t handle);
 void skynet_mq_mark_release(struct message_queue *q);
+int skynet_mq_released(struct message_queue *q);	// marked by skynet_mq_mark_release
 
 typedef void (*message_drop)(struct skynet_message *, void *);
 
@@ -34,6 +38,36 @@ void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
 int skynet_mq_length(struct message_queue *q);
 int skynet_mq_overload(struct message_queue *q);
 
-void skynet_mq_init();
+#define MQ_PRIORITY_HIGH 0		//高优先级，严格优先调度，用于延迟敏感的服务(如gate、login)
+#define MQ_PRIORITY_NORMAL 1	//普通优先级(默认)
+#define MQ_PRIORITY_LOW 2		//低优先级，用于批处理服务
+#define MQ_PRIORITY_COUNT 3
+
+// the new priority takes effect next time the queue becomes runnable
+void skynet_mq_setpriority(struct message_queue *q, int priority);
+int skynet_mq_priority(struct message_queue *q);
+// queueing delay (ns) of a priority class, from runnable to dispatch
+void skynet_mq_priority_stat(int priority, uint64_t *count, uint64_t *delay, uint64_t *max);
+// the delay is measured only when enabled, it costs a clock read for each push and pop
+void skynet_mq_priority_stat_enable(int enable);
+
+#define MAX_NUMA_NODE 16
+
+// worker : number of workers, node : number of NUMA nodes (1 without NUMA mode)
+void skynet_mq_init(int worker, int node);
+// bind current worker thread to its local run queue, on NUMA node
+void skynet_localmq_bind(int id, int node);
+// park current worker until some queue is runnable
+void skynet_mq_park(void);
+// current worker starts (1) or stops (0) spinning for a runnable queue
+void skynet_mq_spin(int spin);
+// wake all parked workers and never park again, for exit
+void skynet_mq_wakeup_all(void);
+
+// Dedicated queue : dispatched by its own thread, never enters the run queues.
+void skynet_mq_dedicate(struct message_queue *q);
+int skynet_mq_dedicated(struct message_queue *q);
+// wait until the queue is runnable, returns 1 when skynet is exiting
+int skynet_mq_dedicated_wait(struct message_queue *q);
 
 #endif
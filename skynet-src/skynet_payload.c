@@ -0,0 +1,267 @@
+//消息数据的分配器
+#include "skynet.h"
+#include "skynet_payload.h"
+#include "malloc_hook.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef NOUSE_JEMALLOC
+#include "jemalloc.h"
+// malloc_hook keeps the owner handle in the last 4 bytes of the block
+#define usable_size(p) (je_malloc_usable_size(p) - sizeof(uint32_t))
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define usable_size(p) malloc_size(p)
+#else
+#include <malloc.h>
+#define usable_size(p) malloc_usable_size(p)
+#endif
+
+// Message payloads are allocated by one thread and freed by another (the receiver), so each thread keeps
+// free blocks of each size class, and moves them in batches of PAYLOAD_BATCH to and from a shared depot.
+// A block is an ordinary skynet_malloc block : its class is taken from its usable size when it is freed,
+// so a payload released by skynet_free somewhere, or a skynet_malloc block given to skynet_payload_free, is fine.
+// A cached block is charged to no service, it's charged to the service which takes it from the cache,
+// so the memory of a service (see malloc_limit) doesn't depend on the traffic of others.
+// 消息数据由一个线程分配，由另一个线程(接收者)释放，所以每个线程按大小类别缓存空闲块，
+// 并且以PAYLOAD_BATCH个为一批和共享的仓库交换。块就是普通的skynet_malloc块：释放时按可用大小决定类别，
+// 所以在别处用skynet_free释放消息数据，或者把skynet_malloc块交给skynet_payload_free都没有问题
+// 缓存中的块不计入任何服务，从缓存取出时计入取出它的服务，所以服务的内存用量不受其他服务流量的影响
+#define PAYLOAD_MIN_SHIFT 4		// 16 bytes, room for the two links of a free block
+#define PAYLOAD_CLASS 10		// 16 ... 8192
+#define PAYLOAD_CACHE 64		// free blocks of one class kept by a thread
+#define PAYLOAD_BATCH 32
+#define PAYLOAD_DEPOT 64		// batches of one class kept in the depot
+
+#define LOCK(q) while (__sync_lock_test_and_set(&(q)->lock,1)) {}
+#define UNLOCK(q) __sync_lock_release(&(q)->lock);
+
+#define CLASS_SIZE(c) ((size_t)1 << ((c) + PAYLOAD_MIN_SHIFT))
+
+struct free_block {
+	struct free_block *next;		//批次中的下一个块
+	struct free_block *next_batch;	//仓库中的下一个批次，只在批次的第一个块中有效
+};
+
+struct payload_cache {
+	struct payload_cache *next;		//所有线程缓存的链表
+	int dead;						//线程已退出，可以给新线程使用
+	int n[PAYLOAD_CLASS];
+	struct free_block *list[PAYLOAD_CLASS];
+	struct skynet_payload_stat stat;
+};
+
+struct payload_depot {
+	int lock;
+	int n;
+	struct free_block *batch;
+};
+
+struct payload_global {
+	volatile int enable;
+	int lock;
+	struct payload_cache *all;
+	struct payload_depot depot[PAYLOAD_CLASS];
+};
+
+static struct payload_global P;
+static __thread struct payload_cache *C = NULL;
+
+void
+skynet_payload_init(int enable) {
+	P.enable = enable;
+}
+
+// The blocks already cached stay in the caches when it's turned off, and are used again when it's turned on.
+// 关闭时已经缓存的块留在缓存中，再次打开时继续使用
+int
+skynet_payload_enable(int enable) {
+	return __sync_lock_test_and_set(&P.enable, enable);
+}
+
+static struct payload_cache *
+cache_get() {
+	if (C)
+		return C;
+	struct payload_cache *c;
+	LOCK(&P);
+	for (c = P.all; c; c = c->next) {
+		if (c->dead) {//复用已退出线程的缓存，保留它的统计
+			c->dead = 0;
+			break;
+		}
+	}
+	if (c == NULL) {
+		c = skynet_malloc(sizeof(*c));
+		memset(c, 0, sizeof(*c));
+		c->next = P.all;
+		P.all = c;
+	}
+	UNLOCK(&P);
+	C = c;
+	return c;
+}
+
+//能容纳sz的最小类别
+static inline int
+alloc_class(size_t sz) {
+	int c = 0;
+	while (CLASS_SIZE(c) < sz) {
+		++c;
+	}
+	return c;
+}
+
+//可用大小能容纳的最大类别，-1表示不缓存
+static inline int
+free_class(size_t usable) {
+	if (usable < CLASS_SIZE(0) || usable >= CLASS_SIZE(PAYLOAD_CLASS)) {
+		return -1;
+	}
+	int c = PAYLOAD_CLASS - 1;
+	while (CLASS_SIZE(c) > usable) {
+		--c;
+	}
+	return c;
+}
+
+void *
+skynet_payload_alloc(size_t sz) {
+	if (!P.enable) {
+		return skynet_malloc(sz);
+	}
+	struct payload_cache *cache = cache_get();
+	if (sz > CLASS_SIZE(PAYLOAD_CLASS - 1)) {
+		++cache->stat.alloc_large;
+		return skynet_malloc(sz);
+	}
+	int c = alloc_class(sz);
+	struct free_block *b = cache->list[c];
+	if (b) {
+		cache->list[c] = b->next;
+		--cache->n[c];
+		++cache->stat.alloc_hit;
+		skynet_malloc_owner(b, skynet_current_handle());
+		return b;
+	}
+	struct payload_depot *d = &P.depot[c];
+	if (d->batch) {
+		LOCK(d);
+		b = d->batch;
+		if (b) {
+			d->batch = b->next_batch;
+			--d->n;
+		}
+		UNLOCK(d);
+		if (b) {
+			cache->list[c] = b->next;
+			cache->n[c] = PAYLOAD_BATCH - 1;
+			++cache->stat.alloc_depot;
+			skynet_malloc_owner(b, skynet_current_handle());
+			return b;
+		}
+	}
+	++cache->stat.alloc_miss;
+	return skynet_malloc(CLASS_SIZE(c));
+}
+
+//从线程缓存中取出一批放入仓库，仓库满了就释放
+static void
+depot_push(struct payload_cache *cache, int c) {
+	struct free_block *batch = cache->list[c];
+	struct free_block *last = batch;
+	int i;
+	for (i=1;i<PAYLOAD_BATCH;i++) {
+		last = last->next;
+	}
+	cache->list[c] = last->next;
+	cache->n[c] -= PAYLOAD_BATCH;
+	last->next = NULL;
+
+	struct payload_depot *d = &P.depot[c];
+	LOCK(d);
+	if (d->n < PAYLOAD_DEPOT) {
+		batch->next_batch = d->batch;
+		d->batch = batch;
+		++d->n;
+		batch = NULL;
+	}
+	UNLOCK(d);
+	if (batch == NULL) {
+		++cache->stat.free_depot;
+		return;
+	}
+	while (batch) {
+		struct free_block *next = batch->next;
+		skynet_free(batch);
+		++cache->stat.free_release;
+		batch = next;
+	}
+}
+
+void
+skynet_payload_free(void *ptr) {
+	if (ptr == NULL)
+		return;
+	if (!P.enable) {
+		skynet_free(ptr);
+		return;
+	}
+	struct payload_cache *cache = cache_get();
+	int c = free_class(usable_size(ptr));
+	if (c < 0) {
+		++cache->stat.free_release;
+		skynet_free(ptr);
+		return;
+	}
+	skynet_malloc_owner(ptr, 0);
+	struct free_block *b = (struct free_block *)ptr;
+	b->next = cache->list[c];
+	cache->list[c] = b;
+	++cache->stat.free_cache;
+	if (++cache->n[c] > PAYLOAD_CACHE) {
+		depot_push(cache, c);
+	}
+}
+
+void
+skynet_payload_thread_exit(void) {
+	struct payload_cache *cache = C;
+	if (cache == NULL)
+		return;
+	int c;
+	for (c=0;c<PAYLOAD_CLASS;c++) {
+		while (cache->n[c] >= PAYLOAD_BATCH) {
+			depot_push(cache, c);
+		}
+		struct free_block *b = cache->list[c];
+		while (b) {
+			struct free_block *next = b->next;
+			skynet_free(b);
+			b = next;
+		}
+		cache->list[c] = NULL;
+		cache->n[c] = 0;
+	}
+	C = NULL;
+	__sync_synchronize();
+	cache->dead = 1;
+}
+
+void
+skynet_payload_stat(struct skynet_payload_stat *stat) {
+	memset(stat, 0, sizeof(*stat));
+	struct payload_cache *c;
+	LOCK(&P);
+	for (c = P.all; c; c = c->next) {
+		stat->alloc_hit += c->stat.alloc_hit;
+		stat->alloc_depot += c->stat.alloc_depot;
+		stat->alloc_miss += c->stat.alloc_miss;
+		stat->alloc_large += c->stat.alloc_large;
+		stat->free_cache += c->stat.free_cache;
+		stat->free_depot += c->stat.free_depot;
+		stat->free_release += c->stat.free_release;
+	}
+	UNLOCK(&P);
+}
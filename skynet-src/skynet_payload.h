@@ -0,0 +1,27 @@
+//消息数据的分配器
+#ifndef skynet_payload_h
+#define skynet_payload_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct skynet_payload_stat {
+	uint64_t alloc_hit;		// taken from the cache of the thread
+	uint64_t alloc_depot;	// a batch taken from the depot
+	uint64_t alloc_miss;	// allocated by skynet_malloc
+	uint64_t alloc_large;	// larger than the largest size class
+	uint64_t free_cache;	// kept in the cache of the thread
+	uint64_t free_depot;	// moved to the depot in a batch
+	uint64_t free_release;	// released by skynet_free
+};
+
+void skynet_payload_init(int enable);
+int skynet_payload_enable(int enable);	// turn the caches on or off at runtime, for comparison ; returns the old state
+// the block is a skynet_malloc block, it may also be released by skynet_free
+void * skynet_payload_alloc(size_t sz);
+void skynet_payload_free(void *ptr);
+// give the cache of the current thread back before the thread exits
+void skynet_payload_thread_exit(void);
+void skynet_payload_stat(struct skynet_payload_stat *stat);
+
+#endif
@@ -11,6 +11,7 @@
 #include "skynet_monitor.h"
 #include "skynet_imp.h"
 #include "skynet_log.h"
+#include "skynet_payload.h"
 
 #include <pthread.h>
 
@@ -20,6 +21,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#define DISPATCH_SLICE 1000000	// 1ms , the cpu time budget of one queue visit in adaptive dispatch
+
 #ifdef CALLING_CHECK
 
 //type __sync_lock_test_and_set (type *ptr, type value, ...)
@@ -51,19 +54,38 @@
 
 //但是在该blog(http://blog.codingnow.com/2013/12/skynet_monitor.html)中，云风说：“而且 skynet 借助 lua 的 coroutine 机制，事实上在同一个 lua service 里跑着多个 actor 。一个 lua coroutine 才是一个 actor ”
 
+// Mailbox policies, applied when the message queue of a service reaches its cap.
+// Responses and errors are always accepted, they are the replies of the requests made by the service.
+// 邮箱策略，服务的消息队列达到上限时生效，回应和错误消息总是接受的，因为它们是服务自己发出的请求的回应
+#define MAILBOX_DROP_NEWEST 0	//丢弃新的消息，发送者不知道
+#define MAILBOX_DROP_OLDEST 1	//接受新的消息，派发时丢弃最老的消息
+#define MAILBOX_ERROR 2			//拒绝新的消息，skynet_send返回-1(call因此失败)，不再另外发送错误消息
+#define MAILBOX_SLOWDOWN 3		//接受新的消息，通知发送者减速
+#define MAILBOX_POLICY_COUNT 4
+
 struct skynet_context {
 	void * instance;			//模块实例引用
 	struct skynet_module * mod;	//模块引用
 	void * cb_ud;				//回调的用户数据(userdata)
 	skynet_cb cb;				//skynet回调
+	bool shared_cb;				//回调从不保留消息，可以直接收到批量发送的共享数据
 	struct message_queue *queue;	//消息队列
 	FILE * logfile;					//日志文件句柄
-	char result[32];				//结果缓冲区
+	char result[64];				//结果缓冲区
 	uint32_t handle;				//句柄号
 	int session_id;					//会话id，用于产生会话
 	int ref;						//引用计数
 	bool init;						//是否初始化
 	bool endless;					//消息分发陷入死循环
+	int batch;						//最近一次访问派发的消息数
+	uint64_t cost;					//每条消息的平均开销(纳秒)，指数滑动平均
+	uint64_t message_count;			//已派发的消息总数
+	int mailbox_cap;				//邮箱容量，0表示不限制
+	int mailbox_policy;				//邮箱满时的策略
+	volatile uint32_t mailbox_count[MAILBOX_POLICY_COUNT];	//每种策略生效的次数
+	volatile uint32_t backpressure;	//作为发送者收到的减速信号数
+	struct skynet_context * free_next;	//释放后在空闲链表中的下一个
+	struct name_cache names;		//已解析的本地名字
 
 	CHECKCALLING_DECL				//检查调用声明
 };
@@ -72,6 +94,7 @@ struct skynet_node {
 	int total;			//上下文计数器
 	int init;
 	uint32_t monitor_exit;//监视服务退出的句柄号
+	int cost;			//统计派发的开销，自适应派发需要，关闭时派发不读时钟
 	pthread_key_t handle_key;
 };
 
@@ -89,7 +112,9 @@ context_inc() {//上下文计数增加
 
 static void
 context_dec() {//上下文计数减少
-	__sync_fetch_and_sub(&G_NODE.total,1);//原子操作
+	if (__sync_sub_and_fetch(&G_NODE.total,1) == 0) {//原子操作
+		skynet_timer_wakeup();//时钟线程检查到上下文数为0时退出，不必等它休眠结束
+	}
 }
 
 uint32_t 
@@ -114,6 +139,37 @@ id_to_hex(char * str, uint32_t id) { //将id转化为十六进制的字符串
 	str[9] = '\0';
 }
 
+// The payload of skynet_send_batch is shared by all the messages, a reference count is stored before the data.
+// The last receiver releases it.
+// 批量发送的消息共享一份数据，数据前面存放引用计数，最后一个接收者释放
+#define SHARED_HEADER 16	//引用计数头部的大小，保持数据的对齐
+
+static void *
+shared_new(const void * data, size_t sz, int ref) {
+	char * block = skynet_malloc(SHARED_HEADER + sz);
+	*(int *)block = ref;
+	memcpy(block + SHARED_HEADER, data, sz);
+	return block + SHARED_HEADER;
+}
+
+static void
+shared_release(void * data) {
+	int * ref = (int *)((char *)data - SHARED_HEADER);
+	if (__sync_sub_and_fetch(ref, 1) == 0) {
+		skynet_free(ref);
+	}
+}
+
+//释放消息的数据
+static inline void
+message_free(struct skynet_message *msg) {
+	if (msg->shared) {
+		shared_release(msg->data);
+	} else {
+		skynet_payload_free(msg->data);
+	}
+}
+
 struct drop_t {
 	uint32_t handle;
 };
@@ -122,7 +178,7 @@ struct drop_t {
 static void
 drop_message(struct skynet_message *msg, void *ud) {
 	struct drop_t *d = ud;//从用户数据中获取到丢弃类型
-	skynet_free(msg->data);//释放掉消息中的数据
+	message_free(msg);//释放掉消息中的数据
 	uint32_t source = d->handle;//从丢弃类型中获取到句柄号
 	assert(source);//断言源地址是合法的
 	//其实这里的source是该条消息的目的地
@@ -131,6 +187,40 @@ drop_message(struct skynet_message *msg, void *ud) {
 	//向消息来源(msg->source)报告错误
 	skynet_send(NULL, source, msg->source, PTYPE_ERROR, 0, NULL, 0);
 }
+// The memory of contexts is type-stable : a released context goes to a free list and is only reused as
+// a context, never returned to the allocator, so the lock-free skynet_handle_grab can always touch it.
+// 上下文的内存是类型稳定的：释放的上下文放入空闲链表，只会被重用为上下文，不还给分配器
+// 所以无锁的skynet_handle_grab总是可以安全地访问它
+static struct {
+	int lock;
+	struct skynet_context * list;
+} CTX_FREE;
+
+static struct skynet_context *
+context_alloc() {
+	while (__sync_lock_test_and_set(&CTX_FREE.lock, 1)) {}
+	struct skynet_context * ctx = CTX_FREE.list;
+	if (ctx) {
+		CTX_FREE.list = ctx->free_next;
+	}
+	__sync_lock_release(&CTX_FREE.lock);
+	if (ctx == NULL) {
+		ctx = skynet_malloc(sizeof(*ctx));
+		ctx->ref = 0;
+		ctx->handle = 0;
+	}
+	return ctx;
+}
+
+static void
+context_free(struct skynet_context * ctx) {
+	ctx->handle = 0;//先清除句柄，重用时不会被旧的句柄匹配到
+	while (__sync_lock_test_and_set(&CTX_FREE.lock, 1)) {}
+	ctx->free_next = CTX_FREE.list;
+	CTX_FREE.list = ctx;
+	__sync_lock_release(&CTX_FREE.lock);
+}
+
 //创建一个新的上下文
 //参数为：
 //name：模块名
@@ -145,7 +235,7 @@ skynet_context_new(const char * name, const char *param) {
 	void *inst = skynet_module_instance_create(mod);//创建模块实例
 	if (inst == NULL)
 		return NULL;
-	struct skynet_context * ctx = skynet_malloc(sizeof(*ctx));//为skynet上下文分配内存
+	struct skynet_context * ctx = context_alloc();//为skynet上下文分配内存
 	CHECKCALLING_INIT(ctx)//检查调用初始化
 
 	//初始化skynet上下文相关的一些数据
@@ -154,11 +244,20 @@ skynet_context_new(const char * name, const char *param) {
 	ctx->ref = 2;//引用计数
 	ctx->cb = NULL;
 	ctx->cb_ud = NULL;
+	ctx->shared_cb = false;
 	ctx->session_id = 0;
 	ctx->logfile = NULL;
 
 	ctx->init = false;//标志是否已经初始化
 	ctx->endless = false;//是否回绕？
+	ctx->batch = 0;
+	ctx->cost = 0;
+	ctx->message_count = 0;
+	ctx->mailbox_cap = 0;
+	ctx->mailbox_policy = MAILBOX_DROP_NEWEST;
+	memset((void *)ctx->mailbox_count, 0, sizeof(ctx->mailbox_count));
+	ctx->backpressure = 0;
+	memset(&ctx->names, 0, sizeof(ctx->names));
 	// Should set to 0 first to avoid skynet_handle_retireall get an uninitialized handle
 	ctx->handle = 0;//初始化句柄号为0	
 
@@ -224,7 +323,7 @@ delete_context(struct skynet_context *ctx) {
 	}
 	skynet_module_instance_release(ctx->mod, ctx->instance);//释放模块实例
 	skynet_mq_mark_release(ctx->queue);//释放队列
-	skynet_free(ctx);//释放上下文
+	context_free(ctx);//释放上下文
 	context_dec();//全局上下文减少
 }
 
@@ -237,16 +336,114 @@ skynet_context_release(struct skynet_context *ctx) {
 	return ctx;//返回上下文
 }
 
-int
-skynet_context_push(uint32_t handle, struct skynet_message *message) {
+// Called by the lock-free skynet_handle_grab with a context found in the handle table, which may be released
+// or even reused by another service (the memory is type-stable). Take a reference only if it's still alive,
+// then check it's still the service of handle.
+// 无锁的skynet_handle_grab在句柄表中找到的上下文可能正在释放，甚至已经被另一个服务重用(内存是类型稳定的)
+// 只在引用计数不为0时增加引用，然后检查它仍然是handle对应的服务
+bool
+skynet_context_trygrab(struct skynet_context *ctx, uint32_t handle) {
+	int ref = ctx->ref;
+	for (;;) {
+		if (ref <= 0)
+			return false;
+		int old = __sync_val_compare_and_swap(&ctx->ref, ref, ref + 1);
+		if (old == ref)
+			break;
+		ref = old;
+	}
+	if (ctx->handle != handle) {
+		skynet_context_release(ctx);
+		return false;
+	}
+	return true;
+}
+
+// Responses and errors end a waiting session, and socket data is a stream which can't lose a piece,
+// so they always go into the queue whatever the policy is.
+// 回应和错误结束一个等待的会话，socket数据是流，不能丢失其中一段，所以不论什么策略都放入队列
+static inline bool
+mailbox_exempt(struct skynet_message *message) {
+	int type = message->sz >> HANDLE_REMOTE_SHIFT;
+	return type == PTYPE_RESPONSE || type == PTYPE_ERROR || type == PTYPE_SOCKET;
+}
+
+//通知发送者减速
+static void
+signal_backpressure(uint32_t source) {
+	struct skynet_context * ctx = skynet_handle_grab(source);
+	if (ctx) {
+		__sync_fetch_and_add(&ctx->backpressure, 1);
+		skynet_context_release(ctx);
+	}
+}
+
+// Push a message into the queue of ctx by its mailbox policy.
+// Returns 0 if it's pushed, 1 if it's dropped (drop newest), -2 if it's rejected (error).
+// The message data is not freed when it's not pushed.
+// 按邮箱策略把消息放入ctx的队列，返回0表示放入，1表示丢弃(丢弃新消息)，-2表示拒绝(报错)，没有放入时不释放消息数据
+static int
+mailbox_push(struct skynet_context * ctx, struct skynet_message *message) {
+	int cap = ctx->mailbox_cap;
+	if (cap > 0 && !mailbox_exempt(message) && skynet_mq_length(ctx->queue) >= cap) {
+		int policy = ctx->mailbox_policy;
+		switch (policy) {
+		case MAILBOX_DROP_NEWEST:
+			__sync_fetch_and_add(&ctx->mailbox_count[policy], 1);
+			return 1;
+		case MAILBOX_ERROR:
+			// The sender learns it from the return value only : a PTYPE_ERROR would arrive for a session
+			// the failed call never waits on.
+			// 发送者只从返回值得知，如果再发送错误消息，它会到达一个失败的call并不等待的会话
+			__sync_fetch_and_add(&ctx->mailbox_count[policy], 1);
+			return -2;
+		case MAILBOX_SLOWDOWN:
+			__sync_fetch_and_add(&ctx->mailbox_count[policy], 1);
+			if (message->source != 0) {
+				signal_backpressure(message->source);
+			}
+			break;
+		default:
+			// MAILBOX_DROP_OLDEST : counted when the consumer drops them, see mailbox_drop
+			break;
+		}
+	}
+	skynet_mq_push(ctx->queue, message);//将消息放入队列
+	return 0;
+}
+
+// Drop the message just popped if the queue is still over the cap (drop oldest policy).
+// 丢弃最老消息的策略：刚pop出的消息如果队列仍然超过上限，就丢弃它
+static bool
+mailbox_drop(struct skynet_context * ctx, struct message_queue *q, struct skynet_message *msg) {
+	int cap = ctx->mailbox_cap;
+	if (cap > 0 && ctx->mailbox_policy == MAILBOX_DROP_OLDEST && !mailbox_exempt(msg) && skynet_mq_length(q) >= cap) {
+		__sync_fetch_and_add(&ctx->mailbox_count[MAILBOX_DROP_OLDEST], 1);
+		message_free(msg);
+		return true;
+	}
+	return false;
+}
+
+static int
+context_push(uint32_t handle, struct skynet_message *message) {
 	struct skynet_context * ctx = skynet_handle_grab(handle);//根据句柄获取上下文引用
 	if (ctx == NULL) {
 		return -1;
 	}
-	skynet_mq_push(ctx->queue, message);//将消息放入队列
+	int r = mailbox_push(ctx, message);
 	skynet_context_release(ctx);//释放上下文，因为在skynet_handle_grab中调用了skynet_context_grab增加了上下文的引用计数
 
-	return 0;
+	return r;
+}
+
+// 0 when it's pushed, -1 for an invalid handle, -2 when the mailbox of handle drops or rejects it.
+// The caller frees the data when it's not pushed.
+// 返回0表示放入，-1表示无效的句柄，-2表示被邮箱丢弃或拒绝，没有放入时调用者释放数据
+int
+skynet_context_push(uint32_t handle, struct skynet_message *message) {
+	int r = context_push(handle, message);
+	return r > 0 ? -2 : r;
 }
 
 void 
@@ -278,8 +475,23 @@ dispatch_message(struct skynet_context *ctx, struct skynet_message *msg) {
 	if (ctx->logfile) {//如果上下文内存在log文件
 		skynet_log_output(ctx->logfile, msg->source, type, msg->session, msg->data, sz);//输出日志
 	}
+	void * shared = NULL;
+	if (msg->shared) {
+		// A callback may keep the message (eg. forward mode), so it gets a private copy unless it declared it never does.
+		// 回调可能保留消息(比如forward模式)，除非它声明从不保留，否则给它一份私有的拷贝
+		shared = msg->data;
+		if (!ctx->shared_cb) {
+			msg->data = skynet_malloc(sz);
+			memcpy(msg->data, shared, sz);
+		}
+	}
 	if (!ctx->cb(ctx, ctx->cb_ud, type, msg->session, msg->source, msg->data, sz)) {//调用服务的回调函数处理消息
-		skynet_free(msg->data);//回调调用成功，释放消息承载的数据
+		if (msg->data != shared) {
+			skynet_payload_free(msg->data);//回调调用成功，释放消息承载的数据
+		}
+	}
+	if (shared) {
+		shared_release(shared);
 	}
 	CHECKCALLING_END(ctx)//检查调用结束
 }
@@ -297,6 +509,48 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	}
 }
 
+// Choose how many messages to dispatch in this visit :
+// the backlog, limited to DISPATCH_SLICE of cpu time by the recent cost per message,
+// and the slice shrinks when more queues are waiting in the run queue.
+// 自适应的派发数：队列积压的消息数，按最近每条消息的开销限制在一个时间片内，
+// 运行队列中等待的消息队列越多，时间片越短
+static int
+adaptive_batch(struct skynet_context * ctx, struct message_queue *q) {
+	int n = skynet_mq_length(q) + 1;//加上已经取出的这一条
+	int pressure = skynet_globalmq_length();
+	uint64_t slice = DISPATCH_SLICE / (1 + pressure);
+	if (ctx->cost > 0 && n > slice / ctx->cost) {
+		n = slice / ctx->cost;
+	}
+	if (n < 1) {
+		n = 1;
+	}
+	return n;
+}
+
+// the clock is read only when the cost is measured (see skynet_context_measure_cost)
+static inline uint64_t
+cost_start(void) {
+	return G_NODE.cost ? skynet_monotonic_time() : 0;
+}
+
+//更新每条消息的平均开销，start为0时不统计开销
+static void
+update_cost(struct skynet_context * ctx, uint64_t start, int n) {
+	if (n <= 0)
+		return;
+	if (start) {
+		uint64_t cost = (skynet_monotonic_time() - start) / n;
+		if (ctx->cost == 0) {
+			ctx->cost = cost;
+		} else {
+			ctx->cost = (ctx->cost * 7 + cost) / 8;
+		}
+	}
+	ctx->batch = n;
+	ctx->message_count += n;
+}
+
 struct message_queue * 
 skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue *q, int weight) {
 	if (q == NULL) {//如果传入的消息队列为空
@@ -316,12 +570,16 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 
 	int i,n=1;
 	struct skynet_message msg;//定义一个skynet消息用于存放收到的消息
+	uint64_t start = cost_start();//统计本次访问的开销
 
 	//分发当前队列的消息
 	for (i=0;i<n;i++) {
 		if (skynet_mq_pop(q,&msg)) {//队列中没有消息了
+			update_cost(ctx, start, i);
 			skynet_context_release(ctx);//释放上下文，减少上下文的引用计数 为什么？因为skynet_handle_grab会增加上下文的引用计数
 			return skynet_globalmq_pop();//再从全局队列中pop一个队列出来并返回
+		} else if (i==0 && weight == DISPATCH_ADAPTIVE) {//自适应派发
+			n = adaptive_batch(ctx, q);
 		} else if (i==0 && weight >= 0) {//第一次进入循环，并且权重大于等于0
 			n = skynet_mq_length(q);//获取消息队列的长度
 			n >>= weight;//权重值比较大时，对长度进行右移操作，也就是减少处理的消息数目
@@ -331,20 +589,26 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 			skynet_error(ctx, "May overload, message queue length = %d", overload);//将日志输出到logger
 		}
 
+		if (mailbox_drop(ctx, q, &msg))
+			continue;
+
 		skynet_monitor_trigger(sm, msg.source , handle);//触发监视器
 
 		if (ctx->cb == NULL) {//如果上下文的回调函数为空
-			skynet_free(msg.data);//释放掉消息的数据
+			message_free(&msg);//释放掉消息的数据
 		} else {
 			dispatch_message(ctx, &msg);//派发消息，实际上是调用上下文的回调函数处理消息
 		}
 
 		skynet_monitor_trigger(sm, 0,0);//重置监视器
 	}
+	update_cost(ctx, start, n);
 
 	assert(q == ctx->queue);//断言当前的q必然等于上下文内的queue
 	struct message_queue *nq = skynet_globalmq_pop();//再从全局队列pop一个队列出来
-	if (nq) {
+	if (nq || skynet_mq_dedicated(q)) {
+		// A queue just dedicated to its own thread is handed over instead of being dispatched again here.
+		// 刚刚交给专属线程的队列不再由工作线程继续派发，push时会交给专属线程
 		// If global mq is not empty , push q back, and return next queue (nq)
 		// Else (global mq is empty or block, don't push q back, and return q again (for next dispatch)
 		//如果全局队列不为空，那么把分发过消息的 q push回去，然后返回下一个队列做分发
@@ -357,6 +621,73 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 	return q;//返回队列
 }
 
+// The loop of a dedicated thread : wait until the queue is runnable, then dispatch all its messages.
+// The thread exits when the service is released, or when skynet exits.
+// 专属线程的循环：等待队列可运行，然后派发队列中的所有消息，服务释放或者skynet退出时线程结束
+static void *
+dedicated_thread(void *p) {
+	struct message_queue *q = p;
+	uint32_t handle = skynet_mq_handle(q);
+	skynet_initthread(THREAD_WORKER);
+	for (;;) {
+		int quit = skynet_mq_dedicated_wait(q);
+		struct skynet_context * ctx = skynet_handle_grab(handle);
+		if (ctx == NULL) {
+			// The handle is retired before the queue is marked (see delete_context),
+			// skynet_mq_mark_release wakes this thread again, so wait for the mark before dropping the queue.
+			// 句柄先于队列的释放标记失效，标记时会再次唤醒本线程，所以等到有释放标记后才释放队列并结束线程
+			if (skynet_mq_released(q)) {
+				struct drop_t d = { handle };
+				skynet_mq_release(q, drop_message, &d);
+				break;
+			}
+			if (quit)
+				break;
+			continue;
+		}
+		struct skynet_message msg;
+		uint64_t start = cost_start();
+		int n = 0;
+		while (!skynet_mq_pop(q,&msg)) {
+			if (mailbox_drop(ctx, q, &msg)) {
+				continue;
+			} else if (ctx->cb == NULL) {
+				message_free(&msg);
+			} else {
+				dispatch_message(ctx, &msg);
+			}
+			++n;
+		}
+		update_cost(ctx, start, n);
+		skynet_context_release(ctx);
+		if (quit)
+			break;
+	}
+	skynet_payload_thread_exit();
+	return NULL;
+}
+
+// Bind a context to a dedicated thread, others still send to it as usual.
+// 把服务绑定到一个专属线程上，其他服务照常给它发送消息
+void
+skynet_context_dedicate(struct skynet_context * ctx) {
+	struct message_queue *q = ctx->queue;
+	if (skynet_mq_dedicated(q))
+		return;
+	// The queue is handed over by the pushes after this, the thread only pops when it's runnable.
+	// 之后的push会把队列交给专属线程，专属线程只在队列可运行时才pop，所以不会和工作线程同时派发
+	skynet_mq_dedicate(q);
+	pthread_t pid;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&pid, &attr, dedicated_thread, q)) {
+		fprintf(stderr, "Create thread failed");
+		exit(1);
+	}
+	pthread_attr_destroy(&attr);
+}
+
 static void
 copy_name(char name[GLOBALNAME_LENGTH], const char * addr) {
 	int i;
@@ -374,7 +705,7 @@ skynet_queryname(struct skynet_context * context, const char * name) {
 	case ':':
 		return strtoul(name+1,NULL,16);
 	case '.':
-		return skynet_handle_findname(name + 1);
+		return skynet_handle_findname_cache(name + 1, &context->names);
 	}
 	skynet_error(context, "Don't support query global name %s",name);
 	return 0;
@@ -404,14 +735,28 @@ struct command_func {
 
 static const char *
 cmd_timeout(struct skynet_context * context, const char * param) {
-	char * session_ptr = NULL;//没用？
+	char * session_ptr = NULL;//时间值之后的单位
 	int ti = strtol(param, &session_ptr, 10);//取出传入的时间值
 	int session = skynet_context_newsession(context);//新建一个会话
-	skynet_timeout(context->handle, ti, session);//注册一个定时器
+	if (strcmp(session_ptr, "ms") == 0) {//"10ms" 单位为毫秒
+		skynet_timeout_ms(context->handle, ti, session);
+	} else {//单位为百分之一秒
+		skynet_timeout(context->handle, ti, session);//注册一个定时器
+	}
 	sprintf(context->result, "%d", session);//将会话写入上下文的result域
 	return context->result;//返回result
 }
 
+//取消定时器，成功时返回会话
+static const char *
+cmd_cancel(struct skynet_context * context, const char * param) {
+	int session = strtol(param, NULL, 10);
+	if (skynet_timeout_cancel(context->handle, session)) {
+		return param;
+	}
+	return NULL;
+}
+
 static const char *
 cmd_reg(struct skynet_context * context, const char * param) {
 	if (param == NULL || param[0] == '\0') {//param为空或者为空字符串
@@ -583,6 +928,176 @@ cmd_mqlen(struct skynet_context * context, const char * param) {
 	return context->result;
 }
 
+// STAT mqlen/batch/cost/message : dispatch statistics of current service, cost is 0 unless adaptive dispatch is on
+//派发统计：队列长度、最近一次的派发数、每条消息的平均开销(纳秒，只在自适应派发时统计)、已派发的消息总数
+static const char *
+cmd_stat(struct skynet_context * context, const char * param) {
+	if (param == NULL) {
+		return NULL;
+	}
+	if (strcmp(param, "mqlen") == 0) {
+		sprintf(context->result, "%d", skynet_mq_length(context->queue));
+	} else if (strcmp(param, "batch") == 0) {
+		sprintf(context->result, "%d", context->batch);
+	} else if (strcmp(param, "cost") == 0) {
+		sprintf(context->result, "%llu", (unsigned long long)context->cost);
+	} else if (strcmp(param, "message") == 0) {
+		sprintf(context->result, "%llu", (unsigned long long)context->message_count);
+	} else {
+		context->result[0] = '\0';
+	}
+	return context->result;
+}
+
+static const char * mailbox_name[MAILBOX_POLICY_COUNT] = { "drop_newest", "drop_oldest", "error", "slowdown" };
+
+static int
+mailbox_policy_id(const char * name) {
+	int i;
+	for (i=0;i<MAILBOX_POLICY_COUNT;i++) {
+		if (strcmp(name, mailbox_name[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+// MAILBOX : "cap policy" of current service
+// MAILBOX cap policy : set the mailbox of current service, cap 0 means unbounded
+// MAILBOX :handle cap policy : set the mailbox of another service
+// MAILBOX stat : counters of each policy of current service, "drop_newest drop_oldest error slowdown"
+// MAILBOX backpressure : slowdown signals received by current service as a sender since last query
+//服务的邮箱：设置容量和满时的策略，查询每种策略的计数，以及作为发送者收到的减速信号
+static const char *
+cmd_mailbox(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		sprintf(context->result, "%d %s", context->mailbox_cap, mailbox_name[context->mailbox_policy]);
+		return context->result;
+	}
+	if (strcmp(param, "stat") == 0) {
+		sprintf(context->result, "%u %u %u %u",
+			context->mailbox_count[0], context->mailbox_count[1], context->mailbox_count[2], context->mailbox_count[3]);
+		return context->result;
+	}
+	if (strcmp(param, "backpressure") == 0) {
+		uint32_t n = __sync_lock_test_and_set(&context->backpressure, 0);
+		sprintf(context->result, "%u", n);
+		return context->result;
+	}
+	int size = strlen(param);
+	char arg[3][size+1];
+	int n = sscanf(param, "%s %s %s", arg[0], arg[1], arg[2]);
+	struct skynet_context * ctx = context;
+	char (*setting)[size+1] = arg;
+	if (n == 3) {
+		uint32_t handle = tohandle(context, arg[0]);
+		if (handle == 0)
+			return NULL;
+		ctx = skynet_handle_grab(handle);
+		if (ctx == NULL)
+			return NULL;
+		setting = arg + 1;
+	} else if (n != 2) {
+		skynet_error(context, "Invalid mailbox %s", param);
+		return NULL;
+	}
+	int cap = strtol(setting[0], NULL, 10);
+	int policy = mailbox_policy_id(setting[1]);
+	if (cap < 0 || policy < 0) {
+		skynet_error(context, "Invalid mailbox %s", param);
+	} else {
+		ctx->mailbox_policy = policy;
+		ctx->mailbox_cap = cap;
+	}
+	if (ctx != context) {
+		skynet_context_release(ctx);
+	}
+	return NULL;
+}
+
+// DEDICATED : move current service to a dedicated thread
+// DEDICATED :handle : move another service, eg. after launch
+//把服务放到专属线程上运行
+static const char *
+cmd_dedicated(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		skynet_context_dedicate(context);
+		return NULL;
+	}
+	uint32_t handle = tohandle(context, param);
+	if (handle == 0)
+		return NULL;
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL)
+		return NULL;
+	skynet_context_dedicate(ctx);
+	skynet_context_release(ctx);
+	return NULL;
+}
+
+static const char * priority_name[MQ_PRIORITY_COUNT] = { "high", "normal", "low" };
+
+static int
+priority_id(const char * name) {
+	int i;
+	for (i=0;i<MQ_PRIORITY_COUNT;i++) {
+		if (strcmp(name, priority_name[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+// PRIORITY : get the priority class of current service
+// PRIORITY high/normal/low : set the priority class of current service
+// PRIORITY :handle high/normal/low : set the priority class of another service, eg. after launch
+// PRIORITY stat high/normal/low : queueing delay of the class, "count total_ns max_ns"
+// PRIORITY stat on/off : start or stop measuring the queueing delay
+//服务的优先级：查询、设置自己或其他服务的优先级，以及每个优先级的排队延迟统计
+static const char *
+cmd_priority(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		return priority_name[skynet_mq_priority(context->queue)];
+	}
+	int size = strlen(param);
+	char arg1[size+1];
+	char arg2[size+1];
+	arg2[0] = '\0';
+	sscanf(param, "%s %s", arg1, arg2);
+	if (strcmp(arg1, "stat") == 0 && (strcmp(arg2, "on") == 0 || strcmp(arg2, "off") == 0)) {
+		skynet_mq_priority_stat_enable(arg2[1] == 'n');
+		return NULL;
+	}
+	if (arg2[0] == '\0') {
+		int p = priority_id(arg1);
+		if (p < 0) {
+			skynet_error(context, "Invalid priority %s", arg1);
+			return NULL;
+		}
+		skynet_mq_setpriority(context->queue, p);
+		return NULL;
+	}
+	int p = priority_id(arg2);
+	if (p < 0) {
+		skynet_error(context, "Invalid priority %s", arg2);
+		return NULL;
+	}
+	if (strcmp(arg1, "stat") == 0) {
+		uint64_t count, delay, max;
+		skynet_mq_priority_stat(p, &count, &delay, &max);
+		sprintf(context->result, "%llu %llu %llu",
+			(unsigned long long)count, (unsigned long long)delay, (unsigned long long)max);
+		return context->result;
+	}
+	uint32_t handle = tohandle(context, arg1);
+	if (handle == 0)
+		return NULL;
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL)
+		return NULL;
+	skynet_mq_setpriority(ctx->queue, p);
+	skynet_context_release(ctx);
+	return NULL;
+}
+
 static const char *
 cmd_logon(struct skynet_context * context, const char * param) {
 	uint32_t handle = tohandle(context, param);
@@ -627,6 +1142,7 @@ cmd_logoff(struct skynet_context * context, const char * param) {
 //命令名-》命令函数 映射表
 static struct command_func cmd_funcs[] = {
 	{ "TIMEOUT", cmd_timeout },//注册定时器
+	{ "CANCEL", cmd_cancel },//取消定时器
 	{ "REG", cmd_reg },//注册命令
 	{ "QUERY", cmd_query },
 	{ "NAME", cmd_name },//命名服务
@@ -641,6 +1157,10 @@ static struct command_func cmd_funcs[] = {
 	{ "ABORT", cmd_abort },//中止所有服务
 	{ "MONITOR", cmd_monitor },
 	{ "MQLEN", cmd_mqlen },
+	{ "STAT", cmd_stat },
+	{ "PRIORITY", cmd_priority },
+	{ "DEDICATED", cmd_dedicated },
+	{ "MAILBOX", cmd_mailbox },
 	{ "LOGON", cmd_logon },
 	{ "LOGOFF", cmd_logoff },
 	{ NULL, NULL },
@@ -671,7 +1191,7 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
 	}
 
 	if (needcopy && *data) {//如果需要复制数据并且指向数据的指针不为空
-		char * msg = skynet_malloc(*sz+1);//分配内存
+		char * msg = skynet_payload_alloc(*sz+1);//从消息数据的分配器分配内存
 		memcpy(msg, *data, *sz);//内存复制
 		msg[*sz] = '\0';//添加一个字符串结束符
 		*data = msg;//让指向数据的指针指向新的内存地址
@@ -709,15 +1229,104 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		smsg.session = session;//设置会话
 		smsg.data = data;//设置数据
 		smsg.sz = sz;//设置数据大小
+		smsg.shared = 0;
 
-		if (skynet_context_push(destination, &smsg)) {//发送消息到目标的队列中
+		int r = context_push(destination, &smsg);//发送消息到目标的队列中
+		if (r) {
 			skynet_free(data);//push消息到队列失败，则释放数据
-			return -1;
+			if (r < 0)
+				return -1;
+			// dropped by the mailbox of destination, silently
+			// 被目标的邮箱丢弃，发送者不知道
 		}
 	}
 	return session;//返回会话
 }
 
+#define SEND_BATCH 64	//每次批量获取的上下文数
+
+// Send one message to n destinations. Local receivers share one copy of the payload,
+// the handles are grabbed SEND_BATCH at a time.
+// Messages are one-way (session 0), remote destinations get their own copy through harbor.
+// 发送同一条消息给n个目的地，本地的接收者共享一份数据，每次获取一批上下文
+// 消息是单向的(会话为0)，远程的目的地通过harbor各自发送一份拷贝
+// 返回成功投递的目的地数
+int
+skynet_send_batch(struct skynet_context * context, uint32_t source, const uint32_t * destination, int n, int type, void * data, size_t sz) {
+	int dontcopy = type & PTYPE_TAG_DONTCOPY;
+	type &= 0xff;
+	if ((sz & HANDLE_MASK) != sz) {//判断消息是否过大
+		skynet_error(context, "The batch message is too large (sz = %lu)", sz);
+		if (dontcopy) {
+			skynet_free(data);
+		}
+		return -1;
+	}
+	if (source == 0) {
+		source = context->handle;
+	}
+	int i;
+	int local = 0;
+	for (i=0;i<n;i++) {
+		if (destination[i] && !skynet_harbor_message_isremote(destination[i]))
+			++local;
+	}
+	void * payload = NULL;
+	if (data && local > 0) {
+		payload = shared_new(data, sz, local + 1);//发送者持有一个引用，直到投递完成
+	}
+
+	struct skynet_message smsg;
+	smsg.source = source;
+	smsg.session = 0;
+	smsg.data = payload;
+	smsg.sz = sz | (size_t)type << HANDLE_REMOTE_SHIFT;
+	smsg.shared = payload != NULL;
+
+	int count = 0;
+	uint32_t handle[SEND_BATCH];
+	struct skynet_context * ctx[SEND_BATCH];
+	int h = 0;
+	for (i=0;i<=n;i++) {
+		if (i < n) {
+			uint32_t des = destination[i];
+			if (des == 0)
+				continue;
+			if (skynet_harbor_message_isremote(des)) {
+				if (skynet_send(context, source, des, type, 0, data, sz) >= 0)
+					++count;
+				continue;
+			}
+			handle[h++] = des;
+			if (h < SEND_BATCH)
+				continue;
+		}
+		skynet_handle_grabs(handle, h, ctx);
+		int j;
+		for (j=0;j<h;j++) {
+			int r = -1;
+			if (ctx[j]) {
+				r = mailbox_push(ctx[j], &smsg);
+				skynet_context_release(ctx[j]);
+			}
+			if (r >= 0) {
+				++count;
+			}
+			if (r != 0 && payload) {
+				shared_release(payload);
+			}
+		}
+		h = 0;
+	}
+	if (payload) {
+		shared_release(payload);
+	}
+	if (dontcopy) {
+		skynet_free(data);
+	}
+	return count;
+}
+
 //skynet发送消息(目标是字符串地址，也就是服务的名字)
 int
 skynet_sendname(struct skynet_context * context, uint32_t source, const char * addr , int type, int session, void * data, size_t sz) {
@@ -728,7 +1337,7 @@ skynet_sendname(struct skynet_context * context, uint32_t source, const char * a
 	if (addr[0] == ':') {//名字以:开头 ，名字其实就是数字地址，只不过是用字符串表达的 比如":01000008"
 		des = strtoul(addr+1, NULL, 16);//将字符串转化为长整形
 	} else if (addr[0] == '.') {//名字以.开头 本地服务名字
-		des = skynet_handle_findname(addr + 1);//根据名字查找目标地址
+		des = skynet_handle_findname_cache(addr + 1, &context->names);//根据名字查找目标地址，先查本服务的名字缓存
 		if (des == 0) {//没有找到地址
 			if (type & PTYPE_TAG_DONTCOPY) {//如果消息数据是不需要拷贝的
 				skynet_free(data);//消息数据是分配的指针，需要释放掉
@@ -761,6 +1370,12 @@ void
 skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb) {
 	context->cb = cb;
 	context->cb_ud = ud;
+	context->shared_cb = false;
+}
+
+void
+skynet_callback_shared(struct skynet_context * context, int shared) {
+	context->shared_cb = shared != 0;
 }
 
 void
@@ -770,15 +1385,22 @@ skynet_context_send(struct skynet_context * ctx, void * msg, size_t sz, uint32_t
 	smsg.session = session;
 	smsg.data = msg;
 	smsg.sz = sz | type << HANDLE_REMOTE_SHIFT;
+	smsg.shared = 0;
 
 	skynet_mq_push(ctx->queue, &smsg);
 }
 
+void
+skynet_context_measure_cost(int enable) {
+	G_NODE.cost = enable;
+}
+
 void
 skynet_globalinit(void) {
 	//初始化全局节点G_NODE
 	G_NODE.total = 0;
 	G_NODE.monitor_exit = 0;
+	G_NODE.cost = 0;
 	G_NODE.init = 1;
 	//创建线程私有数据
 	if (pthread_key_create(&G_NODE.handle_key, NULL)) {
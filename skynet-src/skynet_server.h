@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 struct skynet_context;
 struct skynet_message;
@@ -11,15 +12,19 @@ struct skynet_monitor;
 
 struct skynet_context * skynet_context_new(const char * name, const char * parm);
 void skynet_context_grab(struct skynet_context *);
+bool skynet_context_trygrab(struct skynet_context *, uint32_t handle);	// for lock-free skynet_handle_grab
 void skynet_context_reserve(struct skynet_context *ctx);
 struct skynet_context * skynet_context_release(struct skynet_context *);
 uint32_t skynet_context_handle(struct skynet_context *);
-int skynet_context_push(uint32_t handle, struct skynet_message *message);
+int skynet_context_push(uint32_t handle, struct skynet_message *message);	// -1 invalid handle, -2 refused by the mailbox
 void skynet_context_send(struct skynet_context * context, void * msg, size_t sz, uint32_t source, int type, int session);
 int skynet_context_newsession(struct skynet_context *);
+#define DISPATCH_ADAPTIVE (-2)	// weight of skynet_context_message_dispatch, choose batch size by backlog, cost and pressure
 struct message_queue * skynet_context_message_dispatch(struct skynet_monitor *, struct message_queue *, int weight);	// return next queue
 int skynet_context_total();
 void skynet_context_dispatchall(struct skynet_context * context);	// for skynet_error output before exit
+void skynet_context_dedicate(struct skynet_context * context);	// dispatch by a dedicated thread
+void skynet_context_measure_cost(int enable);	// measure the cost of dispatch, needed by DISPATCH_ADAPTIVE
 
 void skynet_context_endless(uint32_t handle);	// for monitor
 
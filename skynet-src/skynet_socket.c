@@ -6,6 +6,7 @@
 #include "skynet_server.h"
 #include "skynet_mq.h"
 #include "skynet_harbor.h"
+#include "skynet_payload.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -15,8 +16,8 @@
 static struct socket_server * SOCKET_SERVER = NULL;//全局只有一个
 
 void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create();//新建一个socket服务器
+skynet_socket_init(int thread) {
+	SOCKET_SERVER = socket_server_create_sharded(thread);//新建一个socket服务器，每个socket线程一个分片
 }
 
 void
@@ -43,7 +44,7 @@ forward_message(int type, bool padding, struct socket_message * result) {
 			result->data = "";
 		}
 	}
-	sm = (struct skynet_socket_message *)skynet_malloc(sz);
+	sm = (struct skynet_socket_message *)skynet_payload_alloc(sz);
 	sm->type = type;
 	sm->id = result->id;
 	sm->ud = result->ud;
@@ -59,24 +60,25 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	message.session = 0;
 	message.data = sm;
 	message.sz = sz | PTYPE_SOCKET << HANDLE_REMOTE_SHIFT;
+	message.shared = 0;
 	
 	if (skynet_context_push((uint32_t)result->opaque, &message)) {
 		// todo: report somewhere to close socket
 		// don't call skynet_socket_close here (It will block mainloop)
 		skynet_free(sm->buffer);
-		skynet_free(sm);
+		skynet_payload_free(sm);
 	}
 }
 
 
 //socket循环
 int 
-skynet_socket_poll() {
+skynet_socket_poll(int shard) {
 	struct socket_server *ss = SOCKET_SERVER;//获取socket服务器引用
 	assert(ss);
 	struct socket_message result;//结果(socket消息的形式)
 	int more = 1;
-	int type = socket_server_poll(ss, &result, &more);
+	int type = socket_server_poll_shard(ss, shard, &result, &more);
 	switch (type) {
 	case SOCKET_EXIT:
 		return 0;
@@ -168,6 +170,21 @@ skynet_socket_nodelay(struct skynet_context *ctx, int id) {
 	socket_server_nodelay(SOCKET_SERVER, id);
 }
 
+void
+skynet_socket_stat(struct socket_server_stat *stat) {
+	socket_server_stat(SOCKET_SERVER, stat);
+}
+
+int
+skynet_socket_shard() {
+	return socket_server_shard(SOCKET_SERVER);
+}
+
+void
+skynet_socket_shard_stat(int shard, struct socket_server_stat *stat) {
+	socket_server_shard_stat(SOCKET_SERVER, shard, stat);
+}
+
 int 
 skynet_socket_udp(struct skynet_context *ctx, const char * addr, int port) {
 	uint32_t source = skynet_context_handle(ctx);
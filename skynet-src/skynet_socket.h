@@ -18,10 +18,11 @@ struct skynet_socket_message {
 	char * buffer;
 };
 
-void skynet_socket_init();
+void skynet_socket_init(int thread);
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+int skynet_socket_poll(int shard);
+int skynet_socket_shard();
 
 int skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz);
 void skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz);
@@ -37,4 +38,8 @@ int skynet_socket_udp_connect(struct skynet_context *ctx, int id, const char * a
 int skynet_socket_udp_send(struct skynet_context *ctx, int id, const char * address, const void *buffer, int sz);
 const char * skynet_socket_udp_address(struct skynet_socket_message *, int *addrsz);
 
+struct socket_server_stat;
+void skynet_socket_stat(struct socket_server_stat *stat);
+void skynet_socket_shard_stat(int shard, struct socket_server_stat *stat);
+
 #endif
@@ -5,28 +5,34 @@
 #include "skynet_mq.h"
 #include "skynet_handle.h"
 #include "skynet_module.h"
+#include "skynet_payload.h"
 #include "skynet_timer.h"
 #include "skynet_monitor.h"
 #include "skynet_socket.h"
 #include "skynet_daemon.h"
+#include "skynet_affinity.h"
+#include "malloc_hook.h"
 
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 //监视者们数据结构定义
 //好听点儿的叫法可以叫做监视者 ！！！容器！！！之前的什么们也可以叫做什么容器
 struct monitor {
 	int count;//监视者计数
 	struct skynet_monitor ** m;//存储具体的监视者
-	pthread_cond_t cond;//条件锁	
-	pthread_mutex_t mutex;//互斥锁
-	//为了防止竞争，条件锁的使用总是和一个互斥锁结合在一起
-	//条件锁是用来线程通讯的，但是互斥锁是为了保护这种通讯不会产生逻辑错误，可以正常工作。
-	int sleep;//睡眠线程数
+};
+
+//cpu列表
+struct cpulist {
+	int n;
+	int cpu[MAX_AFFINITY_CPU];
 };
 
 //工作者参数数据结构定义
@@ -34,6 +40,8 @@ struct worker_parm {
 	struct monitor *m;//监视者们引用
 	int id;			//ID
 	int weight;		//权重
+	int node;		//所在的NUMA节点
+	struct cpulist *cpu;	//绑定的cpu，为空列表时不绑定
 };
 
 #define CHECK_ABORT if (skynet_context_total()==0) break;//检查是否停止，根据上下文的数目
@@ -47,36 +55,31 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	}
 }
 
-//唤醒休眠的线程
-//busy代表需要保持忙的线程数
-//当busy=0时：
-//条件为m->sleep>=m->count，代表全部线程都睡眠的情况下才唤醒一个工作线程
-//当busy=m->count-1时：
-//条件为m->sleep>=1,代表只要有一个工作线程休眠了，就唤醒一个线程
+//把线程绑定到n个cpu上，失败只是警告
 static void
-wakeup(struct monitor *m, int busy) {
-	if (m->sleep >= m->count - busy) {//如果睡眠线程数大于等于总工作线程数-busy（代表需要保持忙的线程数）
-		// m->count为监视者数等于工作线程数
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);//唤醒一个线程
+bind_cpu(pthread_t pid, const char *name, const int *cpu, int n) {
+	if (n > 0 && skynet_affinity_bind(pid, cpu, n)) {
+		skynet_error(NULL, "Can't bind %s thread to cpu %d", name, cpu[0]);
 	}
 }
 
-//socket线程工作函数
+#define WORKER_SPIN 64	//工作线程找不到消息队列时，休眠前先自旋的次数
+
+//socket线程工作函数，p是这个线程负责的分片
 static void *
 _socket(void *p) {
-	struct monitor * m = p;//获取到监视者们
+	int shard = *(int *)p;
 	skynet_initthread(THREAD_SOCKET);//初始化线程私有数据
 	for (;;) {//死循环
-		int r = skynet_socket_poll();//处理socket循环
+		int r = skynet_socket_poll(shard);//处理socket循环
 		if (r==0)//SOCKET_EXIT的情况下
 			break;//跳出死循环
 		if (r<0) {//返回值小于0的情况下
 			CHECK_ABORT//检查是否跳出死循环
-			continue;//继续循环，不用唤醒睡眠线程
+			continue;//继续循环
 		}
-		wakeup(m,0);//唤醒睡眠线程
-		// 全部线程都睡眠的情况下才唤醒一个工作线程(即只要有工作线程处于工作状态，则不需要唤醒)
+		// pushing the socket message into a queue wakes a parked worker, see skynet_mq_park
+		// 把socket消息放入消息队列时会直接唤醒休眠的工作线程
 	}
 	return NULL;
 }
@@ -88,8 +91,6 @@ free_monitor(struct monitor *m) {
 	for (i=0;i<n;i++) {//遍历监视者
 		skynet_monitor_delete(m->m[i]);//删除监视者
 	}
-	pthread_mutex_destroy(&m->mutex);//销毁互斥锁
-	pthread_cond_destroy(&m->cond);//销毁条件锁
 	skynet_free(m->m);//释放指针数组
 	skynet_free(m);//释放监视者们
 }
@@ -119,18 +120,16 @@ _monitor(void *p) {
 //时钟线程工作函数
 static void *
 _timer(void *p) {
-	struct monitor * m = p;//获取监视者容器
 	skynet_initthread(THREAD_TIMER);//初始化线程私有数据
 	for (;;) {//死循环
-		skynet_updatetime();//更新时钟
+		skynet_updatetime();//更新时钟，到期的定时器消息放入消息队列时会直接唤醒休眠的工作线程
 		CHECK_ABORT//检查是否跳出循环
-		wakeup(m,m->count-1);//唤醒休眠线程 只要有一个睡眠线程就唤醒，让工作线程热起来
-		usleep(2500);//休眠2500微妙
+		skynet_timer_wait();//休眠到下一个有定时器要处理的格，时间轮为空时最长休眠1秒
 	}
 	// wakeup socket thread
 	skynet_socket_exit();
 	// wakeup all worker thread
-	pthread_cond_broadcast(&m->cond);//唤醒所有工作线程
+	skynet_mq_wakeup_all();//唤醒所有工作线程
 	return NULL;
 }
 
@@ -144,62 +143,132 @@ _worker(void *p) {
 	struct monitor *m = wp->m;//获取到监视者们
 	struct skynet_monitor *sm = m->m[id];//根据id从监视者们获取到具体的监视者引用
 	skynet_initthread(THREAD_WORKER);//线程私有数据初始化
+	bind_cpu(pthread_self(), "worker", wp->cpu->cpu, wp->cpu->n);//绑定cpu
+	skynet_localmq_bind(id, wp->node);//绑定本线程的本地运行队列
 	struct message_queue * q = NULL;//定义消息队列指针
+	int spin = 0;//自旋次数
 	for (;;) {//死循环
 		q = skynet_context_message_dispatch(sm, q, weight);//不断的从 globalmq 里取出二级 mq
 		if (q == NULL) {//如果返回的消息队列为空，则代表当前没有队列有消息要分发
-			//pthread_mutex_lock在成功完成之后会返回零
-			//下面的语句在返回时，互斥锁已经被锁定
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;//自增睡眠线程数
-				// "spurious wakeup" is harmless,
-				// because skynet_context_message_dispatch() can be call at any time.
-
-				// 在调用pthread_cond_wait()前必须由本线程加锁（pthread_mutex_lock()）
-				// 而在更新条件等待队列以前，mutex保持锁定状态，并在线程挂起进入等待前解锁(其他线程就可以继续使用互斥锁了)
-				// 在条件满足从而离开pthread_cond_wait()之前，mutex将被重新加锁，以与进入pthread_cond_wait()前的加锁动作对应
-				// 所以下面的代码中还有一个解锁的动作
-
-				// 激发条件有两种形式，pthread_cond_signal()激活一个等待该条件的线程，存在多个等待线程时按入队顺序激活其中一个；而pthread_cond_broadcast()则激活所有等待线程。
-				pthread_cond_wait(&m->cond, &m->mutex);//等待条件
-				-- m->sleep;//自减睡眠线程数
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
-				}
+			// Spin a little before parking, a queue may be pushed soon (eg. the response of a call).
+			// 休眠前先自旋一会儿，可能很快就有消息队列被push(比如call的回应)
+			if (spin == 0) {
+				skynet_mq_spin(1);
+			}
+			if (++spin < WORKER_SPIN) {
+				CHECK_ABORT
+				sched_yield();
+				continue;
 			}
-		} 
+			spin = 0;
+			skynet_mq_spin(0);
+			skynet_mq_park();//休眠，直到有消息队列被push
+		} else if (spin) {
+			spin = 0;
+			skynet_mq_spin(0);
+		}
 		CHECK_ABORT//检查是否跳出死循环
 	}
 	return NULL;
 }
 
+//解析配置项key的cpu列表，没有配置时为空列表
+static struct cpulist *
+cpulist_new(const char *key, const char *str) {
+	struct cpulist *l = skynet_malloc(sizeof(*l));
+	l->n = 0;
+	if (str) {
+		l->n = skynet_cpulist_parse(str, l->cpu, MAX_AFFINITY_CPU);
+		if (l->n <= 0) {
+			fprintf(stderr, "Invalid %s : %s\n", key, str);
+			exit(1);
+		}
+	}
+	return l;
+}
+
+static bool
+cpulist_has(struct cpulist *l, int cpu) {
+	int i;
+	for (i=0;i<l->n;i++) {
+		if (l->cpu[i] == cpu)
+			return true;
+	}
+	return false;
+}
+
+// Place the workers : worker i runs on the i-th cpu of worker_cpu (round robin) if it's set.
+// In NUMA mode workers are spread over the nodes, a worker with a cpu belongs to the node of the cpu,
+// otherwise it's bound to all cpus of its node.
+// 工作线程的放置：配置了worker_cpu时第i个工作线程绑定到其中第i个cpu上(循环使用)
+// NUMA模式下工作线程轮流分配到各个节点，指定了cpu的属于cpu所在的节点，没有指定的绑定到节点的所有cpu上
 static void
-_start(int thread) {
-	pthread_t pid[thread+3];//保存线程ID的数组，多分配了3个槽
+place_workers(struct skynet_config *config, int node, struct worker_parm *wp, int thread) {
+	struct cpulist *worker_cpu = cpulist_new("worker_cpu", config->worker_cpu);
+	struct cpulist *node_cpu[node];
+	int i;
+	for (i=0;i<node;i++) {
+		node_cpu[i] = skynet_malloc(sizeof(struct cpulist));
+		node_cpu[i]->n = node > 1 ? skynet_numa_cpulist(i, node_cpu[i]->cpu, MAX_AFFINITY_CPU) : 0;
+	}
+	for (i=0;i<thread;i++) {
+		struct cpulist *l = skynet_malloc(sizeof(*l));
+		wp[i].node = i % node;
+		if (worker_cpu->n > 0) {
+			int cpu = worker_cpu->cpu[i % worker_cpu->n];
+			int j;
+			for (j=0;j<node;j++) {
+				if (cpulist_has(node_cpu[j], cpu)) {
+					wp[i].node = j;
+					break;
+				}
+			}
+			l->n = 1;
+			l->cpu[0] = cpu;
+		} else {
+			l->n = node_cpu[wp[i].node]->n;
+			memcpy(l->cpu, node_cpu[wp[i].node]->cpu, l->n * sizeof(int));
+		}
+		wp[i].cpu = l;
+	}
+	for (i=0;i<node;i++) {
+		skynet_free(node_cpu[i]);
+	}
+	skynet_free(worker_cpu);
+}
+
+static void
+_start(struct skynet_config *config, int node) {
+	int thread = config->thread;
+	int socket_thread = skynet_socket_shard();
+	pthread_t pid[thread+2+socket_thread];//保存线程ID的数组，多分配了监视、时钟和socket线程的槽
+	int shard[socket_thread];
 
 	struct monitor *m = skynet_malloc(sizeof(*m));//分配monitor内存
 	memset(m, 0, sizeof(*m));//清空monitor内存
 	m->count = thread;//监视者的数目同线程数相同
-	m->sleep = 0;//睡眠线程数
 
 	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));//为存储具体的监视者分配内存,实际上是指针数组，所以是线程数*指针的大小
 	int i;
 	for (i=0;i<thread;i++) {
 		m->m[i] = skynet_monitor_new();//创建监视者并存储
 	}
-	if (pthread_mutex_init(&m->mutex, NULL)) {//初始化互斥锁
-		fprintf(stderr, "Init mutex error");
-		exit(1);
-	}
-	if (pthread_cond_init(&m->cond, NULL)) {//初始化条件锁
-		fprintf(stderr, "Init cond error");
-		exit(1);
-	}
 
 	create_thread(&pid[0], _monitor, m);//创建监视线程
 	create_thread(&pid[1], _timer, m);//创建时钟线程
-	create_thread(&pid[2], _socket, m);//创建socket线程
+	for (i=0;i<socket_thread;i++) {
+		shard[i] = i;
+		create_thread(&pid[i+2], _socket, &shard[i]);//创建socket线程，每个分片一个
+	}
+
+	struct cpulist *l = cpulist_new("timer_cpu", config->timer_cpu);
+	bind_cpu(pid[1], "timer", l->cpu, l->n);
+	skynet_free(l);
+	l = cpulist_new("socket_cpu", config->socket_cpu);
+	for (i=0;i<socket_thread;i++) {
+		bind_cpu(pid[i+2], "socket", l->cpu, l->n);
+	}
+	skynet_free(l);
 
 	static int weight[] = {//权重数组 大小为8*4=32
 		-1, -1, -1, -1, 0, 0, 0, 0,
@@ -211,17 +280,25 @@ _start(int thread) {
 		wp[i].m = m;//设置监视者们引用
 		wp[i].id = i;//设置ID
 		//sizeof(weight)/sizeof(weight[0])是计算出权重数组的大小，现在大小为24
-		if (i < sizeof(weight)/sizeof(weight[0])) {//当i小于权重数组的时候
+		if (config->adaptive_dispatch) {
+			wp[i].weight = DISPATCH_ADAPTIVE;//由派发时的积压、开销和全局压力决定
+		} else if (i < sizeof(weight)/sizeof(weight[0])) {//当i小于权重数组的时候
 			wp[i].weight= weight[i];//权重值为数组内的值
 		} else {
 			wp[i].weight = 0;//当大于等于权重数组的时候，权重值为0
 		}
-		create_thread(&pid[i+3], _worker, &wp[i]);//创建工作线程
+	}
+	place_workers(config, node, wp, thread);//决定每个工作线程的节点和cpu
+	for (i=0;i<thread;i++) {
+		create_thread(&pid[i+2+socket_thread], _worker, &wp[i]);//创建工作线程
 	}
 
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<thread+2+socket_thread;i++) {
 		pthread_join(pid[i], NULL);//等待线程们退出 
 	}
+	for (i=0;i<thread;i++) {
+		skynet_free(wp[i].cpu);
+	}
 
 	free_monitor(m);//释放监视者们和具体的监视者
 }
@@ -249,11 +326,23 @@ skynet_start(struct skynet_config * config) {
 	}
 	//初始化各个组件
 	skynet_harbor_init(config->harbor);//harbor初始化
-	skynet_handle_init(config->harbor);//句柄初始化
-	skynet_mq_init();//消息队列初始化
+	skynet_handle_init(config->harbor, config->handle_slots);//句柄初始化
+	int node = 1;//NUMA节点数，非NUMA模式为1
+	if (config->numa) {
+		node = skynet_numa_node_count();
+		if (node > config->thread)
+			node = config->thread;
+		if (node > MAX_NUMA_NODE)
+			node = MAX_NUMA_NODE;
+	}
+	skynet_mq_init(config->thread, node);//消息队列初始化，每个工作线程一个本地运行队列，每个节点一个全局队列
+	skynet_mq_priority_stat_enable(config->priority_stat);
+	skynet_context_measure_cost(config->adaptive_dispatch);//只有自适应派发需要统计开销
 	skynet_module_init(config->module_path);//模块初始化
-	skynet_timer_init();//时钟初始化
-	skynet_socket_init();//socket初始化
+	skynet_timer_init(config->timer_resolution);//时钟初始化
+	skynet_payload_init(config->payload_cache);//消息数据分配器初始化
+	malloc_limit_default((size_t)config->memory_soft_limit << 20, (size_t)config->memory_hard_limit << 20);//服务内存限制的默认值
+	skynet_socket_init(config->socket_thread);//socket初始化，每个socket线程一个分片
 
 	struct skynet_context *ctx = skynet_context_new("logger", config->logger);//加载日志模块
 	if (ctx == NULL) {
@@ -263,7 +352,13 @@ skynet_start(struct skynet_config * config) {
 
 	bootstrap(ctx, config->bootstrap);//加载引导模块,传入的ctx是日志模块的上下文
 
-	_start(config->thread);//启动各个线程开始工作
+	if (config->logger_thread) {
+		// after bootstrap, bootstrap may dispatch logger in main thread when it fails
+		// 在bootstrap之后，因为bootstrap失败时会在主线程中派发日志服务的消息
+		skynet_context_dedicate(ctx);
+	}
+
+	_start(config, node);//启动各个线程开始工作
 
 	// harbor_exit may call socket send, so it should exit before socket_free
 	// harbor_exit 可能会调用 socket send,所以他应该在socket_free之前退出
@@ -11,11 +11,17 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #if defined(__APPLE__)
 #include <sys/time.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
 typedef void (*timer_execute_func)(void *ud,void *arg);
 
 #define LOCK(q) while (__sync_lock_test_and_set(&(q)->lock,1)) {}
@@ -28,14 +34,59 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
 
+// The wheel ticks every TI->resolution milliseconds (1, 2, 5 or 10), the default is 10 (centisecond).
+// skynet_timeout and skynet_gettime keep counting in centiseconds whatever the resolution is.
+// 时间轮每TI->resolution毫秒走一格(1,2,5或10)，默认是10(百分之一秒)
+// skynet_timeout和skynet_gettime不论精度是多少都以百分之一秒为单位
+#define DEFAULT_RESOLUTION 10
+
+#define DEFAULT_INDEX_SIZE 64
+#define TIMER_POOL_MAX 65536	// free nodes kept for reuse
+
+// The timer thread sleeps until the next tick that has work (a non-empty near slot, or a cascade from the
+// levels), at most TIMER_IDLE_MAX ms. A timer added while it sleeps wakes it if the timer is due earlier.
+// The wheel may lag behind the clock while the thread sleeps : a timer records its deadline on the clock, and
+// skynet_gettime reads the clock instead of the last update.
+// 时钟线程休眠到下一个有事可做的格(near中不为空的槽，或者从高层级移下来)，最长TIMER_IDLE_MAX毫秒
+// 休眠期间加入的定时器如果更早到期会唤醒它。休眠时时间轮会落后于时钟：定时器记录的是时钟上的到期时间，
+// skynet_gettime读时钟而不是上次更新的值
+#define TIMER_IDLE_MAX 1000
+
+// Workers don't touch the wheel. timer_add appends the timer to the pending list of a shard chosen by the
+// handle, and the timer thread merges the pending lists into the wheel before each tick. Each shard has its
+// own lock, cancel index and node pool. The timers of one service are in one shard, so they keep their order.
+// 工作线程不接触时间轮。timer_add把定时器加入按句柄选择的分片的待处理链表，时钟线程在每格之前把它们合并到时间轮
+// 每个分片有自己的锁、取消索引和节点池。同一个服务的定时器在同一个分片中，所以保持顺序
+#define TIMER_SHARD 16
+
 struct timer_event {
 	uint32_t handle;
 	int session;
 };
 
+// A timer is indexed by (handle, session) for cancellation. A cancelled timer is removed from the index
+// and marked with handle 0, it stays in the wheel until its slot is reached and then goes back to the pool,
+// so it never reaches dispatch.
+// 定时器按(句柄，会话)索引以便取消，取消的定时器从索引中移除并将句柄置0
+// 它留在时间轮中，直到到达它的槽时回到节点池，不会被派发
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *hnext;	//索引链表中的下一个
 	uint32_t expire;
+	int shard;					//所在的分片
+	uint64_t deadline;			//到期的时钟格数
+	struct timer_event event;
+};
+
+struct timer_shard {
+	int lock;
+	struct timer_node *pending;			//还没有合并到时间轮的定时器
+	struct timer_node **pending_tail;
+	struct timer_node **index;	//(句柄，会话)索引
+	int index_size;
+	int index_count;
+	struct timer_node *pool;	//空闲节点池
+	int pool_count;
 };
 
 struct link_list {
@@ -46,12 +97,20 @@ struct link_list {
 struct timer {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
-	int lock;
-	uint32_t time;
-	uint32_t current;
+	uint32_t time;			//走过的格数，只有时钟线程访问时间轮
+	uint32_t current;		//启动以来的百分之一秒数
 	uint32_t starttime;
-	uint64_t current_point;
+	uint64_t current_point;	//上次更新时的格数
 	uint64_t origin_point;
+	int resolution;			//每格的毫秒数
+	int tick_per_cs;		//每百分之一秒的格数
+	uint32_t tick_remain;	//还不满百分之一秒的格数
+	struct timer_shard shard[TIMER_SHARD];
+	uint64_t time_point;	//time对应的格数(时钟)
+	volatile uint64_t wait_point;	//时钟线程休眠到的时钟格数
+	volatile int sleeping;			//时钟线程是否在休眠
+	int fd;					//timerfd，-1表示用usleep
+	volatile uint32_t version;	//current，current_point，tick_remain的版本，奇数表示正在更新
 };
 
 static struct timer * TI = NULL;
@@ -66,7 +125,7 @@ link_clear(struct link_list *list) {
 }
 
 static inline void
-link(struct link_list *list,struct timer_node *node) {
+link_node(struct link_list *list,struct timer_node *node) {
 	list->tail->next = node;
 	list->tail = node;
 	node->next=0;
@@ -78,7 +137,7 @@ add_node(struct timer *T,struct timer_node *node) {
 	uint32_t current_time=T->time;
 	
 	if ((time|TIME_NEAR_MASK)==(current_time|TIME_NEAR_MASK)) {
-		link(&T->near[time&TIME_NEAR_MASK],node);
+		link_node(&T->near[time&TIME_NEAR_MASK],node);
 	} else {
 		int i;
 		uint32_t mask=TIME_NEAR << TIME_LEVEL_SHIFT;
@@ -89,21 +148,194 @@ add_node(struct timer *T,struct timer_node *node) {
 			mask <<= TIME_LEVEL_SHIFT;
 		}
 
-		link(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
+		link_node(&T->t[i][((time>>(TIME_NEAR_SHIFT + i*TIME_LEVEL_SHIFT)) & TIME_LEVEL_MASK)],node);	
 	}
 }
 
+// The ticks and the timerfd deadline use the same clock, so they don't drift apart when the clock is slewed.
+// CLOCK_MONOTONIC is read through vdso, CLOCK_MONOTONIC_RAW isn't on older kernels.
+// 时钟的tick和timerfd使用同一个时钟，时钟被调整(slew)时两者不会偏离
+#define CLOCK_TIMER CLOCK_MONOTONIC
+
+// monotonic time in nanoseconds, for the timer and for measuring the cost of message dispatch.
+//单调时间(纳秒)，用于时钟和统计消息派发的开销
+uint64_t
+skynet_monotonic_time(void) {
+#if !defined(__APPLE__)
+	struct timespec ti;
+	clock_gettime(CLOCK_TIMER, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+// monotonic time in ticks
+static inline uint64_t
+gettime(int resolution) {
+	return skynet_monotonic_time() / ((uint64_t)resolution * 1000000);
+}
+
+static inline void
+begin_update(struct timer *T) {
+	++T->version;
+	__sync_synchronize();
+}
+
+static inline void
+end_update(struct timer *T) {
+	__sync_synchronize();
+	++T->version;
+}
+
+//唤醒休眠的时钟线程
 static void
-timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
-	memcpy(node+1,arg,sz);
+timer_wakeup(struct timer *T) {
+#if defined(__linux__)
+	if (T->fd >= 0) {
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_nsec = 1;
+		timerfd_settime(T->fd, 0, &its, NULL);
+	}
+#endif
+}
 
-	LOCK(T);
+static inline struct timer_node **
+index_slot(struct timer_shard *S, uint32_t handle, int session) {
+	uint32_t h = (handle * 2654435761u) ^ (uint32_t)session;
+	return &S->index[h & (S->index_size - 1)];
+}
 
-		node->expire=time+T->time;
-		add_node(T,node);
+static void
+index_add(struct timer_shard *S, struct timer_node *node) {
+	if (S->index_count >= S->index_size) {//扩容
+		struct timer_node **old = S->index;
+		int old_size = S->index_size;
+		S->index_size *= 2;
+		S->index = skynet_malloc(S->index_size * sizeof(struct timer_node *));
+		memset(S->index, 0, S->index_size * sizeof(struct timer_node *));
+		int i;
+		for (i=0;i<old_size;i++) {
+			struct timer_node *n = old[i];
+			while (n) {
+				struct timer_node *next = n->hnext;
+				struct timer_node **slot = index_slot(S, n->event.handle, n->event.session);
+				n->hnext = *slot;
+				*slot = n;
+				n = next;
+			}
+		}
+		skynet_free(old);
+	}
+	struct timer_node **slot = index_slot(S, node->event.handle, node->event.session);
+	node->hnext = *slot;
+	*slot = node;
+	++S->index_count;
+}
 
-	UNLOCK(T);
+static struct timer_node *
+index_remove(struct timer_shard *S, uint32_t handle, int session) {
+	struct timer_node **slot = index_slot(S, handle, session);
+	while (*slot) {
+		struct timer_node *n = *slot;
+		if (n->event.handle == handle && n->event.session == session) {
+			*slot = n->hnext;
+			--S->index_count;
+			return n;
+		}
+		slot = &n->hnext;
+	}
+	return NULL;
+}
+
+//节点放回所在分片的节点池，需要持有分片的锁
+static inline void
+node_release(struct timer_shard *S, struct timer_node *node) {
+	if (S->pool_count < TIMER_POOL_MAX / TIMER_SHARD) {
+		node->next = S->pool;
+		S->pool = node;
+		++S->pool_count;
+	} else {
+		skynet_free(node);
+	}
+}
+
+static inline void
+node_free(struct timer *T, struct timer_node *node) {
+	struct timer_shard *S = &T->shard[node->shard];
+	LOCK(S);
+	node_release(S, node);
+	UNLOCK(S);
+}
+
+static void
+timer_add(struct timer *T,struct timer_event *event,uint32_t time) {
+	int shard = event->handle & (TIMER_SHARD-1);
+	struct timer_shard *S = &T->shard[shard];
+	LOCK(S);
+	struct timer_node *node = S->pool;//先从节点池取
+	if (node) {
+		S->pool = node->next;
+		--S->pool_count;
+	}
+	UNLOCK(S);
+	if (node == NULL) {
+		node = (struct timer_node *)skynet_malloc(sizeof(*node));
+	}
+	node->event = *event;
+	node->shard = shard;
+	node->deadline = gettime(T->resolution) + time;
+	node->next = NULL;
+
+	LOCK(S);
+
+		*S->pending_tail = node;
+		S->pending_tail = &node->next;
+		index_add(S,node);
+
+	UNLOCK(S);
+
+	// pair with the check of pending lists in skynet_timer_wait
+	__sync_synchronize();
+	if (T->sleeping && node->deadline < T->wait_point) {
+		timer_wakeup(T);
+	}
+}
+
+//把各分片待处理的定时器合并到时间轮，只在时钟线程调用
+static void
+timer_merge(struct timer *T) {
+	int i;
+	for (i=0;i<TIMER_SHARD;i++) {
+		struct timer_shard *S = &T->shard[i];
+		if (S->pending == NULL)
+			continue;
+		LOCK(S);
+		struct timer_node *current = S->pending;
+		S->pending = NULL;
+		S->pending_tail = &S->pending;
+		UNLOCK(S);
+		while (current) {
+			struct timer_node *next = current->next;
+			uint64_t tick = current->deadline > T->time_point ? current->deadline - T->time_point : 1;
+			current->expire = T->time + (uint32_t)tick;
+			add_node(T, current);
+			current = next;
+		}
+	}
+}
+
+static int
+timer_pending(struct timer *T) {
+	int i;
+	for (i=0;i<TIMER_SHARD;i++) {
+		if (T->shard[i].pending)
+			return 1;
+	}
+	return 0;
 }
 
 static void
@@ -111,16 +343,20 @@ move_list(struct timer *T, int level, int idx) {
 	struct timer_node *current = link_clear(&T->t[level][idx]);
 	while (current) {
 		struct timer_node *temp=current->next;
-		add_node(T,current);
+		if (current->event.handle == 0) {//已取消
+			node_free(T, current);
+		} else {
+			add_node(T,current);
+		}
 		current=temp;
 	}
 }
 
 static void
 timer_shift(struct timer *T) {
-	LOCK(T);
 	int mask = TIME_NEAR;
 	uint32_t ct = ++T->time;
+	++T->time_point;
 	if (ct == 0) {
 		move_list(T, 3, 0);
 	} else {
@@ -138,41 +374,63 @@ timer_shift(struct timer *T) {
 			++i;
 		}
 	}
-	UNLOCK(T);
+}
+
+//从索引中移除到期的节点，取消的节点放回节点池，返回需要派发的链表
+static struct timer_node *
+expire_list(struct timer *T, struct timer_node *current) {
+	struct timer_node *head = NULL;
+	struct timer_node **tail = &head;
+	while (current) {
+		struct timer_node *next = current->next;
+		struct timer_shard *S = &T->shard[current->shard];
+		LOCK(S);
+		if (current->event.handle == 0) {//已取消
+			node_release(S, current);
+		} else {
+			index_remove(S, current->event.handle, current->event.session);
+			*tail = current;
+			tail = &current->next;
+		}
+		UNLOCK(S);
+		current = next;
+	}
+	*tail = NULL;
+	return head;
 }
 
 static inline void
 dispatch_list(struct timer_node *current) {
 	do {
-		struct timer_event * event = (struct timer_event *)(current+1);
+		struct timer_event * event = &current->event;
 		struct skynet_message message;
 		message.source = 0;
 		message.session = event->session;
 		message.data = NULL;
 		message.sz = PTYPE_RESPONSE << HANDLE_REMOTE_SHIFT;
+		message.shared = 0;
 
 		skynet_context_push(event->handle, &message);
 		
-		struct timer_node * temp = current;
 		current=current->next;
-		skynet_free(temp);	
 	} while (current);
 }
 
 static inline void
 timer_execute(struct timer *T) {
-	LOCK(T);
 	int idx = T->time & TIME_NEAR_MASK;
 	
 	while (T->near[idx].head.next) {
-		struct timer_node *current = link_clear(&T->near[idx]);
-		UNLOCK(T);
-		// dispatch_list don't need lock T
+		struct timer_node *current = expire_list(T, link_clear(&T->near[idx]));
+		if (current == NULL)
+			continue;
 		dispatch_list(current);
-		LOCK(T);
+		while (current) {
+			struct timer_node *next = current->next;
+			node_free(T, current);
+			current = next;
+		}
 	}
-
-	UNLOCK(T);
 }
 
 static void 
@@ -180,6 +438,9 @@ timer_update(struct timer *T) {
 	// try to dispatch timeout 0 (rare condition)
 	timer_execute(T);
 
+	// the new timers are due from the next tick
+	timer_merge(T);
+
 	// shift time first, and then dispatch timer message
 	timer_shift(T);
 
@@ -204,20 +465,27 @@ timer_create_timer() {
 		}
 	}
 
-	r->lock = 0;
 	r->current = 0;
+	for (i=0;i<TIMER_SHARD;i++) {
+		struct timer_shard *S = &r->shard[i];
+		S->pending_tail = &S->pending;
+		S->index_size = DEFAULT_INDEX_SIZE;
+		S->index = skynet_malloc(S->index_size * sizeof(struct timer_node *));
+		memset(S->index, 0, S->index_size * sizeof(struct timer_node *));
+	}
 
 	return r;
 }
 
-int
-skynet_timeout(uint32_t handle, int time, int session) {
+static int
+timeout_tick(uint32_t handle, uint32_t time, int session) {
 	if (time == 0) {//如果传入的时间为0 则不需要添加定时器，直接发消息
 		struct skynet_message message;
 		message.source = 0;
 		message.session = session;
 		message.data = NULL;
 		message.sz = PTYPE_RESPONSE << HANDLE_REMOTE_SHIFT;
+		message.shared = 0;
 
 		if (skynet_context_push(handle, &message)) {//向自己发一个消息
 			return -1;
@@ -226,12 +494,46 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(TI, &event, time);
 	}
 
 	return session;
 }
 
+//取消定时器，返回0表示已经到期(消息可能已在队列中)或者不存在
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	struct timer_shard *S = &TI->shard[handle & (TIMER_SHARD-1)];
+	LOCK(S);
+	struct timer_node *node = index_remove(S, handle, session);
+	if (node) {
+		node->event.handle = 0;//留在时间轮或待处理链表中，到达时回收
+	}
+	UNLOCK(S);
+	return node != NULL;
+}
+
+#define MAX_TICK 0x7fffffff
+
+//定时时间单位为百分之一秒
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	uint64_t tick = time > 0 ? (uint64_t)time * TI->tick_per_cs : 0;
+	return timeout_tick(handle, tick > MAX_TICK ? MAX_TICK : tick, session);
+}
+
+//定时时间单位为毫秒，不足一格的向上取整
+int
+skynet_timeout_ms(uint32_t handle, int ms, int session) {
+	uint64_t tick = ms > 0 ? ((uint64_t)ms + TI->resolution - 1) / TI->resolution : 0;
+	return timeout_tick(handle, tick > MAX_TICK ? MAX_TICK : tick, session);
+}
+
+int
+skynet_timer_resolution(void) {
+	return TI->resolution;
+}
+
 // centisecond: 1/100 second
 static void
 systime(uint32_t *sec, uint32_t *cs) {
@@ -248,42 +550,25 @@ systime(uint32_t *sec, uint32_t *cs) {
 #endif
 }
 
-static uint64_t
-gettime() {
-	uint64_t t;
-#if !defined(__APPLE__)
-
-#ifdef CLOCK_MONOTONIC_RAW
-#define CLOCK_TIMER CLOCK_MONOTONIC_RAW
-#else
-#define CLOCK_TIMER CLOCK_MONOTONIC
-#endif
-
-	struct timespec ti;
-	clock_gettime(CLOCK_TIMER, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
-#else
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	t = (uint64_t)tv.tv_sec * 100;
-	t += tv.tv_usec / 10000;
-#endif
-	return t;
-}
-
 void
 skynet_updatetime(void) {
-	uint64_t cp = gettime();
+	uint64_t cp = gettime(TI->resolution);
 	if(cp < TI->current_point) {
 		skynet_error(NULL, "time diff error: change from %lld to %lld", cp, TI->current_point);
+		begin_update(TI);
 		TI->current_point = cp;
+		end_update(TI);
+		TI->time_point = cp;
 	} else if (cp != TI->current_point) {
 		uint32_t diff = (uint32_t)(cp - TI->current_point);
+		begin_update(TI);
 		TI->current_point = cp;
 
 		uint32_t oc = TI->current;
-		TI->current += diff;
+		TI->tick_remain += diff;
+		TI->current += TI->tick_remain / TI->tick_per_cs;
+		TI->tick_remain %= TI->tick_per_cs;
+		end_update(TI);
 		if (TI->current < oc) {
 			// when cs > 0xffffffff(about 497 days), time rewind
 			TI->starttime += 0xffffffff / 100;
@@ -295,22 +580,125 @@ skynet_updatetime(void) {
 	}
 }
 
+//距离下一个有事可做的格还有几格，0表示时间轮是空的
+static uint32_t
+next_due(struct timer *T) {
+	int i,j;
+	int levels = 0;
+	for (i=0;i<4 && !levels;i++) {
+		for (j=0;j<TIME_LEVEL;j++) {
+			if (T->t[i][j].head.next) {
+				levels = 1;
+				break;
+			}
+		}
+	}
+	for (i=1;i<=TIME_NEAR;i++) {
+		uint32_t t = T->time + i;
+		if ((t & TIME_NEAR_MASK) == 0) {//到达边界时要从高层级移动定时器
+			return levels ? i : 0;
+		}
+		if (T->near[t & TIME_NEAR_MASK].head.next) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+// sleep until the next tick that has work
+void
+skynet_timer_wait(void) {
+	struct timer *T = TI;
+	uint32_t idle = TIMER_IDLE_MAX / T->resolution;
+	timer_merge(T);
+	uint32_t n = next_due(T);
+	if (n == 0 || n > idle) {
+		n = idle;
+	}
+	T->wait_point = T->time_point + n;
+#if defined(__linux__)
+	if (T->fd >= 0) {
+		// arm before sleeping is set, so that a timer_wakeup seeing it is never overwritten
+		uint64_t deadline = T->wait_point * T->resolution * 1000000;
+		uint64_t now = skynet_monotonic_time();
+		uint64_t wait = deadline > now ? deadline - now : 1;
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = wait / 1000000000;
+		its.it_value.tv_nsec = wait % 1000000000;
+		timerfd_settime(T->fd, 0, &its, NULL);
+		T->sleeping = 1;
+		// pair with the barrier in timer_add : either timer_add sees sleeping, or we see its timer
+		__sync_synchronize();
+		if (!timer_pending(T)) {
+			uint64_t expirations;
+			if (read(T->fd, &expirations, sizeof(expirations)) < 0) {
+				// EINTR, update and wait again
+			}
+		}
+		T->sleeping = 0;
+		return;
+	}
+#endif
+	usleep(T->resolution * 250);
+}
+
+void
+skynet_timer_wakeup(void) {
+	timer_wakeup(TI);
+}
+
 uint32_t
 skynet_gettime_fixsec(void) {
 	return TI->starttime;
 }
 
+// the time of the last update plus the ticks since then, the timer thread may be sleeping
 uint32_t 
 skynet_gettime(void) {
-	return TI->current;
+	struct timer *T = TI;
+	uint32_t current, remain, version;
+	uint64_t point;
+	for (;;) {
+		version = T->version;
+		if (version & 1)
+			continue;
+		__sync_synchronize();
+		current = T->current;
+		point = T->current_point;
+		remain = T->tick_remain;
+		__sync_synchronize();
+		if (version == T->version)
+			break;
+	}
+	uint64_t cp = gettime(T->resolution);
+	if (cp > point) {
+		current += (uint32_t)((cp - point + remain) / T->tick_per_cs);
+	}
+	return current;
 }
 
 void 
-skynet_timer_init(void) {
+skynet_timer_init(int resolution) {
 	TI = timer_create_timer();
+	if (resolution <= 0) {
+		resolution = DEFAULT_RESOLUTION;
+	}
+	if (DEFAULT_RESOLUTION % resolution != 0) {
+		fprintf(stderr, "Invalid timer_resolution %d ms, use one of 1 2 5 10\n", resolution);
+		resolution = DEFAULT_RESOLUTION;
+	}
+	TI->resolution = resolution;
+	TI->tick_per_cs = DEFAULT_RESOLUTION / resolution;
 	systime(&TI->starttime, &TI->current);
-	uint64_t point = gettime();
+	uint64_t point = gettime(resolution);
 	TI->current_point = point;
 	TI->origin_point = point;
+	TI->time_point = point;
+#if defined(__linux__)
+	TI->fd = timerfd_create(CLOCK_TIMER, TFD_CLOEXEC);
+#else
+	TI->fd = -1;
+#endif
 }
 
@@ -4,11 +4,18 @@
 
 #include <stdint.h>
 
-int skynet_timeout(uint32_t handle, int time, int session);
+int skynet_timeout(uint32_t handle, int time, int session);	// time in centiseconds
+int skynet_timeout_ms(uint32_t handle, int ms, int session);
+// returns 1 if the timer is cancelled before it expires, its response will never be sent
+int skynet_timeout_cancel(uint32_t handle, int session);
+int skynet_timer_resolution(void);	// milliseconds per tick
 void skynet_updatetime(void);
+void skynet_timer_wait(void);	// sleep until the next tick that has work
+void skynet_timer_wakeup(void);
 uint32_t skynet_gettime(void);
 uint32_t skynet_gettime_fixsec(void);
+uint64_t skynet_monotonic_time(void);	// nanoseconds, for the timer and dispatch cost
 
-void skynet_timer_init(void);
+void skynet_timer_init(int resolution);
 
 #endif
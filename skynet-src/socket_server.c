@@ -1,4 +1,7 @@
 //网络模块
+#ifdef __linux__
+#define _GNU_SOURCE	// recvmmsg / sendmmsg
+#endif
 #include "skynet.h"
 
 #include "socket_server.h"
@@ -15,6 +18,12 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #define MAX_INFO 128
 
@@ -22,6 +31,7 @@
 //连接总数不超过2^16=65536
 #define MAX_SOCKET_P 16　　　　　　　//最大socket数的指数
 
+#define MAX_SHARD 16	//socket线程(分片)数的上限
 #define MAX_EVENT 64　　　　　　　　//最大事件数　　　
 #define MIN_READ_BUFFER 64　　　　//最小读缓冲大小
 #define SOCKET_TYPE_INVALID 0 	//无效的socket
@@ -40,6 +50,7 @@
 #define PRIORITY_LOW 1　//低优先级
 
 #define HASH_ID(id) (((unsigned)id) % MAX_SOCKET)
+#define ID_TAG16(id) ((id>>MAX_SOCKET_P) & 0xffff)
 
 #define PROTOCOL_TCP 0			//TCP
 #define PROTOCOL_UDP 1			//UDP
@@ -49,6 +60,21 @@
 
 #define MAX_UDP_PACKAGE 65535
 
+#if defined(IOV_MAX)
+#define SEND_IOV IOV_MAX	// buffers flushed by one writev
+#elif defined(UIO_MAXIOV)
+#define SEND_IOV UIO_MAXIOV
+#else
+#define SEND_IOV 64
+#endif
+
+#ifdef __linux__
+#define UDP_MMSG
+#define UDP_BATCH 16	// datagrams moved by one recvmmsg/sendmmsg
+#else
+#define UDP_BATCH 1
+#endif
+
 //写缓冲数据结构定义
 struct write_buffer {
 	struct write_buffer * next; // 发送缓冲区构成一个链表
@@ -78,30 +104,60 @@ struct socket {
 	int id;					//应用层维护的一个与fd对应的id 实际上是在socket池中的id
 	uint16_t protocol;		//协议类型
 	uint16_t type;			//socket类型或者状态
+	volatile uint32_t sending;	//高16位是id的标记，低16位是命令队列中还没处理的发送命令数
+	int dw_lock;			//直接写的锁，工作线程写fd时持有
+	int dw_offset;			//直接写已经写出的字节数
+	const void * dw_buffer;	//直接写没有写完的数据，由socket线程接着发送
+	int dw_size;
+	struct socket_shard * shard;	//负责这个socket的分片，由slot下标决定
 	union {
 		int size;	//下一次read操作要分配的缓冲区大小?
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
 	} p;
 };
 
-//socket服务器数据结构定义
-struct socket_server {
-	//管道相关，用于控制命令的传输
-	int recvctrl_fd;	//读取控制文件描述符
-	int sendctrl_fd;	//写入控制文件描述符
-	int checkctrl;		//是否检查控制
+union sockaddr_all {
+	struct sockaddr s;
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+};
 
+// One socket thread : its own event pool and command queue. A socket belongs to the shard
+// of its slot, so all the commands and events of a socket are handled by one thread.
+// 一个socket线程的分片：有自己的事件池和命令队列。socket属于它的slot所在的分片，同一个socket的命令和事件都由一个线程处理
+struct socket_shard {
+	//控制命令队列，其它线程无锁地压入命令，socket线程一次取走整个链表
+	struct request_node * volatile cmd_head;	//新压入的命令，后压入的在前
+	struct request_node * cmd_list;	//socket线程取走的命令，按压入的顺序
+	int cmd_signal;		//socket线程已经被唤醒，压入命令不用再写sendctrl_fd
+	int recvctrl_fd;	//唤醒socket线程的fd(eventfd或者管道)的读取端
+	int sendctrl_fd;	//写入端，eventfd时和读取端相同
+	int checkctrl;		//是否检查控制
 
 	poll_fd event_fd;	//事件池文件描述符
-	int alloc_id;		//应用层分配id用的,得到id再hash得到slot的索引
 	int event_n;		//事件数
 	int event_index;	//事件索引x
-	struct socket_object_interface soi;		//套接字对象接口
 	struct event ev[MAX_EVENT];		//存储已准备好读写的应用层事件	MAX_EVENT:64
-	struct socket slot[MAX_SOCKET];//槽，用于存储应用层套接字	MAX_SOCKET:65536
 	char buffer[MAX_INFO];		//缓冲区	MAX_INFO:128
-	uint8_t udpbuffer[MAX_UDP_PACKAGE];	//udp缓冲区		MAX_UDP_PACKAGE:65535
-	fd_set rfds;	//select的描述符集，用于判断管道是否有控制命令
+	uint8_t udpbuffer[UDP_BATCH][MAX_UDP_PACKAGE];	//udp接收缓冲区，一次recvmmsg最多收UDP_BATCH个包
+#ifdef UDP_MMSG
+	struct mmsghdr udpmsg[UDP_BATCH];
+	struct iovec udpiov[UDP_BATCH];
+	union sockaddr_all udpaddr[UDP_BATCH];
+	int udp_id;			//udpbuffer中还没有转发的包所属的socket
+	int udp_n;			//上次recvmmsg收到的包数
+	int udp_next;		//下一个要转发的包
+#endif
+	struct socket_server_stat stat;	//只由这个分片的socket线程更新
+};
+
+//socket服务器数据结构定义
+struct socket_server {
+	int alloc_id;		//应用层分配id用的,得到id再hash得到slot的索引
+	int shard_n;		//分片数，即socket线程数
+	struct socket_shard * shard;
+	struct socket_object_interface soi;		//套接字对象接口
+	struct socket slot[MAX_SOCKET];//槽，用于存储应用层套接字	MAX_SOCKET:65536
 };
 
 // 以下结构用于控制包体结构
@@ -165,7 +221,7 @@ struct request_udp {
 };
 
 /*
-	The first byte is TYPE  第一个字节为类型
+	The type of a request_node  控制命令的类型
 
 	S Start socket
 	B Bind socket
@@ -183,7 +239,6 @@ struct request_udp {
 
 // 控制命令请求包
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy 头部 6个字节未用 [0-5] [6]是type [7]长度 长度指的是包体的长度
 	union {
 		char buffer[256];
 		struct request_open open;
@@ -200,10 +255,13 @@ struct request_package {
 	uint8_t dummy[256];
 };
 
-union sockaddr_all {
-	struct sockaddr s;
-	struct sockaddr_in v4;
-	struct sockaddr_in6 v6;
+// A command in the queue, buffer is a copy of the len bytes of request_package.u
+// 队列中的控制命令，buffer是request_package.u的前len个字节的拷贝
+struct request_node {
+	struct request_node *next;
+	int type;
+	int len;
+	uint8_t buffer[1];	// aligned by the fields above
 };
 
 struct send_object {
@@ -260,6 +318,7 @@ reserve_id(struct socket_server *ss) {
 			if (__sync_bool_compare_and_swap(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {//重置类型
 				s->id = id;//设置id
 				s->fd = -1;//清空fd
+				s->sending = ID_TAG16(id) << 16;//新id还没有发送命令
 				return id;
 			} else {
 				// retry 重试
@@ -276,9 +335,8 @@ clear_wb_list(struct wb_list *list) {
 	list->tail = NULL;//设置尾为空
 }
 
-//创建socket服务器
-struct socket_server * 
-socket_server_create() {
+static int
+shard_init(struct socket_shard *sh) {
 	int i;
 	int fd[2];
 
@@ -286,48 +344,134 @@ socket_server_create() {
 	poll_fd efd = sp_create();//创建socket poll,socket poll可以看作是一个事件池，不做具体的IO，只是把要监听的fd添加到事件池中进行IO事件（可读或可写）的监听
 	if (sp_invalid(efd)) {//获取的poll_fd无效
 		fprintf(stderr, "socket-server: create event pool failed.\n");
-		return NULL;
+		return 1;
+	}
+	// The commands are in a queue, the fd only wakes up the socket thread.
+	// 命令在队列中，这个fd只用于唤醒socket线程
+#ifdef __linux__
+	fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK);
+	if (fd[0] < 0) {
+		sp_release(efd);//释放socket poll
+		fprintf(stderr, "socket-server: create eventfd failed.\n");
+		return 1;
 	}
-	if (pipe(fd)) {//建立管道，管道用于控制命令的传输
+#else
+	if (pipe(fd)) {//建立管道
 		//fd[0]为管道里的读取端
 		//fd[1]为管道里的写入端
 		sp_release(efd);//释放socket poll
 		fprintf(stderr, "socket-server: create socket pair failed.\n");//创建套接字对失败
-		return NULL;
+		return 1;
 	}
+	fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL, 0) | O_NONBLOCK);
+#endif
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		//添加fd[0]（读取端）到事件池中
 		fprintf(stderr, "socket-server: can't add server fd to event pool.\n");
 		close(fd[0]);//关闭fd[0]
-		close(fd[1]);//关闭fd[1]
+		if (fd[1] != fd[0]) {
+			close(fd[1]);//关闭fd[1]
+		}
 		sp_release(efd);//释放socket poll
-		return NULL;
+		return 1;
+	}
+
+	sh->event_fd = efd;//事件池文件描述符
+	sh->recvctrl_fd = fd[0];//管道读取端fd
+	sh->sendctrl_fd = fd[1];//管道写入端fd
+	sh->checkctrl = 1;//是否检查控制，默认为true
+	sh->cmd_head = NULL;
+	sh->cmd_list = NULL;
+	sh->cmd_signal = 0;
+	sh->event_n = 0;
+	sh->event_index = 0;
+	memset(&sh->stat, 0, sizeof(sh->stat));
+#ifdef UDP_MMSG
+	// the receive buffers are fixed, only msg_namelen changes between calls
+	memset(sh->udpmsg, 0, sizeof(sh->udpmsg));
+	for (i=0;i<UDP_BATCH;i++) {
+		sh->udpiov[i].iov_base = sh->udpbuffer[i];
+		sh->udpiov[i].iov_len = MAX_UDP_PACKAGE;
+		sh->udpmsg[i].msg_hdr.msg_iov = &sh->udpiov[i];
+		sh->udpmsg[i].msg_hdr.msg_iovlen = 1;
+		sh->udpmsg[i].msg_hdr.msg_name = &sh->udpaddr[i];
+	}
+	sh->udp_id = 0;
+	sh->udp_n = 0;
+	sh->udp_next = 0;
+#else
+	(void)i;
+#endif
+	return 0;
+}
+
+static void
+shard_release(struct socket_shard *sh) {
+	struct request_node *node = sh->cmd_list;
+	while (node) {
+		struct request_node *next = node->next;
+		FREE(node);
+		node = next;
+	}
+	node = sh->cmd_head;
+	while (node) {
+		struct request_node *next = node->next;
+		FREE(node);
+		node = next;
+	}
+	if (sh->sendctrl_fd != sh->recvctrl_fd) {
+		close(sh->sendctrl_fd);
+	}
+	close(sh->recvctrl_fd);
+	sp_release(sh->event_fd);
+}
+
+//创建socket服务器，每个分片由一个socket线程调用socket_server_poll_shard
+struct socket_server * 
+socket_server_create_sharded(int shard) {
+	int i;
+	if (shard < 1)
+		shard = 1;
+	if (shard > MAX_SHARD)
+		shard = MAX_SHARD;
+	struct socket_shard * sh = MALLOC(shard * sizeof(*sh));
+	for (i=0;i<shard;i++) {
+		if (shard_init(&sh[i])) {
+			while (--i >= 0) {
+				shard_release(&sh[i]);
+			}
+			FREE(sh);
+			return NULL;
+		}
 	}
 
 	struct socket_server *ss = MALLOC(sizeof(*ss));//为socket server分配内存
-	ss->event_fd = efd;//事件池文件描述符
-	ss->recvctrl_fd = fd[0];//管道读取端fd
-	ss->sendctrl_fd = fd[1];//管道写入端fd
-	ss->checkctrl = 1;//是否检查控制，默认为true
+	ss->shard_n = shard;
+	ss->shard = sh;
 
 	for (i=0;i<MAX_SOCKET;i++) {
 		struct socket *s = &ss->slot[i];//取存储套接字槽的地址
 		s->type = SOCKET_TYPE_INVALID;//类型初始化为无效
+		s->sending = 0;
+		s->dw_lock = 0;
+		s->dw_buffer = NULL;
+		s->shard = &sh[i % shard];//id hash到这个slot的socket都由这个分片处理
 		clear_wb_list(&s->high);//清除写缓冲（高）列表
 		clear_wb_list(&s->low);//清除写缓冲（低）列表
 	}
 	//初始化字段
 	ss->alloc_id = 0;
-	ss->event_n = 0;
-	ss->event_index = 0;
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);//将set清零使集合中不含任何fd
-	assert(ss->recvctrl_fd < FD_SETSIZE);
 
 	return ss;
 }
 
+struct socket_server * 
+socket_server_create() {
+	return socket_server_create_sharded(1);
+}
+
 static void
 free_wb_list(struct socket_server *ss, struct wb_list *list) {
 	struct write_buffer *wb = list->head;
@@ -340,8 +484,27 @@ free_wb_list(struct socket_server *ss, struct wb_list *list) {
 	list->tail = NULL;
 }
 
+// The direct write lock : a worker thread holds it while it writes the fd (see socket_server_send),
+// the socket thread takes it when it picks up the remainder, flushes the write lists or closes the fd.
+// 直接写的锁：工作线程写fd时持有(见socket_server_send)，socket线程接手剩余数据、发送写列表或者关闭fd时持有
+static inline void
+dw_lock(struct socket *s) {
+	while (__sync_lock_test_and_set(&s->dw_lock, 1)) {}
+}
+
+static inline int
+dw_trylock(struct socket *s) {
+	return __sync_lock_test_and_set(&s->dw_lock, 1) == 0;
+}
+
+static inline void
+dw_unlock(struct socket *s) {
+	__sync_lock_release(&s->dw_lock);
+}
+
+// call it with dw_lock held
 static void
-force_close(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+force_close_locked(struct socket_server *ss, struct socket *s, struct socket_message *result) {
 	result->id = s->id;
 	result->ud = 0;
 	result->data = NULL;
@@ -350,10 +513,16 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 		return;
 	}
 	assert(s->type != SOCKET_TYPE_RESERVE);
+	if (s->dw_buffer) {
+		struct send_object so;
+		send_object_init(ss, &so, (void *)s->dw_buffer, s->dw_size);
+		so.free_func((void *)s->dw_buffer);
+		s->dw_buffer = NULL;
+	}
 	free_wb_list(ss,&s->high);
 	free_wb_list(ss,&s->low);
 	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
-		sp_del(ss->event_fd, s->fd);
+		sp_del(s->shard->event_fd, s->fd);
 	}
 	if (s->type != SOCKET_TYPE_BIND) {
 		close(s->fd);
@@ -361,6 +530,13 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 	s->type = SOCKET_TYPE_INVALID;
 }
 
+static void
+force_close(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	dw_lock(s);
+	force_close_locked(ss, s, result);
+	dw_unlock(s);
+}
+
 void 
 socket_server_release(struct socket_server *ss) {
 	int i;
@@ -371,9 +547,10 @@ socket_server_release(struct socket_server *ss) {
 			force_close(ss, s , &dummy);
 		}
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
-	sp_release(ss->event_fd);
+	for (i=0;i<ss->shard_n;i++) {
+		shard_release(&ss->shard[i]);
+	}
+	FREE(ss->shard);
 	FREE(ss);
 }
 
@@ -390,7 +567,7 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	assert(s->type == SOCKET_TYPE_RESERVE);//预留的类型必然是SOCKET_TYPE_RESERVE
 
 	if (add) {//是否添加到事件池中
-		if (sp_add(ss->event_fd, fd, s)) {
+		if (sp_add(s->shard->event_fd, fd, s)) {
 			s->type = SOCKET_TYPE_INVALID;
 			return NULL;
 		}
@@ -480,15 +657,15 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		//
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
-		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-			result->data = ss->buffer;
+		if (inet_ntop(ai_ptr->ai_family, sin_addr, ns->shard->buffer, sizeof(ns->shard->buffer))) {
+			result->data = ns->shard->buffer;
 		}
 		
 		freeaddrinfo( ai_list );
 		return SOCKET_OPEN;
 	} else {//连接不能马上建立成功
 		ns->type = SOCKET_TYPE_CONNECTING; //设置状态为连接中
-		sp_write(ss->event_fd, ns->fd, ns, true);
+		sp_write(ns->shard->event_fd, ns->fd, ns, true);
 	}
 
 	freeaddrinfo( ai_list );
@@ -499,38 +676,6 @@ _failed:
 	return SOCKET_ERROR;
 }
 
-static int
-send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
-	while (list->head) {
-		struct write_buffer * tmp = list->head;
-		for (;;) {
-			int sz = write(s->fd, tmp->ptr, tmp->sz);
-			if (sz < 0) {
-				switch(errno) {
-				case EINTR:
-					continue;
-				case EAGAIN:
-					return -1;
-				}
-				force_close(ss,s, result);
-				return SOCKET_CLOSE;
-			}
-			s->wb_size -= sz;
-			if (sz != tmp->sz) {
-				tmp->ptr += sz;
-				tmp->sz -= sz;
-				return -1;
-			}
-			break;
-		}
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
-	}
-	list->tail = NULL;
-
-	return -1;
-}
-
 static socklen_t
 udp_socket_address(struct socket *s, const uint8_t udp_address[UDP_ADDRESS_SIZE], union sockaddr_all *sa) {
 	int type = (uint8_t)udp_address[0];
@@ -555,6 +700,56 @@ udp_socket_address(struct socket *s, const uint8_t udp_address[UDP_ADDRESS_SIZE]
 	return 0;
 }
 
+#ifdef UDP_MMSG
+
+// flush up to UDP_BATCH datagrams of the list with one sendmmsg
+static int
+send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	union sockaddr_all sa[UDP_BATCH];
+	while (list->head) {
+		struct write_buffer * tmp = list->head;
+		int i, n;
+		for (n=0; tmp && n<UDP_BATCH; tmp=tmp->next, n++) {
+			memset(&msg[n], 0, sizeof(msg[n]));
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			msg[n].msg_hdr.msg_iov = &iov[n];
+			msg[n].msg_hdr.msg_iovlen = 1;
+			msg[n].msg_hdr.msg_name = &sa[n];
+			msg[n].msg_hdr.msg_namelen = udp_socket_address(s, tmp->udp_address, &sa[n]);
+		}
+		int m = sendmmsg(s->fd, msg, n, 0);
+		if (m < 0) {
+			switch(errno) {
+			case EINTR:
+			case EAGAIN:
+				return -1;
+			}
+			fprintf(stderr, "socket-server : udp (%d) sendmmsg error %s.\n",s->id, strerror(errno));
+			return -1;
+		}
+		s->shard->stat.sendmmsg++;
+		s->shard->stat.sendmmsg_packet += m;
+		for (i=0;i<m;i++) {
+			tmp = list->head;
+			s->wb_size -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
+		}
+		if (m < n) {
+			// the rest waits for the next writable event
+			return -1;
+		}
+	}
+	list->tail = NULL;
+
+	return -1;
+}
+
+#else
+
 static int
 send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
 	while (list->head) {
@@ -590,14 +785,7 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 	return -1;
 }
 
-static int
-send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
-	if (s->protocol == PROTOCOL_TCP) {
-		return send_list_tcp(ss, s, list, result);
-	} else {
-		return send_list_udp(ss, s, list, result);
-	}
-}
+#endif
 
 static inline int
 list_uncomplete(struct wb_list *s) {
@@ -625,45 +813,6 @@ raise_uncomplete(struct socket * s) {
 	high->head = high->tail = tmp;
 }
 
-/*
-	Each socket has two write buffer list, high priority and low priority.
-
-	1. send high list as far as possible.
-	2. If high list is empty, try to send low list.
-	3. If low list head is uncomplete (send a part before), move the head of low list to empty high list (call raise_uncomplete) .
-	4. If two lists are both empty, turn off the event. (call check_close)
- */
-static int
-send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *result) {
-	assert(!list_uncomplete(&s->low));
-	// step 1
-	if (send_list(ss,s,&s->high,result) == SOCKET_CLOSE) {
-		return SOCKET_CLOSE;
-	}
-	if (s->high.head == NULL) {
-		// step 2
-		if (s->low.head != NULL) {
-			if (send_list(ss,s,&s->low,result) == SOCKET_CLOSE) {
-				return SOCKET_CLOSE;
-			}
-			// step 3
-			if (list_uncomplete(&s->low)) {
-				raise_uncomplete(s);
-			}
-		} else {
-			// step 4
-			sp_write(ss->event_fd, s->fd, s, false);
-
-			if (s->type == SOCKET_TYPE_HALFCLOSE) {
-				force_close(ss, s, result);
-				return SOCKET_CLOSE;
-			}
-		}
-	}
-
-	return -1;
-}
-
 static struct write_buffer *
 append_sendbuffer_(struct socket_server *ss, struct wb_list *s, struct request_send * request, int size, int n) {
 	struct write_buffer * buf = MALLOC(size);
@@ -709,6 +858,145 @@ send_buffer_empty(struct socket *s) {
 	return (s->high.head == NULL && s->low.head == NULL);
 }
 
+// Flush both write lists (high first) with writev, up to SEND_IOV buffers a call.
+// If the head of the low list is sent partly, it is raised to the (empty) high list.
+// Call it with dw_lock held, the lists are read by socket_server_send.
+// 用writev发送两个写列表(先高优先级)，每次最多SEND_IOV个缓冲区。如果低优先级列表的头部只发送了一部分，把它移到(空的)高优先级列表
+static int
+send_list_tcp(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	struct iovec iov[SEND_IOV];
+	while (!send_buffer_empty(s)) {
+		int n = 0;
+		size_t total = 0;
+		struct write_buffer * tmp = s->high.head;
+		int high = 1;
+		while (n < SEND_IOV) {
+			if (tmp == NULL) {
+				if (!high)
+					break;
+				high = 0;	// the high list is done, continue with the low list
+				tmp = s->low.head;
+				if (tmp == NULL)
+					break;
+			}
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			total += tmp->sz;
+			++n;
+			tmp = tmp->next;
+		}
+		ssize_t sz;
+		for (;;) {
+			sz = writev(s->fd, iov, n);
+			if (sz < 0) {
+				switch(errno) {
+				case EINTR:
+					continue;
+				case EAGAIN:
+					return -1;
+				}
+				force_close_locked(ss,s, result);
+				return SOCKET_CLOSE;
+			}
+			break;
+		}
+		++s->shard->stat.writev;
+		s->shard->stat.writev_buffer += n;
+		s->wb_size -= sz;
+		int complete = (size_t)sz == total;
+		// drop the buffers written, the high list first ; empty buffers are dropped too
+		struct wb_list *list = s->high.head ? &s->high : &s->low;
+		while (list->head && sz >= list->head->sz) {
+			tmp = list->head;
+			sz -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
+			if (list->head == NULL) {
+				list->tail = NULL;
+				list = &s->low;
+			}
+		}
+		if (sz > 0) {
+			// the head is written in part
+			tmp = list->head;
+			tmp->ptr += sz;
+			tmp->sz -= sz;
+			if (list == &s->low) {
+				raise_uncomplete(s);
+			}
+			return -1;
+		}
+		if (!complete) {
+			return -1;	// the kernel buffer is full
+		}
+	}
+	return -1;
+}
+
+// Move the remainder of a direct write to the high list, call it with dw_lock held.
+// 把直接写剩余的数据放到高优先级列表，调用时需要持有dw_lock
+static void
+direct_write_remainder(struct socket_server *ss, struct socket *s) {
+	if (s->dw_buffer == NULL)
+		return;
+	// a direct write only starts when the lists are empty, and everything appending to them calls this first
+	assert(send_buffer_empty(s));
+	struct request_send request;
+	request.id = s->id;
+	request.sz = s->dw_size;
+	request.buffer = (char *)s->dw_buffer;
+	append_sendbuffer(ss, s, &request, s->dw_offset);
+	s->dw_buffer = NULL;
+}
+
+
+/*
+	Each socket has two write buffer list, high priority and low priority.
+
+	1. send high list as far as possible.
+	2. If high list is empty, try to send low list.
+	3. If low list head is uncomplete (send a part before), move the head of low list to empty high list (call raise_uncomplete) .
+	4. If two lists are both empty, turn off the event. (call check_close)
+
+	dw_lock is held during all the steps : socket_server_send reads the two lists to decide whether it may write the fd,
+	and it must not see them empty while a buffer is being sent or raised.
+	整个过程持有dw_lock：socket_server_send根据两个列表决定能否直接写fd，不能让它在发送或者移动缓冲区的中途看到两个列表都空
+ */
+static int
+send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+	if (!dw_trylock(s)) {
+		return -1;	// a worker thread is writing, the write event comes again
+	}
+	direct_write_remainder(ss, s);
+	assert(!list_uncomplete(&s->low));
+	if (s->protocol == PROTOCOL_TCP) {
+		// step 1 - 3 in one pass, see send_list_tcp
+		if (send_list_tcp(ss,s,result) == SOCKET_CLOSE) {
+			dw_unlock(s);
+			return SOCKET_CLOSE;
+		}
+	} else {
+		// step 1
+		send_list_udp(ss,s,&s->high,result);
+		// step 2
+		if (s->high.head == NULL && s->low.head != NULL) {
+			send_list_udp(ss,s,&s->low,result);
+		}
+	}
+	if (send_buffer_empty(s)) {
+		// step 4, no direct write can start before dw_lock is released
+		sp_write(s->shard->event_fd, s->fd, s, false);
+		if (s->type == SOCKET_TYPE_HALFCLOSE) {
+			force_close_locked(ss, s, result);
+			dw_unlock(s);
+			return SOCKET_CLOSE;
+		}
+	}
+	dw_unlock(s);
+
+	return -1;
+}
+
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
 
@@ -729,6 +1017,12 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 		return -1;
 	}
 	assert(s->type != SOCKET_TYPE_PLISTEN && s->type != SOCKET_TYPE_LISTEN);
+	if (s->protocol == PROTOCOL_TCP) {
+		// this request was queued after a direct write, which may not be finished
+		dw_lock(s);
+		direct_write_remainder(ss, s);
+		dw_unlock(s);
+	}
 	if (send_buffer_empty(s) && s->type == SOCKET_TYPE_CONNECTED) {
 		if (s->protocol == PROTOCOL_TCP) {
 			int n = write(s->fd, so.buffer, so.sz);
@@ -763,7 +1057,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 				so.free_func(request->buffer);
 			}
 		}
-		sp_write(ss->event_fd, s->fd, s, true);
+		sp_write(s->shard->event_fd, s->fd, s, true);
 	} else {
 		if (s->protocol == PROTOCOL_TCP) {
 			if (priority == PRIORITY_LOW) {
@@ -813,18 +1107,25 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 		result->data = NULL;
 		return SOCKET_CLOSE;
 	}
+	dw_lock(s);
+	direct_write_remainder(ss, s);
+	dw_unlock(s);
 	if (!send_buffer_empty(s)) { 
 		int type = send_buffer(ss,s,result);
 		if (type != -1)
 			return type;
 	}
+	dw_lock(s);
+	direct_write_remainder(ss, s);
 	if (send_buffer_empty(s)) {
+		dw_unlock(s);
 		force_close(ss,s,result);
 		result->id = id;
 		result->opaque = request->opaque;
 		return SOCKET_CLOSE;
 	}
-	s->type = SOCKET_TYPE_HALFCLOSE;
+	s->type = SOCKET_TYPE_HALFCLOSE;//不再直接写
+	dw_unlock(s);
 
 	return -1;
 }
@@ -866,7 +1167,7 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 
 	if (s->type == SOCKET_TYPE_PACCEPT || s->type == SOCKET_TYPE_PLISTEN) {//待接受或者待监听（未加入poll）
 
-		if (sp_add(ss->event_fd, s->fd, s)) {//加入poll　　userdata存储的是socket本身
+		if (sp_add(s->shard->event_fd, s->fd, s)) {//加入poll　　userdata存储的是socket本身
 			//加入poll失败
 			s->type = SOCKET_TYPE_INVALID;//设置类型为无效
 			return SOCKET_ERROR;//返回出错
@@ -898,35 +1199,45 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
 }
 
+//读空唤醒fd，eventfd一次读完，管道可能有多个字节
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {//死循环
-		int n = read(pipefd, buffer, sz);//从pipe中读取sz大小的数据到buffer中
-		if (n<0) {
-			if (errno == EINTR)//如果是由于信号中断，没读到任何数据
-				continue;//继续读
-			fprintf(stderr, "socket-server : read pipe error %s.\n",strerror(errno));//打印出错信息
-			return;
-		}
-		// must atomic read from a pipe
-		assert(n == sz);//读取的字节数一定要与传入的字节数(sz)相等
+drain_wakeup(struct socket_shard *sh) {
+	uint64_t buffer[8];
+	for (;;) {
+		int n = read(sh->recvctrl_fd, buffer, sizeof(buffer));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == sizeof(buffer))
+			continue;
 		return;
 	}
 }
 
-//检查管道中是否有命令
+//检查队列中是否有命令，有则按压入的顺序取到cmd_list
 static int
-has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};//select立即返回
-	int retval;
-
-	FD_SET(ss->recvctrl_fd, &ss->rfds);//将读fd加入set集合
-
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {//描述符就绪
+has_cmd(struct socket_shard *sh) {
+	if (sh->cmd_list)
 		return 1;
-	}
-	return 0;//出错或超时
+	struct request_node *node = __sync_lock_test_and_set(&sh->cmd_head, NULL);
+	if (node == NULL) {
+		// The queue is empty, the next command must wake up the socket thread. Check again after the signal is cleared,
+		// a command pushed before that didn't write the fd.
+		// 队列空了，下一个命令需要唤醒socket线程。清除信号后再检查一次，在这之前压入的命令没有写fd
+		sh->cmd_signal = 0;
+		__sync_synchronize();
+		node = __sync_lock_test_and_set(&sh->cmd_head, NULL);
+		if (node == NULL)
+			return 0;
+	}
+	struct request_node *list = NULL;
+	while (node) {//反转链表，恢复压入的顺序
+		struct request_node *next = node->next;
+		node->next = list;
+		list = node;
+		node = next;
+	}
+	sh->cmd_list = list;
+	return 1;
 }
 
 static void
@@ -972,25 +1283,42 @@ set_udp_address(struct socket_server *ss, struct request_setudp *request, struct
 	return -1;
 }
 
-// return type
-static int
-ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;//获取读取控制fd
-	// the length of message is one byte, so 256+8 buffer size is enough.
-	// 消息的长度是一个字节，所以缓冲区大小为256+8是足够的
-	uint8_t buffer[256];//接收缓冲区
-	uint8_t header[2];//头部
-	block_readpipe(fd, header, sizeof(header));//阻塞从管道读头部
-	int type = header[0];//消息类型
-	int len = header[1];//消息长度
-	block_readpipe(fd, buffer, len);//阻塞从管道读取指定长度的消息数据
-	// ctrl command only exist in local fd, so don't worry about endian.
-	// 控制命令仅存在于本地fd,所以不用担心大小端的问题
+// The send requests of a socket in the queue, a worker thread doesn't write the fd directly while there are some.
+// 命令队列中某个socket的发送命令数，有的时候工作线程不会直接写fd
+static void
+inc_sending(struct socket *s, int id) {
+	for (;;) {
+		uint32_t sending = s->sending;
+		if ((sending >> 16) != ID_TAG16(id))
+			return;	// the id is reused
+		if ((sending & 0xffff) == 0xffff)
+			continue;	// overflow (rarely), wait for the socket thread
+		if (__sync_bool_compare_and_swap(&s->sending, sending, sending + 1))
+			return;
+	}
+}
+
+static void
+dec_sending(struct socket_server *ss, int id) {
+	struct socket *s = &ss->slot[HASH_ID(id)];
+	for (;;) {
+		uint32_t sending = s->sending;
+		if ((sending >> 16) != ID_TAG16(id) || (sending & 0xffff) == 0)
+			return;
+		if (__sync_bool_compare_and_swap(&s->sending, sending, sending - 1))
+			return;
+	}
+}
 
+//执行一个控制命令
+static int
+do_cmd(struct socket_server *ss, int type, uint8_t *buffer, struct socket_message *result) {
+	// ctrl command only exist in local memory, so don't worry about endian.
+	// 控制命令仅存在于本进程的内存中,所以不用担心大小端的问题
 
 	//以下copy自文件上方数据结构定义
 	/*
-	The first byte is TYPE(第一个字节是类型)，第二个字节是消息长度
+	The type of command(命令类型)
 	
 	S Start socket
 	B Bind socket
@@ -1025,9 +1353,13 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		result->data = NULL;
 		return SOCKET_EXIT;
 	case 'D':
-		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_HIGH, NULL);
-	case 'P':
-		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_LOW, NULL);
+	case 'P': {
+		struct request_send * request = (struct request_send *)buffer;
+		int id = request->id;
+		int ret = send_socket(ss, request, result, type == 'D' ? PRIORITY_HIGH : PRIORITY_LOW, NULL);
+		dec_sending(ss, id);
+		return ret;
+	}
 	case 'A': {
 		struct request_send_udp * rsu = (struct request_send_udp *)buffer;
 		return send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
@@ -1048,6 +1380,17 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	return -1;
 }
 
+// return type
+static int
+ctrl_cmd(struct socket_server *ss, struct socket_shard *sh, struct socket_message *result) {
+	struct request_node *node = sh->cmd_list;//取出队列头的命令
+	sh->cmd_list = node->next;
+	++sh->stat.command;
+	int type = do_cmd(ss, node->type, node->buffer, result);
+	FREE(node);
+	return type;
+}
+
 // return -1 (ignore) when error
 static int
 forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
@@ -1112,11 +1455,80 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+// size of the address packed after the datagram, 0 if it doesn't match the socket protocol
+static int
+udp_address_size(struct socket *s, socklen_t slen) {
+	if (slen == sizeof(struct sockaddr_in)) {
+		return s->protocol == PROTOCOL_UDP ? 1+2+4 : 0;
+	} else {
+		return s->protocol == PROTOCOL_UDPv6 ? 1+2+16 : 0;
+	}
+}
+
+static int
+forward_datagram(struct socket *s, const uint8_t *buffer, int n, union sockaddr_all *sa, socklen_t slen, struct socket_message * result) {
+	int addrsz = udp_address_size(s, slen);
+	if (addrsz == 0)
+		return -1;
+	uint8_t * data = MALLOC(n + addrsz);
+	gen_udp_address(s->protocol, sa, data + n);
+	memcpy(data, buffer, n);
+
+	result->opaque = s->opaque;
+	result->id = s->id;
+	result->ud = n;
+	result->data = (char *)data;
+
+	return SOCKET_UDP;
+}
+
+#ifdef UDP_MMSG
+
+// forward the datagrams left from the last recvmmsg of the socket one by one, return -1 when none is left
+// 逐个转发这个socket上次recvmmsg剩下的包，没有剩下的包时返回-1
+static int
+forward_pending_udp(struct socket *s, struct socket_message * result) {
+	struct socket_shard *sh = s->shard;
+	if (sh->udp_id != s->id) {
+		// left by a socket closed before they were forwarded
+		sh->udp_n = 0;
+		return -1;
+	}
+	while (sh->udp_next < sh->udp_n) {
+		int i = sh->udp_next++;
+		int type = forward_datagram(s, sh->udpbuffer[i], sh->udpmsg[i].msg_len,
+			&sh->udpaddr[i], sh->udpmsg[i].msg_hdr.msg_namelen, result);
+		if (type != -1)
+			return type;
+	}
+	sh->udp_n = 0;
+	return -1;
+}
+
+#endif
+
+// On linux up to UDP_BATCH datagrams are read by one recvmmsg, and they are still forwarded as separate
+// SOCKET_UDP messages : the read event is handled again (see socket_server_poll) until they are all forwarded.
+// linux下一次recvmmsg最多读UDP_BATCH个包，但是仍然逐个作为SOCKET_UDP转发：读事件会被再次处理，直到它们都转发完
 static int
 forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+	struct socket_shard *sh = s->shard;
+#ifdef UDP_MMSG
+	if (sh->udp_n > 0) {
+		int type = forward_pending_udp(s, result);
+		if (type != -1)
+			return type;
+	}
+	int i;
+	for (i=0;i<UDP_BATCH;i++) {
+		sh->udpmsg[i].msg_hdr.msg_namelen = sizeof(union sockaddr_all);
+	}
+	int n = recvmmsg(s->fd, sh->udpmsg, UDP_BATCH, 0, NULL);
+#else
 	union sockaddr_all sa;
 	socklen_t slen = sizeof(sa);
-	int n = recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
+	int n = recvfrom(s->fd, sh->udpbuffer[0],MAX_UDP_PACKAGE,0,&sa.s,&slen);
+#endif
 	if (n<0) {
 		switch(errno) {
 		case EINTR:
@@ -1129,26 +1541,16 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_me
 		}
 		return -1;
 	}
-	uint8_t * data;
-	if (slen == sizeof(sa.v4)) {
-		if (s->protocol != PROTOCOL_UDP)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 4);
-		gen_udp_address(PROTOCOL_UDP, &sa, data + n);
-	} else {
-		if (s->protocol != PROTOCOL_UDPv6)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 16);
-		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
-	}
-	memcpy(data, ss->udpbuffer, n);
-
-	result->opaque = s->opaque;
-	result->id = s->id;
-	result->ud = n;
-	result->data = (char *)data;
-
-	return SOCKET_UDP;
+#ifdef UDP_MMSG
+	sh->stat.recvmmsg++;
+	sh->stat.recvmmsg_packet += n;
+	sh->udp_id = s->id;
+	sh->udp_n = n;
+	sh->udp_next = 0;
+	return forward_pending_udp(s, result);
+#else
+	return forward_datagram(s, sh->udpbuffer[0], n, &sa, slen, result);
+#endif
 }
 
 static int
@@ -1165,14 +1567,14 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_message
 		result->id = s->id;
 		result->ud = 0;
 		if (send_buffer_empty(s)) {
-			sp_write(ss->event_fd, s->fd, s, false);
+			sp_write(s->shard->event_fd, s->fd, s, false);
 		}
 		union sockaddr_all u;
 		socklen_t slen = sizeof(u);
 		if (getpeername(s->fd, &u.s, &slen) == 0) {
 			void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-			if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-				result->data = ss->buffer;
+			if (inet_ntop(u.s.sa_family, sin_addr, s->shard->buffer, sizeof(s->shard->buffer))) {
+				result->data = s->shard->buffer;
 				return SOCKET_OPEN;
 			}
 		}
@@ -1212,8 +1614,8 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
 	char tmp[INET6_ADDRSTRLEN];
 	if (inet_ntop(u.s.sa_family, sin_addr, tmp, sizeof(tmp))) {
-		snprintf(ss->buffer, sizeof(ss->buffer), "%s:%d", tmp, sin_port);
-		result->data = ss->buffer;
+		snprintf(s->shard->buffer, sizeof(s->shard->buffer), "%s:%d", tmp, sin_port);
+		result->data = s->shard->buffer;
 	}
 
 	return 1;
@@ -1221,12 +1623,12 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 
 //清理已关闭事件
 static inline void 
-clear_closed_event(struct socket_server *ss, struct socket_message * result, int type) {
+clear_closed_event(struct socket_shard *sh, struct socket_message * result, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERROR) {//如果是关闭或者出错
 		int id = result->id;
 		int i;
-		for (i=ss->event_index; i<ss->event_n; i++) {
-			struct event *e = &ss->ev[i];
+		for (i=sh->event_index; i<sh->event_n; i++) {
+			struct event *e = &sh->ev[i];
 			struct socket *s = e->s;
 			if (s) {
 				if (s->type == SOCKET_TYPE_INVALID && s->id == id) {
@@ -1242,39 +1644,43 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 //socket服务器循环
 //上层的API调用会转变为命令发送到管道，socket server则从管道读取命令进行处理
 int 
-socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+socket_server_poll_shard(struct socket_server *ss, int shard, struct socket_message * result, int * more) {
+	struct socket_shard *sh = &ss->shard[shard];
 	for (;;) {//死循环
-		if (ss->checkctrl) {//如果检查控制
-			if (has_cmd(ss)) {//是否有命令
-				int type = ctrl_cmd(ss, result);//读控制命令
+		if (sh->checkctrl) {//如果检查控制
+			if (has_cmd(sh)) {//是否有命令
+				int type = ctrl_cmd(ss, sh, result);//读控制命令
 				if (type != -1) {//返回了类型
-					clear_closed_event(ss, result, type);
+					clear_closed_event(sh, result, type);
 					return type;//返回类型
 				} else//返回为－１，继续处理命令
 					continue;
 			} else {//如果没有命令，设置检查控制flag为false
-				ss->checkctrl = 0;
+				sh->checkctrl = 0;
 			}
 		}
 		//刚开始两者都为0,或者已经处理完ＩＯ事件
-		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);//等待事件产生
-			ss->checkctrl = 1;//设置检查控制flag为true
+		if (sh->event_index == sh->event_n) {
+			sh->event_n = sp_wait(sh->event_fd, sh->ev, MAX_EVENT);//等待事件产生
+			sh->checkctrl = 1;//设置检查控制flag为true
 			if (more) {
 				*more = 0;
 			}
-			ss->event_index = 0;//设置已处理事件索引
-			if (ss->event_n <= 0) {
-				ss->event_n = 0;
+			sh->event_index = 0;//设置已处理事件索引
+			if (sh->event_n <= 0) {
+				sh->event_n = 0;
 				return -1;
 			}
 		}
 		//处理ＩＯ事件
-		struct event *e = &ss->ev[ss->event_index++];//取出一个已准备好事件
+		struct event *e = &sh->ev[sh->event_index++];//取出一个已准备好事件
 		struct socket *s = e->s;//取出用户数据 （上层socket）
+		++sh->stat.event;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
-			//分发开头处的管道命令
+			// wakeup fd : commands were pushed, dispatch them at beginning
+			//唤醒fd：有命令压入了队列，回到开头处理命令
+			drain_wakeup(sh);
+			sh->checkctrl = 1;
 			continue;
 		}
 
@@ -1299,25 +1705,25 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 					type = forward_message_udp(ss, s, result);
 					if (type == SOCKET_UDP) {
 						// try read again
-						--ss->event_index;
-						return SOCKET_UDP;
+						--sh->event_index;
+						return type;
 					}
 				}
 				if (e->write) {
 					// Try to dispatch write message next step if write flag set.
 					e->read = false;
-					--ss->event_index;
+					--sh->event_index;
 				}
 				if (type == -1)
 					break;
-				clear_closed_event(ss, result, type);
+				clear_closed_event(sh, result, type);
 				return type;
 			}
 			if (e->write) {//可写
 				int type = send_buffer(ss, s, result);
 				if (type == -1)
 					break;
-				clear_closed_event(ss, result, type);
+				clear_closed_event(sh, result, type);
 				return type;
 			}
 			break;
@@ -1325,27 +1731,58 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
-//向socket server发送请求，通过管道
-static void
-send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	//组装数据
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
+int 
+socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+	return socket_server_poll_shard(ss, 0, result, more);
+}
 
-	//发送数据
+//唤醒socket线程
+static void
+wakeup(struct socket_shard *sh) {
+#ifdef __linux__
+	uint64_t v = 1;
+#else
+	uint8_t v = 1;
+#endif
 	for (;;) {
-		int n = write(ss->sendctrl_fd, &request->header[6], len+2);//写入管道，管道也是一种独立的文件，网络也是
+		int n = write(sh->sendctrl_fd, &v, sizeof(v));
 		if (n<0) {
-			if (errno != EINTR) {
-				fprintf(stderr, "socket-server : send ctrl command error %s.\n", strerror(errno));
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				fprintf(stderr, "socket-server : wakeup socket thread error %s.\n", strerror(errno));
 			}
-			continue;
 		}
-		assert(n == len+2);
 		return;
 	}
 }
 
+//向socket server发送请求，压入命令队列
+// Only the first command after the socket thread found the queue empty writes the wakeup fd,
+// the commands pushed while it is busy cost no syscall.
+// 只有socket线程发现队列为空之后的第一个命令需要写唤醒fd，它忙的时候压入的命令不需要系统调用
+static void
+send_request_shard(struct socket_shard *sh, struct request_package *request, char type, int len) {
+	struct request_node *node = MALLOC(sizeof(*node) + len);
+	node->type = type;
+	node->len = len;
+	memcpy(node->buffer, &request->u, len);
+	struct request_node *head;
+	do {
+		head = sh->cmd_head;
+		node->next = head;
+	} while (!__sync_bool_compare_and_swap(&sh->cmd_head, head, node));
+	if (sh->cmd_signal == 0 && __sync_bool_compare_and_swap(&sh->cmd_signal, 0, 1)) {
+		wakeup(sh);
+	}
+}
+
+//命令压入id所在分片的队列
+static inline void
+send_request(struct socket_server *ss, int id, struct request_package *request, char type, int len) {
+	send_request_shard(ss->slot[HASH_ID(id)].shard, request, type, len);
+}
+
 static int
 open_request(struct socket_server *ss, struct request_package *req, uintptr_t opaque, const char *addr, int port) {
 	int len = strlen(addr);
@@ -1373,11 +1810,20 @@ socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * a
 	int len = open_request(ss, &request, opaque, addr, port);//组装启动请求包
 	if (len < 0)
 		return -1;
-	send_request(ss, &request, 'O', sizeof(request.u.open) + len);//发送请求包
+	send_request(ss, request.u.open.id, &request, 'O', sizeof(request.u.open) + len);//发送请求包
 	return request.u.open.id;
 }
 
+static inline int
+can_direct_write(struct socket *s, int id) {
+	return s->id == id && s->type == SOCKET_TYPE_CONNECTED && s->protocol == PROTOCOL_TCP
+		&& s->dw_buffer == NULL && (s->sending & 0xffff) == 0 && send_buffer_empty(s);
+}
+
 // return -1 when error
+// When nothing of the socket is waiting to be sent, the calling thread writes the fd directly (non-blocking),
+// and only the remainder goes to the socket thread.
+// 当socket没有等待发送的数据时，调用者直接写fd(非阻塞)，只有没写完的部分交给socket线程
 int64_t 
 socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz) {
 	struct socket * s = &ss->slot[HASH_ID(id)];
@@ -1385,12 +1831,36 @@ socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz
 		return -1;
 	}
 
+	if (can_direct_write(s, id) && dw_trylock(s)) {
+		if (can_direct_write(s, id)) {//持有锁后再检查一次
+			struct send_object so;
+			send_object_init(ss, &so, (void *)buffer, sz);
+			int n = write(s->fd, so.buffer, so.sz);
+			if (n < 0) {
+				n = 0;	// let the socket thread deal with the error
+			}
+			if (n == so.sz) {
+				dw_unlock(s);
+				so.free_func((void *)buffer);
+				return 0;
+			}
+			s->dw_buffer = buffer;
+			s->dw_size = sz;
+			s->dw_offset = n;
+			sp_write(s->shard->event_fd, s->fd, s, true);//socket线程在可写时发送剩余的部分
+			dw_unlock(s);
+			return so.sz - n;
+		}
+		dw_unlock(s);
+	}
+
+	inc_sending(s, id);
 	struct request_package request;
 	request.u.send.id = id;
 	request.u.send.sz = sz;
 	request.u.send.buffer = (char *)buffer;
 
-	send_request(ss, &request, 'D', sizeof(request.u.send));
+	send_request(ss, id, &request, 'D', sizeof(request.u.send));
 	return s->wb_size;
 }
 
@@ -1401,18 +1871,61 @@ socket_server_send_lowpriority(struct socket_server *ss, int id, const void * bu
 		return;
 	}
 
+	inc_sending(s, id);
 	struct request_package request;
 	request.u.send.id = id;
 	request.u.send.sz = sz;
 	request.u.send.buffer = (char *)buffer;
 
-	send_request(ss, &request, 'P', sizeof(request.u.send));
+	send_request(ss, id, &request, 'P', sizeof(request.u.send));
+}
+
+void
+socket_server_stat(struct socket_server *ss, struct socket_server_stat *stat) {
+	int i;
+	memset(stat, 0, sizeof(*stat));
+	for (i=0;i<ss->shard_n;i++) {
+		struct socket_server_stat st;
+		socket_server_shard_stat(ss, i, &st);
+		stat->writev += st.writev;
+		stat->writev_buffer += st.writev_buffer;
+		stat->recvmmsg += st.recvmmsg;
+		stat->recvmmsg_packet += st.recvmmsg_packet;
+		stat->sendmmsg += st.sendmmsg;
+		stat->sendmmsg_packet += st.sendmmsg_packet;
+		stat->event += st.event;
+		stat->command += st.command;
+		stat->socket += st.socket;
+	}
+}
+
+int
+socket_server_shard(struct socket_server *ss) {
+	return ss->shard_n;
+}
+
+// The load of one socket thread, the counters are read without lock.
+void
+socket_server_shard_stat(struct socket_server *ss, int shard, struct socket_server_stat *stat) {
+	int i;
+	*stat = ss->shard[shard].stat;
+	stat->socket = 0;
+	for (i=shard;i<MAX_SOCKET;i+=ss->shard_n) {
+		int type = ss->slot[i].type;
+		if (type != SOCKET_TYPE_INVALID && type != SOCKET_TYPE_RESERVE) {
+			++stat->socket;
+		}
+	}
 }
 
+//每个socket线程都收到退出命令
 void
 socket_server_exit(struct socket_server *ss) {
+	int i;
 	struct request_package request;
-	send_request(ss, &request, 'X', 0);
+	for (i=0;i<ss->shard_n;i++) {
+		send_request_shard(&ss->shard[i], &request, 'X', 0);
+	}
 }
 
 void
@@ -1420,7 +1933,7 @@ socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.close.id = id;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(ss, id, &request, 'K', sizeof(request.u.close));
 }
 
 // return -1 means failed
@@ -1504,7 +2017,7 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	request.u.listen.opaque = opaque;//请求方服务句柄（地址）
 	request.u.listen.id = id;//内部预留的socket ID
 	request.u.listen.fd = fd;//监听生成的fd 
-	send_request(ss, &request, 'L', sizeof(request.u.listen));//发送监听请求
+	send_request(ss, id, &request, 'L', sizeof(request.u.listen));//发送监听请求
 	return id;
 }
 
@@ -1517,7 +2030,7 @@ socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	request.u.bind.opaque = opaque;
 	request.u.bind.id = id;
 	request.u.bind.fd = fd;
-	send_request(ss, &request, 'B', sizeof(request.u.bind));
+	send_request(ss, id, &request, 'B', sizeof(request.u.bind));
 	return id;
 }
 
@@ -1528,7 +2041,7 @@ socket_server_start(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.start.id = id;
 	request.u.start.opaque = opaque;
-	send_request(ss, &request, 'S', sizeof(request.u.start));
+	send_request(ss, id, &request, 'S', sizeof(request.u.start));
 }
 
 void
@@ -1537,7 +2050,7 @@ socket_server_nodelay(struct socket_server *ss, int id) {
 	request.u.setopt.id = id;
 	request.u.setopt.what = TCP_NODELAY;
 	request.u.setopt.value = 1;
-	send_request(ss, &request, 'T', sizeof(request.u.setopt));
+	send_request(ss, id, &request, 'T', sizeof(request.u.setopt));
 }
 
 void 
@@ -1577,7 +2090,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	request.u.udp.opaque = opaque;
 	request.u.udp.family = family;
 
-	send_request(ss, &request, 'U', sizeof(request.u.udp));	
+	send_request(ss, id, &request, 'U', sizeof(request.u.udp));	
 	return id;
 }
 
@@ -1608,7 +2121,7 @@ socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp
 
 	memcpy(request.u.send_udp.address, udp_address, addrsz);	
 
-	send_request(ss, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
+	send_request(ss, id, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
 	return s->wb_size;
 }
 
@@ -1645,7 +2158,7 @@ socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, i
 
 	freeaddrinfo( ai_list );
 
-	send_request(ss, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
+	send_request(ss, id, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
 
 	return 0;
 }
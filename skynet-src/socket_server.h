@@ -14,6 +14,18 @@
 
 struct socket_server;
 
+struct socket_server_stat {
+	uint64_t writev;		// writev calls flushing the write lists
+	uint64_t writev_buffer;	// write buffers given to them
+	uint64_t recvmmsg;		// recvmmsg calls reading udp sockets
+	uint64_t recvmmsg_packet;	// datagrams received by them
+	uint64_t sendmmsg;		// sendmmsg calls flushing udp write lists
+	uint64_t sendmmsg_packet;	// datagrams sent by them
+	uint64_t event;		// poll events handled
+	uint64_t command;	// control commands handled
+	int socket;			// sockets in use
+};
+
 //socket消息结构定义
 struct socket_message {
 	int id;
@@ -24,10 +36,16 @@ struct socket_message {
 };
 
 struct socket_server * socket_server_create();
+// sockets are sharded by id across several socket threads, each thread polls its own shard
+struct socket_server * socket_server_create_sharded(int shard);
 void socket_server_release(struct socket_server *);
-int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
+int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);	// poll shard 0
+int socket_server_poll_shard(struct socket_server *, int shard, struct socket_message *result, int *more);
+int socket_server_shard(struct socket_server *);
 
 void socket_server_exit(struct socket_server *);
+void socket_server_stat(struct socket_server *, struct socket_server_stat *stat);	// sum of all the shards
+void socket_server_shard_stat(struct socket_server *, int shard, struct socket_server_stat *stat);
 void socket_server_close(struct socket_server *, uintptr_t opaque, int id);
 void socket_server_start(struct socket_server *, uintptr_t opaque, int id);
 
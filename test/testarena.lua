@@ -0,0 +1,67 @@
+-- Lua allocation benchmark, compare lua_arena = true and lua_arena = false in config.
+local skynet = require "skynet"
+local memory = require "memory"
+
+local mode = ...
+
+local function churn(n)
+	local keep = {}
+	for i=1,n do
+		local t = { i, tostring(i), { x = i, y = i } }
+		keep[i % 1000 + 1] = t
+	end
+	return #keep
+end
+
+if mode == "worker" then
+
+-- a short spike of temporary objects, the memory is given back after the gc
+local function spike(n)
+	local t = {}
+	for i=1,n do
+		t[i] = { i, i }
+	end
+	t = nil
+	collectgarbage "collect"
+end
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, n, cmd)
+		local ti = skynet.now()
+		if cmd == "spike" then
+			spike(n)
+		else
+			churn(n)
+		end
+		skynet.ret(skynet.pack(skynet.now() - ti))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	print("lua_arena", skynet.getenv "lua_arena")
+	local n = 1000000
+	local w = skynet.newservice(SERVICE_NAME, "worker")
+	local ti = skynet.call(w, "lua", n)
+	print(string.format("%d iterations in %d cs", n, ti))
+	local used, peak = memory.service(w)
+	print(string.format("worker memory : current %dK peak %dK", math.floor(used/1024), math.floor(peak/1024)))
+	skynet.call(w, "lua", 200000, "spike")
+	local used, peak = memory.service(w)
+	print(string.format("after spike : current %dK peak %dK", math.floor(used/1024), math.floor(peak/1024)))
+	assert(used < peak / 2, "the free chunks are not released")
+	skynet.kill(w)
+	-- services come and go, their arenas are released
+	local ti = skynet.now()
+	for i=1,100 do
+		local s = skynet.newservice(SERVICE_NAME, "worker")
+		skynet.call(s, "lua", 1000)
+		skynet.kill(s)
+	end
+	print(string.format("100 services in %d cs", skynet.now() - ti))
+	print("arena OK")
+	skynet.exit()
+end)
+
+end
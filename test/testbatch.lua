@@ -0,0 +1,80 @@
+-- Batched send test
+-- Usage : set start = "testbatch" in config.
+-- A broadcaster sends the same packet to many agents with skynet.send_batch, and compares with skynet.send.
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "agent" then
+
+skynet.start(function()
+	local count = 0
+	skynet.dispatch("lua", function(_,_, cmd, v)
+		if cmd == "packet" then
+			assert(v.tick and #v.data == 256)
+			count = count + 1
+		elseif cmd == "count" then
+			skynet.ret(skynet.pack(count))
+		end
+	end)
+end)
+
+elseif mode == "forward" then
+
+-- a forward mode service owns the message (frees it by trash), it must receive a private copy
+skynet.forward_type({}, function()
+	local count = 0
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "packet" then
+			count = count + 1
+		elseif cmd == "count" then
+			skynet.ret(skynet.pack(count))
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local agents = {}
+	for i=1,200 do
+		agents[i] = skynet.newservice(SERVICE_NAME, "agent")
+	end
+	local data = string.rep("x", 256)
+	local ticks = 200
+
+	local ti = skynet.now()
+	for t=1,ticks do
+		assert(skynet.send_batch(agents, "lua", "packet", { tick = t, data = data }) == #agents)
+	end
+	local batch_ti = skynet.now() - ti
+
+	ti = skynet.now()
+	for t=1,ticks do
+		for i=1,#agents do
+			skynet.send(agents[i], "lua", "packet", { tick = t, data = data })
+		end
+	end
+	local send_ti = skynet.now() - ti
+
+	for i=1,#agents do
+		assert(skynet.call(agents[i], "lua", "count") == ticks * 2)
+	end
+	print(string.format("%d agents x %d ticks : send_batch %d cs, send %d cs", #agents, ticks, batch_ti, send_ti))
+
+	-- invalid address and forward mode receiver
+	local fwd = skynet.newservice(SERVICE_NAME, "forward")
+	local dead = skynet.newservice(SERVICE_NAME, "agent")
+	skynet.kill(dead)
+	assert(skynet.send_batch({ fwd, dead, agents[1] }, "lua", "packet", { tick = 0, data = data }) == 2)
+	assert(skynet.call(fwd, "lua", "count") == 1)
+
+	for i=1,#agents do
+		skynet.kill(agents[i])
+	end
+	skynet.kill(fwd)
+	print("send_batch OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,43 @@
+-- Timer cancellation test
+-- Usage : set start = "testcanceltimer" in config.
+-- Most of the timers are cancelled, only the others may fire.
+local skynet = require "skynet"
+
+skynet.start(function()
+	local n = 100000
+	local fired = 0
+	local sessions = {}
+	local ti = skynet.now()
+	for i=1,n do
+		sessions[i] = skynet.timeout(50, function() fired = fired + 1 end)
+	end
+	local cancelled = 0
+	for i=1,n do
+		if i % 10 ~= 0 and skynet.cancel_timeout(sessions[i]) then
+			cancelled = cancelled + 1
+		end
+	end
+	print(string.format("add and cancel %d timers in %d cs", n, skynet.now() - ti))
+	assert(cancelled == n - n / 10, cancelled)
+	skynet.sleep(100)
+	assert(fired == n / 10, fired)
+
+	-- expired timer can't be cancelled
+	local done
+	local session = skynet.timeout(1, function() done = true end)
+	skynet.sleep(10)
+	assert(done and not skynet.cancel_timeout(session))
+
+	-- heartbeat : rearm a timer on each message
+	local beat
+	for i=1,1000 do
+		if beat then
+			skynet.cancel_timeout(beat)
+		end
+		beat = skynet.timeout(10, function() error "heartbeat timer fired" end)
+	end
+	skynet.cancel_timeout(beat)
+	skynet.sleep(20)
+	print("cancel timer OK")
+	skynet.exit()
+end)
@@ -0,0 +1,70 @@
+-- Dedicated thread test
+-- Usage : set start = "testdedicated" in config, logger_thread = true to run the logger on its own thread too.
+-- A hub on a dedicated thread receives from many senders, each sender's order must be kept.
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "hub" then
+
+skynet.start(function()
+	skynet.dedicated()
+	local last = {}
+	local count = 0
+	skynet.dispatch("lua", function(_, source, cmd, n)
+		if cmd == "push" then
+			assert((last[source] or 0) + 1 == n, "out of order")
+			last[source] = n
+			count = count + 1
+		elseif cmd == "count" then
+			skynet.ret(skynet.pack(count))
+		end
+	end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, hub, n)
+		for i=1,n do
+			skynet.send(hub, "lua", "push", i)
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local hub = skynet.newservice(SERVICE_NAME, "hub")
+	local echo = skynet.newservice(SERVICE_NAME, "sender")
+	skynet.dedicated(echo)	-- dedicate another service after launch
+	local sender = {}
+	for i=1,16 do
+		sender[i] = skynet.newservice(SERVICE_NAME, "sender")
+	end
+	local n = 10000
+	local done = 0
+	local co = coroutine.running()
+	for i=1,#sender do
+		skynet.fork(function()
+			skynet.call(sender[i], "lua", hub, n)
+			done = done + 1
+			if done == #sender then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	skynet.call(echo, "lua", hub, 0)
+	local count = skynet.call(hub, "lua", "count")
+	print("dedicated total", count, count == n * #sender and "OK" or "FAIL")
+	for i=1,#sender do
+		skynet.kill(sender[i])
+	end
+	skynet.kill(echo)
+	skynet.kill(hub)
+	skynet.exit()
+end)
+
+end
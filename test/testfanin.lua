@@ -0,0 +1,62 @@
+-- Many senders push to one hub service at the same time, the hub checks the order of each sender.
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "hub" then
+
+local last = {}
+local total = 0
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_, source, cmd, n)
+		if cmd == "data" then
+			local l = last[source] or 0
+			assert(n == l + 1, string.format("%s : %d after %d", skynet.address(source), n, l))
+			last[source] = n
+			total = total + 1
+		else
+			skynet.ret(skynet.pack(total))
+		end
+	end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, hub, n)
+		for i=1,n do
+			skynet.send(hub, "lua", "data", i)
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local hub = skynet.newservice(SERVICE_NAME, "hub")
+	local sender_n = 64
+	local n = 10000
+	local sender = {}
+	for i=1,sender_n do
+		sender[i] = skynet.newservice(SERVICE_NAME, "sender")
+	end
+	local done = 0
+	local co = coroutine.running()
+	for i=1,sender_n do
+		skynet.fork(function()
+			skynet.call(sender[i], "lua", hub, n)
+			done = done + 1
+			if done == sender_n then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	local total = skynet.call(hub, "lua", "total")
+	print("fan-in total", total, total == sender_n * n and "OK" or "FAILED")
+	skynet.exit()
+end)
+
+end
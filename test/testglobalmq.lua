@@ -0,0 +1,64 @@
+-- Global run queue benchmark
+-- Usage : set start = "testglobalmq" in config, and run it with thread = 4 / 16 / 64 .
+-- Rebuild with SKYNET_DEFINES=-DNOUSE_LOCKFREE_GLOBALMQ to compare with the spinlocked list.
+local skynet = require "skynet"
+
+local mode, pairs_n, ti = ...
+
+if mode == "pong" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, n)
+		skynet.ret(skynet.pack(n))
+	end)
+end)
+
+elseif mode == "ping" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, pong, ti)
+		local n = 0
+		local stop = skynet.now() + ti
+		while skynet.now() < stop do
+			n = skynet.call(pong, "lua", n) + 1
+		end
+		skynet.ret(skynet.pack(n))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	pairs_n = tonumber(pairs_n) or 256	-- number of ping-pong pairs
+	ti = tonumber(ti) or 500	-- 1/100 s
+	local ping = {}
+	for i=1,pairs_n do
+		local pong = skynet.newservice(SERVICE_NAME, "pong")
+		ping[i] = { skynet.newservice(SERVICE_NAME, "ping"), pong }
+	end
+
+	local total = 0
+	local done = 0
+	local co = coroutine.running()
+	for i=1,pairs_n do
+		skynet.fork(function()
+			local n = skynet.call(ping[i][1], "lua", ping[i][2], ti)
+			total = total + n
+			done = done + 1
+			if done == pairs_n then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+
+	print(string.format("thread=%s pairs=%d calls=%d calls/s=%.0f",
+		skynet.getenv "thread", pairs_n, total, total * 100 / ti))
+	for i=1,pairs_n do
+		skynet.kill(ping[i][1])
+		skynet.kill(ping[i][2])
+	end
+	skynet.exit()
+end)
+
+end
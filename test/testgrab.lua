@@ -0,0 +1,70 @@
+-- Handle lookup benchmark
+-- Usage : set start = "testgrab" in config, run it with different thread = N to see how the lookup scales.
+-- Each sender sends empty messages to a dead handle (lookup only) and to a live service
+-- whose mailbox (cap 1, drop_newest) drops nearly all of them (lookup and reference count).
+local skynet = require "skynet"
+local c = require "skynet.core"
+
+local mode = ...
+
+if mode == "target" then
+
+skynet.start(function()
+	skynet.mailbox(1, "drop_newest")
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd then
+			skynet.ret()
+		end
+	end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, addr, n)
+		for i=1,n do
+			c.send(addr, skynet.PTYPE_LUA, 0, "")
+		end
+		skynet.ret()
+	end)
+end)
+
+else
+
+local sender_n = 16
+local n = 200000
+
+local function bench(sender, name, addr)
+	local done = 0
+	local co = coroutine.running()
+	local start = skynet.now()
+	for i=1,sender_n do
+		skynet.fork(function()
+			skynet.call(sender[i], "lua", addr, n)
+			done = done + 1
+			if done == sender_n then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	local ti = math.max(skynet.now() - start, 1)
+	print(string.format("grab %s : %d lookups in %d cs, %d per second", name, sender_n * n, ti, math.floor(sender_n * n * 100 / ti)))
+end
+
+skynet.start(function()
+	local sender = {}
+	for i=1,sender_n do
+		sender[i] = skynet.newservice(SERVICE_NAME, "sender")
+	end
+	local target = skynet.newservice(SERVICE_NAME, "target")
+	local dead = skynet.newservice(SERVICE_NAME, "target")
+	skynet.kill(dead)
+	bench(sender, "dead", dead)
+	bench(sender, "live", target)
+	skynet.call(target, "lua", "ping")
+	print("grab OK")
+	skynet.exit()
+end)
+
+end
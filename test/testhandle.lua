@@ -0,0 +1,81 @@
+-- Handle table growth test
+-- Usage : set start = "testhandle" in config, optionally with handle_slots = N to pre-size the table.
+-- Services are launched to grow the handle table while other services keep sending to live handles,
+-- no message may be lost while the slots are migrated to the new table.
+-- Several senders run on different worker threads, so some of them look up a handle in a table
+-- that is replaced while they read it.
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "target" then
+
+skynet.start(function()
+	local count = 0
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "push" then
+			count = count + 1
+		else
+			skynet.ret(skynet.pack(count))
+		end
+	end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, targets, n)
+		for i=1,n do
+			for _, t in ipairs(targets) do
+				skynet.send(t, "lua", "push")
+			end
+			if i % 10 == 0 then
+				skynet.yield()
+			end
+		end
+		skynet.ret()
+	end)
+end)
+
+elseif mode == "idle" then
+
+skynet.start(function() end)
+
+else
+
+skynet.start(function()
+	local targets = {}
+	for i=1,8 do
+		targets[i] = skynet.newservice(SERVICE_NAME, "target")
+	end
+	local n = 5000
+	local nsender = 4
+	local done = 0
+	for i=1,nsender do
+		local sender = skynet.newservice(SERVICE_NAME, "sender")
+		skynet.fork(function()
+			skynet.call(sender, "lua", targets, n)
+			done = done + 1
+		end)
+	end
+	local idle = {}
+	local ti = skynet.now()
+	for i=1,2000 do
+		idle[i] = skynet.newservice(SERVICE_NAME, "idle")
+	end
+	print(string.format("launch %d services in %d cs", #idle, skynet.now() - ti))
+	while done < nsender do
+		skynet.sleep(1)
+	end
+	for _, t in ipairs(targets) do
+		local count = skynet.call(t, "lua", "count")
+		assert(count == n * nsender, count)
+	end
+	for _, s in ipairs(idle) do
+		skynet.kill(s)
+	end
+	print("handle OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,126 @@
+-- Bounded mailbox test
+-- Usage : set start = "testmailbox" in config.
+-- A slow consumer with a mailbox cap is flooded with each policy, its queue must stay bounded.
+-- Requests dropped by drop_newest/drop_oldest are never answered, so wait for the queue to drain before a call.
+-- Socket messages are never dropped, a slow reader with a full mailbox still gets every byte.
+local skynet = require "skynet"
+local socket = require "socket"
+
+local mode = ...
+local port = 8005
+
+if mode == "reader" then
+
+skynet.start(function()
+	local total = 0
+	skynet.mailbox(1, "drop_newest")
+	local listen = socket.listen("127.0.0.1", port)
+	socket.start(listen, function(id)
+		socket.close(listen)
+		socket.start(id)
+		while true do
+			local str = socket.read(id)
+			if not str then
+				break
+			end
+			local n = 0
+			for i=1,20000 do	-- slow reader
+				n = n + i
+			end
+			total = total + #str
+		end
+		socket.close(id)
+	end)
+	skynet.dispatch("lua", function()
+		skynet.ret(skynet.pack(total))
+	end)
+end)
+
+elseif mode == "consumer" then
+
+skynet.start(function()
+	local count = 0
+	skynet.dispatch("lua", function(_,_, cmd, cap, policy)
+		if cmd == "push" then
+			local n = 0
+			for i=1,20000 do	-- slow consumer
+				n = n + i
+			end
+			count = count + 1
+		elseif cmd == "mailbox" then
+			skynet.mailbox(cap, policy)
+			skynet.ret()
+			local ti = skynet.now() + 20
+			while skynet.now() < ti do end	-- busy, the flood is queued meanwhile
+		elseif cmd == "stat" then
+			local stat = skynet.mailbox_stat()
+			stat.count = count
+			stat.mqlen = skynet.mqlen()
+			count = 0
+			skynet.ret(skynet.pack(stat))
+		end
+	end)
+end)
+
+else
+
+local CAP = 100
+local N = 1000
+
+local function flood(policy)
+	local c = skynet.newservice(SERVICE_NAME, "consumer")
+	skynet.call(c, "lua", "mailbox", CAP, policy)
+	local failed = 0
+	for i=1,N do
+		if not skynet.send(c, "lua", "push") then
+			failed = failed + 1
+		end
+	end
+	local backpressure = skynet.backpressure()
+	skynet.sleep(50)	-- let the consumer drain its queue
+	local stat = skynet.call(c, "lua", "stat")
+	skynet.kill(c)
+	print(string.format("%-12s received=%d drop_newest=%d drop_oldest=%d error=%d(failed %d) slowdown=%d(backpressure %d)",
+		policy, stat.count, stat.drop_newest, stat.drop_oldest, stat.error, failed, stat.slowdown, backpressure))
+	return stat, failed, backpressure
+end
+
+skynet.start(function()
+	local stat, failed, backpressure = flood "drop_newest"
+	assert(stat.count <= CAP + 1 and stat.drop_newest == N - stat.count)
+	stat, failed = flood "drop_oldest"
+	assert(stat.count <= CAP + 1 and stat.drop_oldest == N - stat.count)
+	stat, failed = flood "error"
+	assert(stat.count <= CAP + 1 and stat.error == failed and failed == N - stat.count)
+	stat, failed, backpressure = flood "slowdown"
+	assert(stat.count == N and stat.slowdown == backpressure and backpressure > 0)
+
+	-- a call rejected by a full mailbox fails instead of hanging
+	local c = skynet.newservice(SERVICE_NAME, "consumer")
+	skynet.call(c, "lua", "mailbox", 1, "error")
+	for i=1,10 do
+		skynet.send(c, "lua", "push")
+	end
+	assert(not pcall(skynet.call, c, "lua", "stat"))
+	skynet.kill(c)
+
+	local r = skynet.newservice(SERVICE_NAME, "reader")
+	local id = socket.open("127.0.0.1", port)
+	local data = string.rep("x", 100)
+	for i=1,N do
+		socket.write(id, data)
+		if i % 10 == 0 then
+			skynet.yield()	-- many small socket messages
+		end
+	end
+	socket.close(id)
+	skynet.sleep(100)	-- let the reader drain its queue
+	local total = skynet.call(r, "lua")
+	print("socket data through a full mailbox", total)
+	assert(total == N * #data, total)
+	skynet.kill(r)
+	print("mailbox OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,30 @@
+-- Millisecond timer test
+-- Usage : set start = "testmstimer" and timer_resolution = 1 in config.
+-- 200 sleeps of 2ms take about 40cs with 1ms ticks (each one is rounded up to 1 tick, 200cs, with 10ms ticks).
+local skynet = require "skynet"
+
+skynet.start(function()
+	local n = 200
+	local ti = skynet.now()
+	for i=1,n do
+		skynet.sleep_ms(2)
+	end
+	ti = skynet.now() - ti
+	print(string.format("sleep_ms(2) x %d : %d cs", n, ti))
+
+	-- the centisecond api keeps its meaning
+	ti = skynet.now()
+	skynet.sleep(20)
+	local cs = skynet.now() - ti
+	print(string.format("sleep(20) : %d cs", cs))
+	assert(cs >= 20 and cs < 30, cs)
+
+	local order = {}
+	skynet.timeout_ms(30, function() table.insert(order, 30) end)
+	skynet.timeout_ms(10, function() table.insert(order, 10) end)
+	skynet.timeout_ms(20, function() table.insert(order, 20) end)
+	skynet.sleep(10)
+	assert(table.concat(order, " ") == "10 20 30", table.concat(order, " "))
+	print("mstimer OK")
+	skynet.exit()
+end)
@@ -0,0 +1,68 @@
+-- Local name registry test
+-- Usage : set start = "testname" in config.
+-- Sends by name go through the name cache of the sender, it must follow a name to its new owner after retire.
+local skynet = require "skynet"
+
+local mode, id = ...
+
+if mode == "echo" then
+
+skynet.start(function()
+	local count = 0
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "push" then
+			count = count + 1
+		else
+			skynet.ret(skynet.pack(id, count))
+		end
+	end)
+end)
+
+elseif mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, n)
+		local ti = skynet.now()
+		for i=1,n do
+			skynet.send(".echo", "lua", "push")
+		end
+		ti = math.max(skynet.now() - ti, 1)
+		skynet.ret(skynet.pack(skynet.call(".echo", "lua", "count")))
+		print(string.format("name send : %d in %d cs, %d per second", n, ti, math.floor(n * 100 / ti)))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	-- enough names to grow the index a few times
+	local others = {}
+	for i=1,100 do
+		local s = skynet.newservice(SERVICE_NAME, "echo", i)
+		skynet.name(".echo" .. i, s)
+		others[i] = s
+	end
+	for i=1,100,7 do
+		assert(skynet.localname(".echo" .. i) == others[i])
+	end
+
+	local sender = skynet.newservice(SERVICE_NAME, "sender")
+	local a = skynet.newservice(SERVICE_NAME, "echo", "a")
+	skynet.name(".echo", a)
+	local id, count = skynet.call(sender, "lua", 20000)
+	assert(id == "a" and count == 20000, id)
+
+	skynet.kill(a)
+	assert(skynet.localname(".echo") == nil)
+	local ok = pcall(skynet.call, sender, "lua", 1)	-- the sender logs "call to invalid address"
+	assert(not ok, "send to a retired name")
+
+	local b = skynet.newservice(SERVICE_NAME, "echo", "b")
+	skynet.name(".echo", b)
+	local id, count = skynet.call(sender, "lua", 1000)
+	assert(id == "b" and count == 1000, id)
+	print("name OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,51 @@
+-- Ping-pong benchmark of the message payload allocator, each size runs with plain skynet_malloc then with the caches.
+-- Usage : set start = "testpayload" in config.
+local skynet = require "skynet"
+local memory = require "memory"
+
+local mode = ...
+
+if mode == "echo" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, data)
+		skynet.ret(skynet.pack(data))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local echo = skynet.newservice(SERVICE_NAME, "echo")
+	local n = 20000
+	local function run(size)
+		local data = string.rep("x", size)
+		local before = memory.payload()
+		local ti = skynet.now()
+		for i=1,n do
+			local r = skynet.call(echo, "lua", data)
+			assert(#r == size)
+		end
+		ti = skynet.now() - ti
+		local s = memory.payload()
+		local alloc = (s.alloc_hit + s.alloc_depot + s.alloc_miss + s.alloc_large)
+			- (before.alloc_hit + before.alloc_depot + before.alloc_miss + before.alloc_large)
+		local hit = (s.alloc_hit + s.alloc_depot) - (before.alloc_hit + before.alloc_depot)
+		return math.max(ti, 1), alloc > 0 and hit * 100 / alloc or 0
+	end
+	local enable = memory.payload_cache(false)
+	for _, size in ipairs { 16, 256, 4096 } do
+		memory.payload_cache(false)
+		local malloc_ti = run(size)
+		memory.payload_cache(true)
+		local cache_ti, hit = run(size)
+		print(string.format("payload %5d bytes : %d round trips, skynet_malloc %d/s, cache %d/s (hit %.1f%%), %.2fx",
+			size, n, math.floor(n * 100 / malloc_ti), math.floor(n * 100 / cache_ti), hit, malloc_ti / cache_ti))
+		assert(hit > 0)
+	end
+	memory.payload_cache(enable)
+	print("payload OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,76 @@
+-- Priority class test
+-- Usage : set start = "testpriority" in config.
+-- Busy services keep the workers saturated, then an echo service is called at high priority.
+-- The high class should show a much lower queueing delay than the normal class.
+-- The delay is measured after skynet.priority_stat(true).
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "busy" then
+
+skynet.start(function()
+	local running = true
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "loop" then
+			if running then
+				local n = 0
+				for i=1,20000 do
+					n = n + i
+				end
+				skynet.send(skynet.self(), "lua", "loop")
+			end
+		elseif cmd == "stop" then
+			running = false
+			skynet.ret()
+		end
+	end)
+end)
+
+elseif mode == "echo" then
+
+skynet.start(function()
+	skynet.priority "high"
+	skynet.dispatch("lua", function(_,_, n)
+		skynet.ret(skynet.pack(n))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	skynet.priority "high"
+	local busy = {}
+	for i=1,64 do
+		busy[i] = skynet.newservice(SERVICE_NAME, "busy")
+		skynet.send(busy[i], "lua", "loop")
+	end
+	local echo = skynet.newservice(SERVICE_NAME, "echo")
+	assert(skynet.call(echo, "debug", "STAT").priority == "high")
+	skynet.priority("low", busy[1])
+	assert(skynet.call(busy[1], "debug", "STAT").priority == "low")
+	skynet.priority("normal", busy[1])
+
+	skynet.priority_stat(true)
+	local c0, t0 = skynet.priority_stat "high"
+	local n0, u0 = skynet.priority_stat "normal"
+	for i=1,1000 do
+		assert(skynet.call(echo, "lua", i) == i)
+	end
+	local c1, t1, m1 = skynet.priority_stat "high"
+	local n1, u1, m2 = skynet.priority_stat "normal"
+	skynet.priority_stat(false)
+	local high = (t1 - t0) / (c1 - c0) / 1000
+	local normal = (u1 - u0) / (n1 - n0) / 1000
+	print(string.format("queueing delay (us) high avg=%.1f max=%.1f, normal avg=%.1f max=%.1f",
+		high, m1 / 1000, normal, m2 / 1000))
+	for i=1,#busy do
+		skynet.call(busy[i], "lua", "stop")
+		skynet.kill(busy[i])
+	end
+	skynet.kill(echo)
+	print("priority", high < normal and "OK" or "FAIL")
+	skynet.exit()
+end)
+
+end
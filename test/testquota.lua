@@ -0,0 +1,70 @@
+-- Per service memory limits : the hog crosses its soft limit (a warning) and fails at its hard limit
+-- with a memory error of its own, the other services go on.
+local skynet = require "skynet"
+local memory = require "memory"
+
+local mode = ...
+
+if mode == "hog" then
+
+local warned
+
+skynet.start(function()
+	skynet.memory_warning(function(used)
+		warned = used
+	end)
+	skynet.dispatch("lua", function(_,_, soft, hard)
+		local used = memory.service(skynet.self())
+		memory.limit(skynet.self(), used + soft, used + hard)
+		local t = {}
+		local ok, err = pcall(function()
+			for i=1,1000000 do
+				t[i] = string.rep(tostring(i), 100)
+			end
+		end)
+		local n = #t
+		t = nil
+		collectgarbage()
+		skynet.sleep(0)	-- the warning is a message
+		skynet.ret(skynet.pack(ok, tostring(err), n, warned))
+	end)
+end)
+
+elseif mode == "idle" then
+
+skynet.start(function() end)
+
+else
+
+skynet.start(function()
+	local hog = skynet.newservice(SERVICE_NAME, "hog")
+	local soft, hard = 2 * 1048576, 4 * 1048576
+	local ok, err, n, warned = skynet.call(hog, "lua", soft, hard)
+	print(string.format("hog stopped after %d strings : %s, warned at %s", n, err, warned))
+	assert(not ok and err:find("not enough memory"), err)
+	assert(warned, "no memory warning")
+	local used, peak, s, h = memory.service(hog)
+	print(string.format("hog memory : current %dK peak %dK", math.floor(used/1024), math.floor(peak/1024)))
+	assert(peak >= used and peak <= h)
+	-- the hog is still alive, and back under its limit
+	local ok2, _, n2 = skynet.call(hog, "lua", soft, hard)
+	assert(not ok2 and n2 > 0)
+	-- memory.services lists every service, even more than its first buffer holds
+	local idle = {}
+	for i=1,1100 do
+		idle[i] = skynet.newservice(SERVICE_NAME, "idle")
+	end
+	local services = memory.services()
+	for _, s in ipairs(idle) do
+		assert(services[s], string.format("%08x is not listed", s))
+	end
+	local hog_used = services[hog][1]
+	print(string.format("%d idle services listed, hog current %dK", #idle, math.floor(hog_used/1024)))
+	for _, s in ipairs(idle) do
+		skynet.kill(s)
+	end
+	print("quota OK")
+	skynet.exit()
+end)
+
+end
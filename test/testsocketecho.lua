@@ -0,0 +1,59 @@
+-- Echo round trips through tcp, the replies are written by the worker threads when the socket has nothing pending.
+-- The packets are numbered, the replies must come back byte for byte in order.
+local skynet = require "skynet"
+local socket = require "socket"
+
+local mode = ...
+local port = 8003
+local n = 20000
+local pipeline = 4	-- packets in flight, the server replies to them in order
+
+local function packet(i)
+	return string.format("%015d\n", i)
+end
+
+if mode == "server" then
+
+skynet.start(function()
+	local listen = socket.listen("127.0.0.1", port)
+	socket.start(listen, function(id)
+		socket.close(listen)
+		skynet.fork(function()
+			socket.start(id)
+			while true do
+				local str = socket.read(id)
+				if not str then
+					break
+				end
+				socket.write(id, str)
+			end
+			socket.close(id)
+		end)
+	end)
+end)
+
+else
+
+skynet.start(function()
+	skynet.newservice(SERVICE_NAME, "server")
+	local id = socket.open("127.0.0.1", port)
+	local ti = skynet.now()
+	for i=1,n,pipeline do
+		local expect = {}
+		for j=i,i+pipeline-1 do
+			local p = packet(j)
+			socket.write(id, p)
+			table.insert(expect, p)
+		end
+		expect = table.concat(expect)
+		local r = socket.read(id, #expect)
+		assert(r == expect, r)
+	end
+	ti = skynet.now() - ti
+	print(string.format("%d round trips in %d cs, %.1f us each", n, ti, ti * 10000 / n))
+	socket.close(id)
+	print("socket echo OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,111 @@
+-- Many small packets through one tcp connection, high and low priority mixed.
+-- Each priority keeps its order and no packet is split by another, the reader checks every byte.
+local skynet = require "skynet"
+local socket = require "socket"
+
+local mode = ...
+local port = 8002
+local n = 200000
+local size = 64
+
+-- the i-th packet of a priority ("H" or "L")
+local function packet(tag, i)
+	return tag .. string.format("%07d", i) .. string.rep(string.char(97 + i % 26), size - 9) .. "\n"
+end
+
+if mode == "reader" then
+
+local total = 0
+local result
+local err
+
+local function read(id)
+	socket.start(id)
+	local expect = { H = 1, L = 1 }
+	local rest = ""
+	while total < n * size do
+		local str = socket.read(id)
+		if not str then
+			break
+		end
+		total = total + #str
+		rest = rest .. str
+		local offset = 1
+		while offset + size - 1 <= #rest do
+			local p = rest:sub(offset, offset + size - 1)
+			local tag = p:sub(1,1)
+			local i = expect[tag]
+			if i == nil or p ~= packet(tag, i) then
+				err = err or string.format("unexpected packet at %d : %q", total - #rest + offset - 1, p)
+			else
+				expect[tag] = i + 1
+			end
+			offset = offset + size
+		end
+		rest = rest:sub(offset)
+	end
+	socket.close(id)
+	if result then
+		result(true, total, err)
+	end
+	result = false
+end
+
+skynet.start(function()
+	local listen = socket.listen("127.0.0.1", port)
+	socket.start(listen, function(id)
+		socket.close(listen)
+		skynet.sleep(10)	-- let the kernel buffer fill up, the rest is queued to the write lists
+		skynet.fork(read, id)
+	end)
+	skynet.dispatch("lua", function()
+		if result == false then
+			skynet.ret(skynet.pack(total, err))
+		else
+			result = skynet.response()
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local reader = skynet.newservice(SERVICE_NAME, "reader")
+	-- make the packets first, so that they are written faster than they are read
+	local packets = {}
+	local h, l = 0, 0
+	for i=1,n do
+		if i % 3 == 0 then
+			l = l + 1
+			packets[i] = packet("L", l)
+		else
+			h = h + 1
+			packets[i] = packet("H", h)
+		end
+	end
+	local id = socket.open("127.0.0.1", port)
+	local ti = skynet.now()
+	for i=1,n do
+		if i % 3 == 0 then
+			socket.lwrite(id, packets[i])
+		else
+			socket.write(id, packets[i])
+		end
+		if i % 1000 == 0 then
+			socket.write(id, "")	-- empty buffers in the write lists
+		end
+	end
+	socket.write(id, "")	-- the last buffer queued is empty
+	local total, err = skynet.call(reader, "lua")
+	ti = skynet.now() - ti
+	print(string.format("%d packets in %d cs, %d/s", n, ti, math.floor(n * 100 / math.max(ti, 1))))
+	local stat = socket.stat()
+	print(string.format("writev %d calls, %.1f buffers per call", stat.writev, stat.buffers_per_writev))
+	assert(err == nil, err)
+	assert(total == n * size, total)
+	socket.close(id)
+	print("socket send OK")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,68 @@
+-- Usage : set socket_thread = 4 in config. Connections are spread across the socket threads by id.
+local skynet = require "skynet"
+local socket = require "socket"
+
+local mode = ...
+local port = 8004
+local n = 64
+local round = 100
+
+if mode == "server" then
+
+skynet.start(function()
+	local listen = socket.listen("127.0.0.1", port)
+	socket.start(listen, function(id)
+		skynet.fork(function()
+			socket.start(id)
+			while true do
+				local str = socket.read(id)
+				if not str then
+					break
+				end
+				socket.write(id, str)
+			end
+			socket.close(id)
+		end)
+	end)
+end)
+
+else
+
+local function echo(id, i)
+	for j=1,round do
+		local str = string.format("%d:%d\n", i, j)
+		socket.write(id, str)
+		assert(socket.readline(id) .. "\n" == str)
+	end
+end
+
+skynet.start(function()
+	skynet.newservice(SERVICE_NAME, "server")
+	local conn = {}
+	for i=1,n do
+		conn[i] = socket.open("127.0.0.1", port)
+	end
+	local done = 0
+	for i=1,n do
+		skynet.fork(function()
+			echo(conn[i], i)
+			done = done + 1
+		end)
+	end
+	while done < n do
+		skynet.sleep(1)
+	end
+	local total = socket.stat()
+	for i=1,total.thread do
+		local stat = socket.stat(i)
+		print(string.format("socket thread %d : %d sockets, %d events, %d commands", i, stat.socket, stat.event, stat.command))
+	end
+	print(string.format("%d connections x %d round trips, %d sockets", n, round, total.socket))
+	for i=1,n do
+		socket.close(conn[i])
+	end
+	print("socket shard OK")
+	skynet.exit()
+end)
+
+end
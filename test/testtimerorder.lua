@@ -0,0 +1,67 @@
+-- Timer insertion from many services at the same time
+-- Usage : set start = "testtimerorder" in config.
+-- Each service arms timers of the same delay in a row, they must fire in the order they were armed.
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "worker" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(_,_, n)
+		local fired = 0
+		local co = coroutine.running()
+		for i=1,n do
+			skynet.timeout(i % 3 + 1, function()
+				fired = fired + 1
+				if fired == n then
+					skynet.wakeup(co)
+				end
+			end)
+		end
+		-- same delay in a row
+		local last = 0
+		local order = true
+		for i=1,n do
+			skynet.timeout(5, function()
+				if last ~= i - 1 then
+					order = false
+				end
+				last = i
+			end)
+		end
+		skynet.wait()
+		skynet.sleep(10)
+		skynet.ret(skynet.pack(order and last == n))
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local worker_n = 32
+	local n = 1000
+	local worker = {}
+	for i=1,worker_n do
+		worker[i] = skynet.newservice(SERVICE_NAME, "worker")
+	end
+	local ti = skynet.now()
+	local done = 0
+	local ok = true
+	local co = coroutine.running()
+	for i=1,worker_n do
+		skynet.fork(function()
+			ok = skynet.call(worker[i], "lua", n) and ok
+			done = done + 1
+			if done == worker_n then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	print(string.format("%d timers from %d services in %d cs", worker_n * n * 2, worker_n, skynet.now() - ti))
+	print("timer order", ok and "OK" or "FAILED")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,39 @@
+-- Bursts of udp packages, the socket thread reads them with recvmmsg and still delivers them one by one.
+local skynet = require "skynet"
+local socket = require "socket"
+
+local port = 8766
+local n = 200
+local burst = 20
+
+skynet.start(function()
+	local count = 0
+	local last = 0
+	local server = socket.udp(function(data, sz, from)
+		local str = skynet.tostring(data, sz)
+		local i = tonumber(str:match("^udp (%d+)$"))
+		assert(i and i > last, str)	-- the packages read at once keep their order
+		assert(socket.udp_address(from) == "127.0.0.1")
+		last = i
+		count = count + 1
+	end, "127.0.0.1", port)
+
+	local c = socket.udp(function() end)
+	socket.udp_connect(c, "127.0.0.1", port)
+	for i=1,n do
+		socket.write(c, "udp " .. i)
+		if i % burst == 0 then
+			skynet.sleep(1)
+		end
+	end
+	skynet.sleep(50)
+	local stat = socket.stat()
+	print(string.format("%d/%d udp packages, %d recvmmsg calls, %.1f packages per call",
+		count, n, stat.recvmmsg, stat.recvmmsg > 0 and stat.recvmmsg_packet / stat.recvmmsg or 0))
+	assert(count == n, "udp packages lost")
+	assert(stat.recvmmsg_packet > stat.recvmmsg, "no batch")	-- some calls read more than one package
+	socket.close(c)
+	socket.close(server)
+	print("udp batch OK")
+	skynet.exit()
+end)
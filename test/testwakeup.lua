@@ -0,0 +1,36 @@
+-- A message sent by a service in a long callback must not wait for the callback to finish :
+-- the receiver's queue is pushed to the sender's local run queue, and a parked worker is woken to steal it.
+-- Usage : set start = "testwakeup" and thread >= 2 in config.
+local skynet = require "skynet"
+
+local mode = ...
+
+if mode == "receiver" then
+
+skynet.start(function()
+	local recv
+	skynet.dispatch("lua", function(_,_, cmd)
+		if cmd == "ping" then
+			recv = skynet.now()
+		else
+			skynet.ret(skynet.pack(recv))
+		end
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local receiver = skynet.newservice(SERVICE_NAME, "receiver")
+	skynet.sleep(10)	-- let the other workers park
+	local ti = skynet.now()
+	skynet.send(receiver, "lua", "ping")
+	while skynet.now() - ti < 50 do end	-- busy for 0.5s without yielding
+	local recv = skynet.call(receiver, "lua", "when")
+	print(string.format("received after %d cs", recv - ti))
+	assert(recv - ti < 25, recv - ti)
+	print("wakeup OK")
+	skynet.exit()
+end)
+
+end